@@ -0,0 +1,72 @@
+//
+// Created by zr on 23-7-22.
+//
+#include "mqtt_histogram.h"
+#include "mqtt_util.h"
+#include <string.h>
+
+void tmq_histogram_init(tmq_histogram_t* histogram)
+{
+    bzero(histogram, sizeof(tmq_histogram_t));
+}
+
+static int bucket_index(int64_t value)
+{
+    if(value < HISTOGRAM_SUB_BUCKETS)
+        return value < 0 ? 0 : (int) value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int) ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static int64_t bucket_upper_bound(int idx)
+{
+    if(idx < HISTOGRAM_SUB_BUCKETS)
+        return idx;
+    int shift = (idx >> HISTOGRAM_SUB_BITS) - 1;
+    int64_t lower = (int64_t) (HISTOGRAM_SUB_BUCKETS + (idx & (HISTOGRAM_SUB_BUCKETS - 1))) << shift;
+    return lower + ((int64_t) 1 << shift) - 1;
+}
+
+void tmq_histogram_record(tmq_histogram_t* histogram, int64_t value)
+{
+    incrementAndGet(histogram->buckets[bucket_index(value)], 1);
+    incrementAndGet(histogram->count, 1);
+    int64_t max = atomicGet(histogram->max);
+    while(value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, 0,
+                                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+void tmq_histogram_drain(tmq_histogram_t* src, tmq_histogram_t* dst)
+{
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        if(atomicGet(src->buckets[i]))
+            dst->buckets[i] += atomicExchange(src->buckets[i], 0);
+    }
+    dst->count += atomicExchange(src->count, 0);
+    int64_t max = atomicExchange(src->max, 0);
+    if(max > dst->max)
+        dst->max = max;
+}
+
+int64_t tmq_histogram_percentile(tmq_histogram_t* histogram, double percentile)
+{
+    uint64_t total = 0;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += histogram->buckets[i];
+    if(!total) return 0;
+    uint64_t rank = (uint64_t) (total * percentile / 100.0);
+    if(rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if(seen > rank)
+        {
+            int64_t upper = bucket_upper_bound(i);
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
@@ -0,0 +1,30 @@
+//
+// Created by zr on 23-7-22.
+//
+
+#ifndef TINYMQTT_MQTT_HISTOGRAM_H
+#define TINYMQTT_MQTT_HISTOGRAM_H
+#include <stdint.h>
+
+/* every power of two is split into 2^HISTOGRAM_SUB_BITS buckets, so a value is off by at most 1/8 */
+#define HISTOGRAM_SUB_BITS      3
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/* a log-linear histogram of non-negative values(e.g. latencies in us).
+ * it's updated with atomic operations, so one thread can record while another reads and resets it */
+typedef struct tmq_histogram_s
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    int64_t max;
+} tmq_histogram_t;
+
+void tmq_histogram_init(tmq_histogram_t* histogram);
+void tmq_histogram_record(tmq_histogram_t* histogram, int64_t value);
+/* move all the values recorded in src into dst, src is reset */
+void tmq_histogram_drain(tmq_histogram_t* src, tmq_histogram_t* dst);
+/* the upper bound of the bucket containing the given percentile(0-100), 0 if the histogram is empty */
+int64_t tmq_histogram_percentile(tmq_histogram_t* histogram, double percentile);
+
+#endif //TINYMQTT_MQTT_HISTOGRAM_H
@@ -8,12 +8,10 @@
 #include <stdio.h>
 
 /* using murmurhash for str hashing */
-unsigned hash_str(const void* key)
+unsigned hash_bytes(const void* data, size_t len)
 {
-    const char* strkey = *(const char**)key;
     const uint64_t m = UINT64_C(0xc6a4a7935bd1e995);
-    const size_t len = strlen(strkey);
-    const unsigned char *p = (const unsigned char *) strkey;
+    const unsigned char *p = (const unsigned char *) data;
     const unsigned char *end = p + (len & ~(uint64_t) 0x7);
     uint64_t h = (len * m);
 
@@ -57,6 +55,12 @@ unsigned hash_str(const void* key)
     return (uint32_t) h;
 }
 
+unsigned hash_str(const void* key)
+{
+    const char* strkey = *(const char**)key;
+    return hash_bytes(strkey, strlen(strkey));
+}
+
 int equal_str(const void* k1, const void* k2)
 {
     const char* s1 = *(const char**)k1;
@@ -227,6 +231,7 @@ tmq_map_base_t* tmq_map_new_(uint32_t cap, uint32_t factor,
         return NULL;
     }
     m->cap = cap;
+    m->size = 0;
     m->remap_thresh = (uint32_t)(m->cap * factor / 100);
 //    printf("map cap = %u\n", m->cap);
     return m;
@@ -301,6 +306,13 @@ void tmq_map_free_(tmq_map_base_t* m)
     free(m);
 }
 
+size_t tmq_map_memory_(tmq_map_base_t* m)
+{
+    if(!m) return 0;
+    return sizeof(tmq_map_base_t) + m->cap * sizeof(tmq_map_entry_t*) +
+           m->size * (sizeof(tmq_map_entry_t) + m->key_size + m->value_size);
+}
+
 uint32_t tmq_next_bucket(tmq_map_base_t* m, uint32_t cur)
 {
     for(; cur < m->cap; cur++)
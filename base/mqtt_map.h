@@ -95,6 +95,8 @@ typedef struct tmq_map_iter_s
 
 #define tmq_map_free(m) tmq_map_free_((m).base)
 
+#define tmq_map_memory(m) tmq_map_memory_((m).base)
+
 #define tmq_map_iter(m) tmq_map_iter_((m).base)
 #define tmq_map_next(m, iter) tmq_map_iter_next_((m).base, &(iter))
 #define tmq_map_has_next(iter)  iter.bucket_idx != UINT32_MAX
@@ -107,9 +109,12 @@ void* tmq_map_get_(tmq_map_base_t* m, const void* key);
 void tmq_map_erase_(tmq_map_base_t* m, const void* key);
 void tmq_map_clear_(tmq_map_base_t* m);
 void tmq_map_free_(tmq_map_base_t* m);
+/* heap bytes held by the map, not counting string keys */
+size_t tmq_map_memory_(tmq_map_base_t* m);
 tmq_map_iter_t tmq_map_iter_(tmq_map_base_t* m);
 void tmq_map_iter_next_(tmq_map_base_t* m, tmq_map_iter_t* iter);
 
+unsigned hash_bytes(const void* data, size_t len);
 unsigned hash_str(const void* key);
 int equal_str(const void* k1, const void* k2);
 
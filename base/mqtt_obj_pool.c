@@ -0,0 +1,151 @@
+//
+// Created by zr on 23-7-27.
+//
+#include "mqtt_obj_pool.h"
+#include "mqtt_util.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct tmq_obj_header_s
+{
+    union
+    {
+        /* NULL if the object isn't pooled */
+        tmq_obj_pool_t* owner;
+        tmq_obj_header_t* next;
+    };
+    uint32_t obj_class;
+    uint32_t type;
+};
+
+static const char* obj_type_names[OBJ_TYPES] = {
+        "tcp_conn", "event_handler", "session", "sending_packet", "timer", "packet"
+};
+
+static __thread tmq_obj_pool_t* local_pool;
+
+void tmq_obj_pool_init(tmq_obj_pool_t* pool, size_t limit)
+{
+    bzero(pool, sizeof(tmq_obj_pool_t));
+    pool->limit = limit;
+}
+
+void tmq_obj_pool_attach(tmq_obj_pool_t* pool)
+{
+    local_pool = pool;
+}
+
+const char* tmq_obj_type_name(tmq_obj_type type)
+{
+    return type < OBJ_TYPES ? obj_type_names[type] : "unknown";
+}
+
+static size_t class_bytes(uint32_t obj_class)
+{
+    return (obj_class + 1) * OBJ_POOL_ALIGN;
+}
+
+static void pool_put(tmq_obj_pool_t* pool, tmq_obj_header_t* obj)
+{
+    size_t bytes = class_bytes(obj->obj_class);
+    if(pool->held_bytes + bytes > pool->limit)
+    {
+        free(obj);
+        return;
+    }
+    obj->next = pool->free_lists[obj->obj_class];
+    pool->free_lists[obj->obj_class] = obj;
+    atomicSet(pool->held_bytes, pool->held_bytes + bytes);
+}
+
+/* take back the objects freed by other threads */
+static void pool_collect_remote(tmq_obj_pool_t* pool)
+{
+    tmq_obj_header_t* obj = atomicExchange(pool->remote_frees, NULL);
+    while(obj)
+    {
+        tmq_obj_header_t* next = obj->next;
+        pool_put(pool, obj);
+        obj = next;
+    }
+}
+
+void* tmq_obj_alloc(tmq_obj_type type, size_t size)
+{
+    tmq_obj_pool_t* pool = local_pool;
+    uint32_t obj_class = (sizeof(tmq_obj_header_t) + size - 1) / OBJ_POOL_ALIGN;
+    int pooled = pool && obj_class < OBJ_POOL_CLASSES;
+    tmq_obj_header_t* obj = NULL;
+    if(pooled)
+    {
+        incrementAndGet(pool->allocs[type], 1);
+        if(!pool->free_lists[obj_class] && atomicGet(pool->remote_frees))
+            pool_collect_remote(pool);
+        obj = pool->free_lists[obj_class];
+        if(obj)
+        {
+            pool->free_lists[obj_class] = obj->next;
+            atomicSet(pool->held_bytes, pool->held_bytes - class_bytes(obj_class));
+            if(pool->held_bytes < pool->idle_bytes)
+                pool->idle_bytes = pool->held_bytes;
+        }
+    }
+    if(!obj)
+    {
+        if(pool)
+            incrementAndGet(pool->mallocs[type], 1);
+        obj = malloc(pooled ? class_bytes(obj_class) : sizeof(tmq_obj_header_t) + size);
+        if(!obj)
+            return NULL;
+    }
+    obj->owner = pooled ? pool : NULL;
+    obj->obj_class = obj_class;
+    obj->type = type;
+    return obj + 1;
+}
+
+void tmq_obj_free(void* ptr)
+{
+    if(!ptr) return;
+    tmq_obj_header_t* obj = (tmq_obj_header_t*) ptr - 1;
+    tmq_obj_pool_t* pool = obj->owner;
+    if(!pool || atomicGet(pool->closed))
+    {
+        free(obj);
+        return;
+    }
+    if(pool == local_pool)
+    {
+        pool_put(pool, obj);
+        return;
+    }
+    obj->next = atomicGet(pool->remote_frees);
+    while(!atomicCompareExchange(pool->remote_frees, obj->next, obj));
+    incrementAndGet(pool->remote_freed, 1);
+}
+
+void tmq_obj_pool_trim(tmq_obj_pool_t* pool)
+{
+    pool_collect_remote(pool);
+    size_t released = 0;
+    for(int c = OBJ_POOL_CLASSES - 1; c >= 0 && released < pool->idle_bytes; c--)
+    {
+        while(pool->free_lists[c] && released < pool->idle_bytes)
+        {
+            tmq_obj_header_t* obj = pool->free_lists[c];
+            pool->free_lists[c] = obj->next;
+            released += class_bytes(c);
+            free(obj);
+        }
+    }
+    atomicSet(pool->held_bytes, pool->held_bytes - released);
+    pool->idle_bytes = pool->held_bytes;
+}
+
+void tmq_obj_pool_destroy(tmq_obj_pool_t* pool)
+{
+    atomicSet(pool->closed, 1);
+    pool_collect_remote(pool);
+    pool->idle_bytes = pool->held_bytes;
+    tmq_obj_pool_trim(pool);
+}
\ No newline at end of file
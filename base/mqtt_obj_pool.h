@@ -0,0 +1,61 @@
+//
+// Created by zr on 23-7-27.
+//
+
+#ifndef TINYMQTT_MQTT_OBJ_POOL_H
+#define TINYMQTT_MQTT_OBJ_POOL_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* objects up to 1KB(header included) are cached in size classes of 16 bytes */
+#define OBJ_POOL_ALIGN              16
+#define OBJ_POOL_CLASSES            64
+#define OBJ_POOL_DEFAULT_LIMIT      (1024 * 1024)
+
+typedef enum tmq_obj_type_e
+{
+    OBJ_TCP_CONN,
+    OBJ_EVENT_HANDLER,
+    OBJ_SESSION,
+    OBJ_SENDING_PACKET,
+    OBJ_TIMER,
+    OBJ_PACKET,
+    OBJ_TYPES
+} tmq_obj_type;
+
+typedef struct tmq_obj_header_s tmq_obj_header_t;
+
+/* free objects of a thread. objects are given back to the pool of the thread that allocated them,
+ * the ones freed by other threads are queued in remote_frees and taken back in one go by the owner.
+ * only the owner thread changes the free lists, the counters are read by other threads */
+typedef struct tmq_obj_pool_s
+{
+    tmq_obj_header_t* free_lists[OBJ_POOL_CLASSES];
+    tmq_obj_header_t* remote_frees;
+    /* objects freed after the pool is destroyed go back to malloc */
+    int closed;
+    /* bytes of the cached objects, objects released above limit are freed */
+    size_t held_bytes, limit;
+    /* the lowest held_bytes since the last trim */
+    size_t idle_bytes;
+    /* objects allocated by the owner thread, and those of them that came from malloc */
+    uint64_t allocs[OBJ_TYPES], mallocs[OBJ_TYPES];
+    /* objects freed by other threads */
+    uint64_t remote_freed;
+} tmq_obj_pool_t;
+
+void tmq_obj_pool_init(tmq_obj_pool_t* pool, size_t limit);
+/* objects allocated by the calling thread come from pool, without a pool(the default) they are malloc-ed */
+void tmq_obj_pool_attach(tmq_obj_pool_t* pool);
+/* free the objects that stayed idle since the last trim */
+void tmq_obj_pool_trim(tmq_obj_pool_t* pool);
+void tmq_obj_pool_destroy(tmq_obj_pool_t* pool);
+const char* tmq_obj_type_name(tmq_obj_type type);
+
+/* returns NULL if out of memory, the object isn't initialized. it can be freed by any thread */
+void* tmq_obj_alloc(tmq_obj_type type, size_t size);
+void tmq_obj_free(void* obj);
+
+#define tmq_obj_new(T, type) ((T*) tmq_obj_alloc(type, sizeof(T)))
+
+#endif //TINYMQTT_MQTT_OBJ_POOL_H
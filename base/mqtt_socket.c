@@ -74,6 +74,13 @@ int tmq_socket_tcp_no_delay(tmq_socket_t fd, int enable)
     return 0;
 }
 
+int tmq_socket_busy_poll(tmq_socket_t fd, int usec)
+{
+    if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, (socklen_t) sizeof(usec)) < 0)
+        return -1;
+    return 0;
+}
+
 int tmq_socket_local_addr(tmq_socket_t fd, tmq_socket_addr_t* addr)
 {
     socklen_t len = sizeof(tmq_socket_addr_t);
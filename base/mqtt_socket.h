@@ -17,6 +17,8 @@ int tmq_socket_reuse_addr(tmq_socket_t fd, int enable);
 int tmq_socket_reuse_port(tmq_socket_t fd, int enable);
 int tmq_socket_keepalive(tmq_socket_t fd, int enable);
 int tmq_socket_tcp_no_delay(tmq_socket_t fd, int enable);
+/* SO_BUSY_POLL, raising it above net.core.busy_poll needs CAP_NET_ADMIN, so failing isn't fatal */
+int tmq_socket_busy_poll(tmq_socket_t fd, int usec);
 int tmq_socket_local_addr(tmq_socket_t fd, tmq_socket_addr_t* addr);
 int tmq_socket_peer_addr(tmq_socket_t fd, tmq_socket_addr_t* addr);
 void tmq_socket_bind(tmq_socket_t fd, const char* ip, int port);
@@ -14,6 +14,9 @@
 #define atomicExchange(var, val)    __atomic_exchange_n(&(var), val, __ATOMIC_SEQ_CST)
 #define decrementAndGet(var, val)   __atomic_sub_fetch(&(var), val, __ATOMIC_SEQ_CST)
 #define incrementAndGet(var, val)   __atomic_add_fetch(&(var), val, __ATOMIC_SEQ_CST)
+/* stores desired in var if it equals expected, otherwise loads var into expected */
+#define atomicCompareExchange(var, expected, desired) \
+__atomic_compare_exchange_n(&(var), &(expected), desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
 
 #define mqtt_tid syscall(SYS_gettid)
 
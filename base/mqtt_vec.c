@@ -172,4 +172,26 @@ int tmq_vec_extend_(tmq_vec_base_t* v1, tmq_vec_base_t* v2)
     memcpy(tmq_vec_end_(v1), v2->data, tmq_vec_size_(v2) * v2->elem_size);
     tmq_vec_resize_(v1, size);
     return 0;
+}
+
+void tmq_vec_shrink_(tmq_vec_base_t* v)
+{
+    if(!v || v->cap == v->size) return;
+    if(!v->size)
+    {
+        free(v->data);
+        v->data = NULL;
+        v->cap = 0;
+        return;
+    }
+    void* data = realloc(v->data, v->size * v->elem_size);
+    if(!data) return;
+    v->data = data;
+    v->cap = v->size;
+}
+
+size_t tmq_vec_memory_(tmq_vec_base_t* v)
+{
+    if(!v) return 0;
+    return sizeof(tmq_vec_base_t) + v->cap * v->elem_size;
 }
\ No newline at end of file
@@ -60,6 +60,8 @@ struct                      \
 #define tmq_vec_resize(v, size) tmq_vec_resize_((v).base, size)
 #define tmq_vec_reserve(v, size) tmq_vec_reserve_((v).base, size)
 #define tmq_vec_extend(v1, v2) tmq_vec_extend_((v1).base, (v2).base)
+#define tmq_vec_shrink(v) tmq_vec_shrink_((v).base)
+#define tmq_vec_memory(v) tmq_vec_memory_((v).base)
 
 tmq_vec_base_t* tmq_base_init_(size_t elem_size);
 int tmq_vec_push_back_(tmq_vec_base_t* v, const void* elem);
@@ -78,5 +80,9 @@ int tmq_vec_resize_(tmq_vec_base_t* v, size_t size);
 int tmq_vec_reserve_(tmq_vec_base_t* v, size_t size);
 void tmq_vec_swap_(tmq_vec_base_t** v1, tmq_vec_base_t** v2);
 int tmq_vec_extend_(tmq_vec_base_t* v1, tmq_vec_base_t* v2);
+/* release the unused capacity, an empty vector frees its data */
+void tmq_vec_shrink_(tmq_vec_base_t* v);
+/* heap bytes held by the vector */
+size_t tmq_vec_memory_(tmq_vec_base_t* v);
 
 #endif //TINYMQTT_MQTT_VEC_H
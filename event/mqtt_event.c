@@ -4,6 +4,7 @@
 #include "mqtt_event.h"
 #include "tlog.h"
 #include "base/mqtt_util.h"
+#include "base/mqtt_obj_pool.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -14,7 +15,7 @@
 
 tmq_event_handler_t* tmq_event_handler_new(int fd, short events, tmq_event_cb cb, void* arg)
 {
-    tmq_event_handler_t* handler = malloc(sizeof(tmq_event_handler_t));
+    tmq_event_handler_t* handler = tmq_obj_new(tmq_event_handler_t, OBJ_EVENT_HANDLER);
     if(!handler)
         fatal_error("malloc() error: out of memory");
     bzero(handler, sizeof(tmq_event_handler_t));
@@ -25,22 +26,48 @@ tmq_event_handler_t* tmq_event_handler_new(int fd, short events, tmq_event_cb cb
     return handler;
 }
 
-void tmq_event_loop_init(tmq_event_loop_t* loop)
+/* an owner-only loop is used by the thread running it alone, so it isn't locked.
+ * before the loop runs it may still be set up by another thread */
+static void loop_lock(tmq_event_loop_t* loop)
 {
-    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-    if(loop->epoll_fd <= 0)
-        fatal_error("epoll_create1() error: %s", strerror(errno));
+    if(loop->owner_only)
+    {
+        assert(!atomicGet(loop->running) || pthread_equal(loop->owner, pthread_self()));
+        return;
+    }
+    pthread_mutex_lock(&loop->lk);
+}
+
+static void loop_unlock(tmq_event_loop_t* loop)
+{
+    if(!loop->owner_only)
+        pthread_mutex_unlock(&loop->lk);
+}
+
+static void event_loop_init(tmq_event_loop_t* loop, tmq_uring_t* uring)
+{
+    loop->uring = uring;
+    loop->epoll_fd = -1;
+    if(!uring)
+    {
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(loop->epoll_fd <= 0)
+            fatal_error("epoll_create1() error: %s", strerror(errno));
+    }
 
     tmq_vec_init(&loop->epoll_events, struct epoll_event);
-    tmq_vec_init(&loop->active_handlers, tmq_event_handler_t*);
-    tmq_map_64_init(&loop->removing_handlers, int, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
-    tmq_map_32_init(&loop->handler_map, epoll_handler_ctx, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
-    if(tmq_vec_resize(loop->epoll_events, INITIAL_EVENTLIST_SIZE) < 0)
+    tmq_vec_init(&loop->event_generations, uint32_t);
+    tmq_vec_init(&loop->fd_handlers, epoll_handler_ctx*);
+    tmq_vec_init(&loop->deferred, tmq_deferred_t);
+    if(tmq_vec_resize(loop->epoll_events, INITIAL_EVENTLIST_SIZE) < 0 ||
+       tmq_vec_resize(loop->event_generations, INITIAL_EVENTLIST_SIZE) < 0)
         fatal_error("tmq_vec_resize() error");
 
     loop->running = 0;
     loop->quit = 0;
-    loop->event_handling = 0;
+    loop->owner_only = 0;
+    loop->busy_poll_us = 0;
+    loop->spin_time = loop->work_time = 0;
     pthread_mutexattr_t attr;
     memset(&attr, 0, sizeof(pthread_mutexattr_t));
     if(pthread_mutexattr_init(&attr))
@@ -53,167 +80,364 @@ void tmq_event_loop_init(tmq_event_loop_t* loop)
     tmq_timer_heap_init(&loop->timer_heap, loop);
 }
 
+void tmq_event_loop_init(tmq_event_loop_t* loop)
+{
+    event_loop_init(loop, NULL);
+}
+
+int tmq_event_loop_init_uring(tmq_event_loop_t* loop)
+{
+    tmq_uring_t* uring = malloc(sizeof(tmq_uring_t));
+    if(!uring)
+        fatal_error("malloc() error: out of memory");
+    if(tmq_uring_init(uring) < 0)
+    {
+        free(uring);
+        event_loop_init(loop, NULL);
+        return -1;
+    }
+    event_loop_init(loop, uring);
+    return 0;
+}
+
+void tmq_event_loop_set_owner_only(tmq_event_loop_t* loop)
+{
+    if(!loop || atomicGet(loop->running)) return;
+    loop->owner_only = 1;
+}
+
+void tmq_event_loop_set_busy_poll(tmq_event_loop_t* loop, int64_t busy_poll_us)
+{
+    if(!loop || atomicGet(loop->running)) return;
+    loop->busy_poll_us = busy_poll_us;
+}
+
+static epoll_handler_ctx* get_handler_ctx(tmq_event_loop_t* loop, int fd, int create)
+{
+    if(fd < 0)
+        return NULL;
+    size_t size = tmq_vec_size(loop->fd_handlers);
+    if((size_t) fd < size)
+    {
+        epoll_handler_ctx* ctx = *tmq_vec_at(loop->fd_handlers, fd);
+        if(ctx || !create)
+            return ctx;
+    }
+    else
+    {
+        if(!create)
+            return NULL;
+        size_t new_size = size ? size : INITIAL_EVENTLIST_SIZE;
+        while(new_size <= (size_t) fd)
+            new_size *= 2;
+        if(tmq_vec_resize(loop->fd_handlers, new_size) < 0)
+            fatal_error("tmq_vec_resize() error");
+        memset(tmq_vec_at(loop->fd_handlers, size), 0, (new_size - size) * sizeof(epoll_handler_ctx*));
+    }
+    epoll_handler_ctx* ctx = malloc(sizeof(epoll_handler_ctx));
+    if(!ctx)
+        fatal_error("malloc() error: out of memory");
+    bzero(ctx, sizeof(epoll_handler_ctx));
+    tmq_vec_set(loop->fd_handlers, fd, ctx);
+    return ctx;
+}
+
+/* handlers of a ready fd, generation is the generation of the fd when it was reported ready */
+static void dispatch_handlers(epoll_handler_ctx* ctx, uint32_t events, uint32_t generation)
+{
+    tmq_event_handler_t* handler = ctx->handlers.slh_first, *next;
+    while(handler && ctx->generation == generation)
+    {
+        next = handler->event_next.sle_next;
+        if(handler->events & events)
+        {
+            handler->r_events = events;
+            handler->cb(handler->fd, events, handler->arg);
+        }
+        handler = next;
+    }
+}
+
+static void dispatch_events(tmq_event_loop_t* loop, int events_num)
+{
+    /* remember the generation of every ready fd before any callback runs,
+     * a callback may unregister(and free) the handlers of another ready fd */
+    uint32_t* generations = tmq_vec_begin(loop->event_generations);
+    for(int i = 0; i < events_num; i++)
+    {
+        epoll_handler_ctx* ctx = tmq_vec_at(loop->epoll_events, i)->data.ptr;
+        generations[i] = ctx->generation;
+    }
+    for(int i = 0; i < events_num; i++)
+    {
+        struct epoll_event* event = tmq_vec_at(loop->epoll_events, i);
+        dispatch_handlers(event->data.ptr, event->events, generations[i]);
+    }
+    if(events_num == tmq_vec_size(loop->epoll_events))
+    {
+        tmq_vec_resize(loop->epoll_events, 2 * tmq_vec_size(loop->epoll_events));
+        tmq_vec_resize(loop->event_generations, tmq_vec_size(loop->epoll_events));
+    }
+}
+
+/* with io_uring, the handlers of an fd are watched by a one-shot poll, which is armed again after the
+ * handlers are called, so they see the same level-triggered events as with epoll.
+ * a poll is identified by the fd and a sequence number, the completion of a replaced poll is ignored */
+#define POLL_USER_DATA(fd, seq)     (URING_POLL_FLAG | ((uint64_t) (fd) << 32) | (seq))
+
+static void uring_arm_poll(tmq_event_loop_t* loop, epoll_handler_ctx* ctx, int fd)
+{
+    ctx->poll_seq++;
+    ctx->poll_events = ctx->all_events;
+    ctx->poll_armed = 1;
+    tmq_uring_prep_poll(loop->uring, fd, ctx->all_events & ~EPOLLET, POLL_USER_DATA(fd, ctx->poll_seq));
+}
+
+static void uring_update_poll(tmq_event_loop_t* loop, epoll_handler_ctx* ctx, int fd)
+{
+    if(ctx->poll_armed && (SLIST_EMPTY(&ctx->handlers) || ctx->poll_events != ctx->all_events))
+    {
+        tmq_uring_prep_poll_remove(loop->uring, POLL_USER_DATA(fd, ctx->poll_seq));
+        ctx->poll_armed = 0;
+    }
+    if(!SLIST_EMPTY(&ctx->handlers) && !ctx->poll_armed)
+        uring_arm_poll(loop, ctx, fd);
+}
+
+static void dispatch_poll(tmq_event_loop_t* loop, uint64_t user_data, int res)
+{
+    int fd = (int) ((user_data & ~URING_POLL_FLAG) >> 32);
+    epoll_handler_ctx* ctx = get_handler_ctx(loop, fd, 0);
+    if(!ctx || !ctx->poll_armed || (uint32_t) user_data != ctx->poll_seq)
+        return;
+    ctx->poll_armed = 0;
+    if(res < 0)
+    {
+        tlog_error("poll error %d: %s", -res, strerror(-res));
+        return;
+    }
+    dispatch_handlers(ctx, (uint32_t) res, ctx->generation);
+    if(!SLIST_EMPTY(&ctx->handlers) && !ctx->poll_armed)
+        uring_arm_poll(loop, ctx, fd);
+}
+
+static void dispatch_completions(tmq_event_loop_t* loop, int completions)
+{
+    /* completions posted while handling these ones wait for the next round */
+    for(int i = 0; i < completions; i++)
+    {
+        struct io_uring_cqe* cqe = tmq_uring_peek_cqe(loop->uring);
+        if(!cqe) break;
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        tmq_uring_cqe_seen(loop->uring);
+        if(user_data == URING_IGNORED_DATA)
+            continue;
+        if(user_data & URING_POLL_FLAG)
+            dispatch_poll(loop, user_data, res);
+        else
+        {
+            tmq_uring_op_t* op = (tmq_uring_op_t*) user_data;
+            op->cb(op, res, flags);
+        }
+    }
+}
+
+static void run_deferred(tmq_event_loop_t* loop)
+{
+    /* a deferred callback may defer more */
+    for(size_t i = 0; i < tmq_vec_size(loop->deferred); i++)
+    {
+        tmq_deferred_t* deferred = tmq_vec_at(loop->deferred, i);
+        deferred->cb(deferred->arg);
+    }
+    tmq_vec_clear(loop->deferred);
+}
+
 void tmq_event_loop_run(tmq_event_loop_t* loop)
 {
     if(!loop) return;
     if(atomicExchange(loop->running, 1) == 1)
         return;
-    pthread_mutex_lock(&loop->lk);
+    loop->owner = pthread_self();
+    loop_lock(loop);
     loop->quit = 0;
+    int64_t last_active = 0;
     while(!loop->quit)
     {
-        pthread_mutex_unlock(&loop->lk);
-        int events_num = epoll_wait(loop->epoll_fd,
+        int timeout = EPOLL_WAIT_TIMEOUT;
+        int64_t poll_start = 0;
+        /* keep polling without blocking for a while after the last event */
+        if(loop->busy_poll_us)
+        {
+            poll_start = time_now();
+            if(poll_start - last_active < loop->busy_poll_us)
+                timeout = 0;
+        }
+        int events_num;
+        run_deferred(loop);
+        if(loop->uring)
+        {
+            loop_unlock(loop);
+            events_num = tmq_uring_submit_and_wait(loop->uring, timeout);
+            loop_lock(loop);
+        }
+        else
+        {
+            loop_unlock(loop);
+            events_num = epoll_wait(loop->epoll_fd,
                                     tmq_vec_begin(loop->epoll_events),
                                     tmq_vec_size(loop->epoll_events),
-                                    EPOLL_WAIT_TIMEOUT);
-        pthread_mutex_lock(&loop->lk);
+                                    timeout);
+            loop_lock(loop);
+        }
+        if(events_num == 0 && timeout == 0)
+            incrementAndGet(loop->spin_time, time_now() - poll_start);
         if(events_num > 0)
         {
-            if(events_num == tmq_vec_size(loop->epoll_events))
-                tmq_vec_resize(loop->epoll_events, 2 * tmq_vec_size(loop->epoll_events));
-            tmq_vec_clear(loop->active_handlers);
-            for(int i = 0; i < events_num; i++)
+            int64_t work_start = loop->busy_poll_us ? time_now() : 0;
+            if(loop->uring)
+                dispatch_completions(loop, events_num);
+            else
+                dispatch_events(loop, events_num);
+            if(loop->busy_poll_us)
             {
-                struct epoll_event* event = tmq_vec_at(loop->epoll_events, i);
-                assert(event != NULL);
-                epoll_handler_ctx * ctx = tmq_map_get(loop->handler_map, event->data.fd);
-                if(!ctx)
-                    continue;
-                tmq_event_handler_t* handler;
-                SLIST_FOREACH(handler, &ctx->handlers, event_next)
-                {
-                    if(!(handler->events & event->events))
-                        continue;
-                    handler->r_events = event->events;
-                    tmq_vec_push_back(loop->active_handlers, handler);
-                }
+                last_active = time_now();
+                incrementAndGet(loop->work_time, last_active - work_start);
             }
-            loop->event_handling = 1;
-            tmq_event_handler_t** it;
-            for(it = tmq_vec_begin(loop->active_handlers);
-                it != tmq_vec_end(loop->active_handlers);
-                it++)
-            {
-                tmq_event_handler_t* active_handler = *it;
-                /* It is possible that an active handler is unregistered by another active handler,
-                 * in this case, it should not be accessed anymore because it may already be freed */
-                if(tmq_map_get(loop->removing_handlers, active_handler) == NULL && active_handler->cb)
-                    active_handler->cb(active_handler->fd, active_handler->r_events, active_handler->arg);
-            }
-            tmq_map_clear(loop->removing_handlers);
-            loop->event_handling = 0;
         }
         else if(events_num < 0)
             tlog_error("epoll_wait() error %d: %s", errno, strerror(errno));
     }
-    pthread_mutex_unlock(&loop->lk);
+    loop_unlock(loop);
     atomicSet(loop->running, 0);
 }
 
 void tmq_handler_register(tmq_event_loop_t* loop, tmq_event_handler_t* handler)
 {
     if(!loop || !handler) return;
-    struct epoll_event event;
-    bzero(&event, sizeof(struct epoll_event));
-    event.data.fd = handler->fd;
-    event.events = handler->events;
-
-    pthread_mutex_lock(&loop->lk);
-    int op = EPOLL_CTL_ADD;
-    epoll_handler_ctx* handler_ctx = tmq_map_get(loop->handler_map, handler->fd);
-    if(!handler_ctx)
+    loop_lock(loop);
+    epoll_handler_ctx* ctx = get_handler_ctx(loop, handler->fd, 1);
+    if(!ctx)
     {
-        epoll_handler_ctx ctx;
-        bzero(&ctx, sizeof(ctx));
-        tmq_map_put(loop->handler_map, handler->fd, ctx);
-        handler_ctx = tmq_map_get(loop->handler_map, handler->fd);
+        loop_unlock(loop);
+        tlog_error("tmq_handler_register() error: invalid fd %d", handler->fd);
+        return;
     }
-    else
+    int op = SLIST_EMPTY(&ctx->handlers) ? EPOLL_CTL_ADD: EPOLL_CTL_MOD;
+    if(op == EPOLL_CTL_ADD)
+        ctx->all_events = 0;
+    SLIST_INSERT_HEAD(&ctx->handlers, handler, event_next);
+    ctx->all_events |= handler->events;
+    if(loop->uring)
     {
-        op = EPOLL_CTL_MOD;
-        event.events = handler_ctx->all_events | handler->events;
+        uring_update_poll(loop, ctx, handler->fd);
+        loop_unlock(loop);
+        return;
     }
-    assert(handler_ctx != NULL);
-    SLIST_INSERT_HEAD(&handler_ctx->handlers, handler, event_next);
-    handler_ctx->all_events = event.events;
 
+    struct epoll_event event;
+    bzero(&event, sizeof(struct epoll_event));
+    event.data.ptr = ctx;
+    event.events = ctx->all_events;
     if(epoll_ctl(loop->epoll_fd, op, handler->fd, &event) < 0)
         fatal_error("epoll_ctl() error %d: %s", errno, strerror(errno));
 
-    pthread_mutex_unlock(&loop->lk);
+    loop_unlock(loop);
 }
 
 void tmq_handler_unregister(tmq_event_loop_t* loop, tmq_event_handler_t* handler)
 {
     if(!loop || !handler) return;
-    pthread_mutex_lock(&loop->lk);
-    epoll_handler_ctx * ctx = tmq_map_get(loop->handler_map, handler->fd);
-    if(!ctx)
-    {
-        tlog_warn("handler already unregistered");
-        goto unlock;
-    }
-    tmq_event_handler_t** next = &ctx->handlers.slh_first;
-    while(*next && *next != handler)
+    loop_lock(loop);
+    epoll_handler_ctx* ctx = get_handler_ctx(loop, handler->fd, 0);
+    tmq_event_handler_t** next = ctx ? &ctx->handlers.slh_first: NULL;
+    while(next && *next && *next != handler)
         next = &(*next)->event_next.sle_next;
-    if(*next)
+    if(next && *next)
     {
+        *next = handler->event_next.sle_next;
+        handler->event_next.sle_next = NULL;
+        /* the handler may be freed by the caller, skip the pending events of this fd */
+        ctx->generation++;
+        if(loop->uring)
+        {
+            ctx->all_events = 0;
+            tmq_event_handler_t* h;
+            SLIST_FOREACH(h, &ctx->handlers, event_next)
+                ctx->all_events |= h->events;
+            uring_update_poll(loop, ctx, handler->fd);
+            loop_unlock(loop);
+            return;
+        }
         int op = EPOLL_CTL_MOD;
         struct epoll_event event, *event_p = &event;
-        /* if *next is the only handler in this handler queue,
-         * then delete corresponding fd from epoll instance */
-        if(*next == ctx->handlers.slh_first && !(*next)->event_next.sle_next)
+        /* if it was the only handler of this fd, then delete the fd from epoll instance */
+        if(SLIST_EMPTY(&ctx->handlers))
         {
             op = EPOLL_CTL_DEL;
             /* Since Linux 2.6.9, event can be specified as NULL when using EPOLL_CTL_DEL. */
             event_p = NULL;
-            tmq_map_erase(loop->handler_map, handler->fd);
+            ctx->all_events = 0;
         }
         /* otherwise, there are other handlers associated with this fd,
          * using EPOLL_CTL_MOD to modify events */
         else
         {
-            event.data.fd = handler->fd;
-            ctx->all_events &= ~handler->events;
+            ctx->all_events = 0;
+            tmq_event_handler_t* h;
+            SLIST_FOREACH(h, &ctx->handlers, event_next)
+                ctx->all_events |= h->events;
+            bzero(&event, sizeof(struct epoll_event));
+            event.data.ptr = ctx;
             event.events = ctx->all_events;
-            *next = (*next)->event_next.sle_next;
         }
         if(epoll_ctl(loop->epoll_fd, op, handler->fd, event_p) < 0)
             fatal_error("epoll_ctl() error %d: %s", errno, strerror(errno));
-
-        handler->event_next.sle_next = NULL;
-        handler->cb = handler->arg = NULL;
-        if(loop->event_handling)
-            tmq_map_put(loop->removing_handlers, handler, 1);
     }
     else
         tlog_warn("handler already unregistered");
-    unlock:
-    pthread_mutex_unlock(&loop->lk);
+    loop_unlock(loop);
 }
 
-int tmq_handler_is_registered(tmq_event_loop_t* loop, tmq_event_handler_t* handler)
+void tmq_handler_rearm(tmq_event_loop_t* loop, tmq_event_handler_t* handler)
 {
-    if(!loop || !handler) return 0;
-    pthread_mutex_lock(&loop->lk);
-    epoll_handler_ctx * ctx = tmq_map_get(loop->handler_map, handler->fd);
-    if(!ctx)
+    if(!loop || !handler) return;
+    loop_lock(loop);
+    epoll_handler_ctx* ctx = get_handler_ctx(loop, handler->fd, 0);
+    /* polls of io_uring are armed again after every event anyway */
+    if(ctx && !SLIST_EMPTY(&ctx->handlers) && !loop->uring)
     {
-        pthread_mutex_unlock(&loop->lk);
-        return 0;
+        struct epoll_event event;
+        bzero(&event, sizeof(struct epoll_event));
+        event.data.ptr = ctx;
+        event.events = ctx->all_events;
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, handler->fd, &event) < 0)
+            fatal_error("epoll_ctl() error %d: %s", errno, strerror(errno));
     }
+    loop_unlock(loop);
+}
+
+int tmq_handler_is_registered(tmq_event_loop_t* loop, tmq_event_handler_t* handler)
+{
+    if(!loop || !handler) return 0;
+    loop_lock(loop);
+    epoll_handler_ctx* ctx = get_handler_ctx(loop, handler->fd, 0);
     int registered = 0;
     tmq_event_handler_t* h;
-    SLIST_FOREACH(h, &ctx->handlers, event_next)
+    if(ctx)
     {
-        if(h == handler)
+        SLIST_FOREACH(h, &ctx->handlers, event_next)
         {
-            registered = 1;
-            break;
+            if(h == handler)
+            {
+                registered = 1;
+                break;
+            }
         }
     }
-    pthread_mutex_unlock(&loop->lk);
+    loop_unlock(loop);
     return registered;
 }
 
@@ -235,6 +459,17 @@ int tmq_event_loop_resume_timer(tmq_event_loop_t* loop, tmq_timerid_t timerid)
     return tmq_resume_timer(&loop->timer_heap, timerid);
 }
 
+void tmq_event_loop_defer(tmq_event_loop_t* loop, tmq_deferred_cb cb, void* arg)
+{
+    tmq_deferred_t deferred = {
+            .cb = cb,
+            .arg = arg
+    };
+    loop_lock(loop);
+    tmq_vec_push_back(loop->deferred, deferred);
+    loop_unlock(loop);
+}
+
 void tmq_event_loop_quit(tmq_event_loop_t* loop) {atomicSet(loop->quit, 1);}
 
 void tmq_event_loop_destroy(tmq_event_loop_t* loop)
@@ -242,22 +477,31 @@ void tmq_event_loop_destroy(tmq_event_loop_t* loop)
     if(atomicGet(loop->running))
         return;
     tmq_vec_free(loop->epoll_events);
-    tmq_vec_free(loop->active_handlers);
-    tmq_map_iter_t it = tmq_map_iter(loop->handler_map);
-    for(; tmq_map_has_next(it); tmq_map_next(loop->handler_map, it))
+    tmq_vec_free(loop->event_generations);
+    epoll_handler_ctx** it;
+    for(it = tmq_vec_begin(loop->fd_handlers); it != tmq_vec_end(loop->fd_handlers); it++)
     {
-        epoll_handler_ctx * ctx = it.second;
+        epoll_handler_ctx* ctx = *it;
+        if(!ctx) continue;
         tmq_event_handler_t* handler, *next;
         handler = ctx->handlers.slh_first;
         while(handler)
         {
             next = handler->event_next.sle_next;
-            free(handler);
+            tmq_obj_free(handler);
             handler = next;
         }
+        free(ctx);
+    }
+    tmq_vec_free(loop->fd_handlers);
+    tmq_vec_free(loop->deferred);
+    if(loop->uring)
+    {
+        tmq_uring_destroy(loop->uring);
+        free(loop->uring);
     }
-    tmq_map_free(loop->handler_map);
-    close(loop->epoll_fd);
+    else
+        close(loop->epoll_fd);
     tmq_timer_heap_destroy(&loop->timer_heap);
 }
 
@@ -295,7 +539,7 @@ void tmq_notifier_destroy(tmq_notifier_t* notifier)
 {
     if(!notifier) return;
     tmq_handler_unregister(notifier->loop, notifier->wakeup_handler);
-    free(notifier->wakeup_handler);
+    tmq_obj_free(notifier->wakeup_handler);
     close(notifier->wakeup_pipe[0]);
     close(notifier->wakeup_pipe[1]);
 }
\ No newline at end of file
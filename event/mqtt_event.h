@@ -8,6 +8,7 @@
 #include "base/mqtt_vec.h"
 #include "base/mqtt_socket.h"
 #include "mqtt_timer.h"
+#include "mqtt_uring.h"
 #include <sys/epoll.h>
 #include <sys/queue.h>
 #include <pthread.h>
@@ -30,40 +31,78 @@ typedef struct tmq_event_handler_s
 tmq_event_handler_t* tmq_event_handler_new(int fd, short events, tmq_event_cb cb, void* arg);
 
 typedef SLIST_HEAD(handler_queue, tmq_event_handler_s) handler_queue;
+/* one record per fd, indexed by the fd and pointed to by the epoll data, so an event is
+ * dispatched without a lookup. the record lives until the loop is destroyed, generation is
+ * bumped whenever a handler of the fd is unregistered, which invalidates the events of it
+ * that are still pending in the current round */
 typedef struct
 {
     handler_queue handlers;
     uint32_t all_events;
+    uint32_t generation;
+    /* the io_uring poll watching this fd, see uring_arm_poll() */
+    uint32_t poll_events;
+    uint32_t poll_seq;
+    int poll_armed;
 } epoll_handler_ctx;
-typedef tmq_map(int, epoll_handler_ctx) handler_map_t;
+typedef tmq_vec(epoll_handler_ctx*) fd_handler_table_t;
 typedef tmq_vec(struct epoll_event) event_list_t;
-typedef tmq_vec(tmq_event_handler_t*) active_handler_list_t;
-typedef tmq_map(tmq_event_handler_t*, int) removing_handler_set_t;
+typedef tmq_vec(uint32_t) generation_list_t;
+typedef void(*tmq_deferred_cb)(void* arg);
+typedef struct
+{
+    tmq_deferred_cb cb;
+    void* arg;
+} tmq_deferred_t;
+typedef tmq_vec(tmq_deferred_t) deferred_list_t;
 
 typedef struct tmq_event_loop_s
 {
     int epoll_fd;
+    /* not NULL if the loop uses io_uring instead of epoll */
+    tmq_uring_t* uring;
     event_list_t epoll_events;
+    generation_list_t event_generations;
 
-    active_handler_list_t active_handlers;
-    removing_handler_set_t removing_handlers;
-    handler_map_t handler_map;
+    fd_handler_table_t fd_handlers;
+    /* run before the loop waits for events again */
+    deferred_list_t deferred;
 
     tmq_timer_heap_t timer_heap;
     int running;
     int quit;
-    int event_handling;
+    /* see tmq_event_loop_set_owner_only() */
+    int owner_only;
+    pthread_t owner;
+    /* see tmq_event_loop_set_busy_poll(). time(us) spent in polling that found nothing
+     * and in handling events, only counted when busy polling. read by other threads */
+    int64_t busy_poll_us;
+    uint64_t spin_time, work_time;
     pthread_mutex_t lk;
 } tmq_event_loop_t;
 
 void tmq_event_loop_init(tmq_event_loop_t* loop);
+/* a loop waiting in io_uring, it falls back to epoll and returns -1 if io_uring isn't available.
+ * handlers work as usual, connections may also submit their own operations to loop->uring */
+int tmq_event_loop_init_uring(tmq_event_loop_t* loop);
+/* handlers of the loop will only be registered and unregistered by the thread running it,
+ * so they don't take the loop lock. other threads hand their work over through a notifier.
+ * timers may still be added and canceled by any thread */
+void tmq_event_loop_set_owner_only(tmq_event_loop_t* loop);
+/* after handling events, poll for busy_poll_us microseconds without blocking before waiting in epoll_wait() again.
+ * this saves the wake-up latency at the cost of a busy cpu, 0 disables it */
+void tmq_event_loop_set_busy_poll(tmq_event_loop_t* loop, int64_t busy_poll_us);
 void tmq_event_loop_run(tmq_event_loop_t* loop);
 void tmq_handler_register(tmq_event_loop_t* loop, tmq_event_handler_t* handler);
 void tmq_handler_unregister(tmq_event_loop_t* loop, tmq_event_handler_t* handler);
+/* report the pending readiness of an edge-triggered fd again */
+void tmq_handler_rearm(tmq_event_loop_t* loop, tmq_event_handler_t* handler);
 int tmq_handler_is_registered(tmq_event_loop_t* loop, tmq_event_handler_t* handler);
 tmq_timerid_t tmq_event_loop_add_timer(tmq_event_loop_t* loop, tmq_timer_t* timer);
 void tmq_event_loop_cancel_timer(tmq_event_loop_t* loop, tmq_timerid_t timerid);
 int tmq_event_loop_resume_timer(tmq_event_loop_t* loop, tmq_timerid_t timerid);
+/* call cb in the loop thread right before the loop waits for events again */
+void tmq_event_loop_defer(tmq_event_loop_t* loop, tmq_deferred_cb cb, void* arg);
 void tmq_event_loop_quit(tmq_event_loop_t* loop);
 void tmq_event_loop_destroy(tmq_event_loop_t* loop);
 
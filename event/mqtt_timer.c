@@ -4,6 +4,7 @@
 #include "mqtt_timer.h"
 #include "mqtt_event.h"
 #include "base/mqtt_util.h"
+#include "base/mqtt_obj_pool.h"
 #include <stdlib.h>
 #include <sys/timerfd.h>
 #include <errno.h>
@@ -49,7 +50,7 @@ tmq_timer_t* tmq_timer_new(double timeout_ms, int repeat, tmq_timer_cb cb, void*
         tlog_error("timeout or interval can't be nagetive");
         return NULL;
     }
-    tmq_timer_t* timer = malloc(sizeof(tmq_timer_t));
+    tmq_timer_t* timer = tmq_obj_new(tmq_timer_t, OBJ_TIMER);
     if(!timer)
         fatal_error("realloc() error: out of memory");
 
@@ -96,7 +97,7 @@ static int timer_heap_insert(tmq_timer_heap_t* timer_heap, tmq_timer_t* timer)
     if(!timer) return 0;
     if(timer_heap->size == timer_heap->cap)
     {
-       tmq_timer_t** heap = (tmq_timer_t**) realloc(timer_heap->heap, timer_heap->cap * 2 + 1);
+       tmq_timer_t** heap = (tmq_timer_t**) realloc(timer_heap->heap, sizeof(tmq_timer_t*) * (timer_heap->cap * 2 + 1));
        if(!heap)
            fatal_error("realloc() error: out of memory");
 
@@ -184,7 +185,7 @@ static void timer_heap_timeout(int timer_fd, uint32_t event, void* arg)
         else
         {
             tmq_map_erase(timer_heap->registered_timers, (*timer)->timer_id);
-            free(*timer);
+            tmq_obj_free(*timer);
         }
     }
     tmq_vec_clear(timer_heap->expired_timers);
@@ -212,7 +213,7 @@ void tmq_timer_heap_init(tmq_timer_heap_t* timer_heap, tmq_event_loop_t* loop)
     if(timer_heap->timer_fd < 0)
         fatal_error("timerfd_create() error %d: %s", errno, strerror(errno));
 
-    timer_heap->heap = malloc(sizeof(tmq_timer_t*) * TIMER_HEAP_INITIAL_SIZE + 1);
+    timer_heap->heap = malloc(sizeof(tmq_timer_t*) * (TIMER_HEAP_INITIAL_SIZE + 1));
     if(!timer_heap->heap)
         fatal_error("malloc() error: out of memory");
 
@@ -229,7 +230,7 @@ void tmq_timer_heap_init(tmq_timer_heap_t* timer_heap, tmq_event_loop_t* loop)
         fatal_error("pthread_mutexattr_init() error %d: %s", errno, strerror(errno));
 
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE_NP);
-    if(pthread_mutex_init(&timer_heap->lk, NULL))
+    if(pthread_mutex_init(&timer_heap->lk, &attr))
         fatal_error("pthread_mutex_init() error %d: %s", errno, strerror(errno));
 
     tmq_event_handler_t* handler = tmq_event_handler_new(timer_heap->timer_fd, EPOLLIN,
@@ -241,10 +242,10 @@ void tmq_timer_heap_destroy(tmq_timer_heap_t* timer_heap)
 {
     if(!timer_heap) return;
     for(int i = 1; i < timer_heap->size; i++)
-        free(timer_heap->heap[i]);
+        tmq_obj_free(timer_heap->heap[i]);
     tmq_timer_t** it = tmq_vec_begin(timer_heap->expired_timers);
     for(; it != tmq_vec_end(timer_heap->expired_timers); it++)
-        free(*it);
+        tmq_obj_free(*it);
     if(timer_heap->heap)
         free(timer_heap->heap);
     tmq_vec_free(timer_heap->expired_timers);
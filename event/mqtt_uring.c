@@ -0,0 +1,288 @@
+//
+// Created by zr on 23-7-24.
+//
+#include "mqtt_uring.h"
+#include "tlog.h"
+#include "base/mqtt_util.h"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* there is no liburing dependency, the ring is set up with the raw system calls */
+static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, void* arg, size_t arg_size)
+{
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static void unmap_rings(tmq_uring_t* ring)
+{
+    if(ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if(ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if(ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    free(ring->recv_bufs);
+}
+
+static int map_rings(tmq_uring_t* ring, struct io_uring_params* params)
+{
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if(params->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        return -1;
+    }
+    if(params->features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            return -1;
+        }
+    }
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        return -1;
+    }
+    char* sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned*) (sq + params->sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params->sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params->sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params->sq_off.array);
+    ring->sq_entries = params->sq_entries;
+    ring->cq_head = (unsigned*) (cq + params->cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params->cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params->cq_off.cqes);
+    return 0;
+}
+
+static int setup_buf_ring(tmq_uring_t* ring)
+{
+    ring->buf_ring_size = URING_RECV_BUF_NUM * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buf_ring == MAP_FAILED)
+    {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+    ring->recv_bufs = malloc(URING_RECV_BUF_NUM * URING_RECV_BUF_SIZE);
+    if(!ring->recv_bufs)
+        fatal_error("malloc() error: out of memory");
+    struct io_uring_buf_reg reg;
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (uint64_t) ring->buf_ring;
+    reg.ring_entries = URING_RECV_BUF_NUM;
+    reg.bgid = URING_RECV_BUF_GROUP;
+    if(io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+    ring->buf_ring_tail = 0;
+    for(uint16_t bid = 0; bid < URING_RECV_BUF_NUM; bid++)
+        tmq_uring_recycle_buf(ring, (uint32_t) bid << IORING_CQE_BUFFER_SHIFT);
+    return 0;
+}
+
+int tmq_uring_init(tmq_uring_t* ring)
+{
+    bzero(ring, sizeof(tmq_uring_t));
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring->ring_fd = io_uring_setup(URING_SQ_ENTRIES, &params);
+    if(ring->ring_fd < 0)
+    {
+        tlog_warn("io_uring_setup() error %d: %s", errno, strerror(errno));
+        return -1;
+    }
+    /* waiting with a timeout needs IORING_FEAT_EXT_ARG(5.11) */
+    if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    {
+        tlog_warn("io_uring of this kernel is too old");
+        close(ring->ring_fd);
+        return -1;
+    }
+    if(map_rings(ring, &params) < 0 || setup_buf_ring(ring) < 0)
+    {
+        tlog_warn("io_uring setup error %d: %s", errno, strerror(errno));
+        unmap_rings(ring);
+        close(ring->ring_fd);
+        return -1;
+    }
+    return 0;
+}
+
+void tmq_uring_destroy(tmq_uring_t* ring)
+{
+    unmap_rings(ring);
+    close(ring->ring_fd);
+}
+
+struct io_uring_sqe* tmq_uring_get_sqe(tmq_uring_t* ring)
+{
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    while(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        tmq_uring_submit_and_wait(ring, 0);
+        tail = *ring->sq_tail + ring->sq_pending;
+    }
+    unsigned idx = tail & *ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->sq_pending++;
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int tmq_uring_submit_and_wait(tmq_uring_t* ring, int timeout_ms)
+{
+    if(ring->sq_pending)
+    {
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_pending, __ATOMIC_RELEASE);
+        ring->sq_pending = 0;
+    }
+    unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    int ret = 0;
+    if(timeout_ms > 0)
+    {
+        struct __kernel_timespec ts = {
+                .tv_sec = timeout_ms / 1000,
+                .tv_nsec = (timeout_ms % 1000) * 1000000
+        };
+        struct io_uring_getevents_arg arg;
+        bzero(&arg, sizeof(arg));
+        arg.ts = (uint64_t) &ts;
+        ret = io_uring_enter(ring->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                             &arg, sizeof(arg));
+    }
+    else if(to_submit)
+        ret = io_uring_enter(ring->ring_fd, to_submit, 0, 0, NULL, 0);
+    /* EBUSY: the completion queue overflowed, the sqes are submitted after the completions are consumed */
+    if(ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+        tlog_error("io_uring_enter() error %d: %s", errno, strerror(errno));
+    return (int) (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head);
+}
+
+struct io_uring_cqe* tmq_uring_peek_cqe(tmq_uring_t* ring)
+{
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void tmq_uring_cqe_seen(tmq_uring_t* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void tmq_uring_prep_poll(tmq_uring_t* ring, int fd, uint32_t events, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = tmq_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+void tmq_uring_prep_poll_remove(tmq_uring_t* ring, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = tmq_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = URING_IGNORED_DATA;
+}
+
+void tmq_uring_prep_accept_multishot(tmq_uring_t* ring, int fd, tmq_uring_op_t* op)
+{
+    struct io_uring_sqe* sqe = tmq_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t) op;
+}
+
+void tmq_uring_prep_recv_multishot(tmq_uring_t* ring, int fd, tmq_uring_op_t* op)
+{
+    struct io_uring_sqe* sqe = tmq_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_BUF_GROUP;
+    sqe->user_data = (uint64_t) op;
+}
+
+void tmq_uring_prep_writev(tmq_uring_t* ring, int fd, const struct iovec* iov, unsigned n, tmq_uring_op_t* op)
+{
+    struct io_uring_sqe* sqe = tmq_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) iov;
+    sqe->len = n;
+    sqe->user_data = (uint64_t) op;
+}
+
+void tmq_uring_prep_cancel(tmq_uring_t* ring, tmq_uring_op_t* op)
+{
+    struct io_uring_sqe* sqe = tmq_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) op;
+    sqe->user_data = URING_IGNORED_DATA;
+}
+
+char* tmq_uring_recv_buf(tmq_uring_t* ring, uint32_t cqe_flags)
+{
+    uint16_t bid = cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+    return ring->recv_bufs + (size_t) bid * URING_RECV_BUF_SIZE;
+}
+
+void tmq_uring_recycle_buf(tmq_uring_t* ring, uint32_t cqe_flags)
+{
+    uint16_t bid = cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_ring_tail & (URING_RECV_BUF_NUM - 1)];
+    buf->addr = (uint64_t) (ring->recv_bufs + (size_t) bid * URING_RECV_BUF_SIZE);
+    buf->len = URING_RECV_BUF_SIZE;
+    buf->bid = bid;
+    ring->buf_ring_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_ring_tail, __ATOMIC_RELEASE);
+}
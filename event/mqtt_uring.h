@@ -0,0 +1,75 @@
+//
+// Created by zr on 23-7-24.
+//
+
+#ifndef TINYMQTT_MQTT_URING_H
+#define TINYMQTT_MQTT_URING_H
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define URING_SQ_ENTRIES        1024
+#define URING_CQ_ENTRIES        8192
+/* buffers provided to multishot recv, shared by all the connections of a loop */
+#define URING_RECV_BUF_NUM      256
+#define URING_RECV_BUF_SIZE     16384
+#define URING_RECV_BUF_GROUP    0
+
+/* user_data of the sqes that aren't tmq_uring_op_t, their completions are ignored */
+#define URING_IGNORED_DATA      0
+/* user_data with this bit set is a poll of the event loop, otherwise it points to a tmq_uring_op_t */
+#define URING_POLL_FLAG         (1ULL << 63)
+
+typedef struct tmq_uring_op_s tmq_uring_op_t;
+typedef void(*tmq_uring_cb)(tmq_uring_op_t* op, int res, uint32_t flags);
+/* an operation in flight, it must stay valid until its last completion(without IORING_CQE_F_MORE) */
+struct tmq_uring_op_s
+{
+    tmq_uring_cb cb;
+    void* arg;
+};
+
+typedef struct tmq_uring_s
+{
+    int ring_fd;
+    unsigned* sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    /* sqes queued but not submitted yet */
+    unsigned sq_pending;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    char* recv_bufs;
+    uint16_t buf_ring_tail;
+} tmq_uring_t;
+
+/* returns -1 if io_uring isn't available */
+int tmq_uring_init(tmq_uring_t* ring);
+void tmq_uring_destroy(tmq_uring_t* ring);
+/* get an sqe to fill in, pending sqes are submitted first if the submission queue is full */
+struct io_uring_sqe* tmq_uring_get_sqe(tmq_uring_t* ring);
+/* submit the pending sqes and wait for at least one completion for up to timeout_ms,
+ * timeout_ms = 0 only submits. returns the number of completions ready */
+int tmq_uring_submit_and_wait(tmq_uring_t* ring, int timeout_ms);
+/* the completion at the head of the completion queue, NULL if there is none */
+struct io_uring_cqe* tmq_uring_peek_cqe(tmq_uring_t* ring);
+void tmq_uring_cqe_seen(tmq_uring_t* ring);
+
+void tmq_uring_prep_poll(tmq_uring_t* ring, int fd, uint32_t events, uint64_t user_data);
+void tmq_uring_prep_poll_remove(tmq_uring_t* ring, uint64_t user_data);
+void tmq_uring_prep_accept_multishot(tmq_uring_t* ring, int fd, tmq_uring_op_t* op);
+void tmq_uring_prep_recv_multishot(tmq_uring_t* ring, int fd, tmq_uring_op_t* op);
+void tmq_uring_prep_writev(tmq_uring_t* ring, int fd, const struct iovec* iov, unsigned n, tmq_uring_op_t* op);
+void tmq_uring_prep_cancel(tmq_uring_t* ring, tmq_uring_op_t* op);
+
+/* the provided buffer a recv completion was written to, it must be recycled once consumed */
+char* tmq_uring_recv_buf(tmq_uring_t* ring, uint32_t cqe_flags);
+void tmq_uring_recycle_buf(tmq_uring_t* ring, uint32_t cqe_flags);
+
+#endif //TINYMQTT_MQTT_URING_H
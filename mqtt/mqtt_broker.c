@@ -4,6 +4,7 @@
 #include "mqtt_broker.h"
 #include "mqtt_session.h"
 #include "base/mqtt_util.h"
+#include "base/mqtt_obj_pool.h"
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
@@ -45,15 +46,234 @@ static void make_connect_respond(tmq_io_group_t* group, tmq_tcp_conn_t* conn,
 
 static void mqtt_publish_deliver(void* arg, char* topic, tmq_message* message, uint8_t retain);
 
+static void retain_delivery_free(retain_delivery_t* delivery)
+{
+    tmq_str_free(delivery->client_id);
+    tmq_retain_cursor_destroy(&delivery->cursor);
+    free(delivery);
+}
+
+/* if the subscriber can't keep up with the messages already sent to it,
+ * wait for it to catch up before sending more retained messages */
+static int session_backlogged(tmq_session_t* session, uint8_t qos)
+{
+    if(qos > 0 && session->pending_packets >= session->inflight_window_size)
+        return 1;
+    return atomicGet(session->conn->pending_bytes) > RETAIN_OUT_BUFFER_HIGH;
+}
+
+static int deliver_retain_message(void* arg, retain_message_t* retain_msg)
+{
+    retain_delivery_t* delivery = arg;
+    uint8_t final_qos = delivery->qos < retain_msg->retain_msg.qos ? delivery->qos : retain_msg->retain_msg.qos;
+    if(!delivery->budget || session_backlogged(delivery->session, final_qos))
+        return 1;
+    tmq_session_publish(delivery->session, retain_msg->retain_topic, retain_msg->retain_msg.message, final_qos, 1);
+    delivery->budget--;
+    return 0;
+}
+
+/* deliver the next batch of retained messages, returns 1 if the delivery is finished */
+static int retain_delivery_step(tmq_broker_t* broker, retain_delivery_t* delivery)
+{
+    tmq_session_t** session = tmq_map_get(broker->sessions, delivery->client_id);
+    if(!session || *session != delivery->session || (*session)->state == CLOSED)
+        return 1;
+    delivery->budget = RETAIN_DELIVER_BATCH;
+    tmq_retain_store_scan(&broker->topics_tree.retain_store, &delivery->cursor,
+                          RETAIN_SCAN_BATCH, deliver_retain_message, delivery);
+    return delivery->cursor.done;
+}
+
+static void deliver_retained_messages(void* arg)
+{
+    tmq_broker_t* broker = arg;
+    size_t remain = 0;
+    int keep_up = 0;
+    for(size_t i = 0; i < tmq_vec_size(broker->retain_deliveries); i++)
+    {
+        retain_delivery_t* delivery = *tmq_vec_at(broker->retain_deliveries, i);
+        if(retain_delivery_step(broker, delivery))
+            retain_delivery_free(delivery);
+        else
+        {
+            tmq_vec_set(broker->retain_deliveries, remain++, delivery);
+            /* the whole batch was sent, the subscriber isn't backlogged */
+            if(!delivery->budget)
+                keep_up = 1;
+        }
+    }
+    tmq_vec_resize(broker->retain_deliveries, remain);
+    if(!remain)
+    {
+        tmq_event_loop_cancel_timer(&broker->loop, broker->retain_deliver_timer);
+        broker->retain_delivering = 0;
+    }
+    /* continue in the next loop iteration instead of waiting for the timer,
+     * backlogged subscribers will be retried by the timer */
+    else if(keep_up)
+        tmq_notifier_notify(&broker->retain_deliver_notifier);
+}
+
+/* stop delivering retained messages to a session, only those matching the topic filter if it isn't NULL */
+static void cancel_retain_deliveries(tmq_broker_t* broker, tmq_session_t* session, const char* topic_filter)
+{
+    size_t remain = 0;
+    for(size_t i = 0; i < tmq_vec_size(broker->retain_deliveries); i++)
+    {
+        retain_delivery_t* delivery = *tmq_vec_at(broker->retain_deliveries, i);
+        if(delivery->session == session && (!topic_filter || !strcmp(delivery->cursor.topic_filter, topic_filter)))
+            retain_delivery_free(delivery);
+        else
+            tmq_vec_set(broker->retain_deliveries, remain++, delivery);
+    }
+    tmq_vec_resize(broker->retain_deliveries, remain);
+}
+
+/* send the retained messages matching a new subscription, the first batch is sent immediately,
+ * the rest is sent by the retain delivery timer so that a huge number of retained messages won't block the broker */
+static void start_retain_delivery(tmq_broker_t* broker, tmq_session_t* session, char* topic_filter, uint8_t qos)
+{
+    /* a subscription to the same topic filter restarts the delivery from the first retained message */
+    cancel_retain_deliveries(broker, session, topic_filter);
+    retain_delivery_t* delivery = malloc(sizeof(retain_delivery_t));
+    if(!delivery) fatal_error("malloc() error: out of memory");
+    delivery->client_id = tmq_str_new(session->client_id);
+    delivery->session = session;
+    delivery->qos = qos;
+    tmq_retain_cursor_init(&delivery->cursor, topic_filter);
+    if(retain_delivery_step(broker, delivery))
+    {
+        retain_delivery_free(delivery);
+        return;
+    }
+    tmq_vec_push_back(broker->retain_deliveries, delivery);
+    if(!broker->retain_delivering)
+    {
+        tmq_timer_t* timer = tmq_timer_new(RETAIN_DELIVER_INTERVAL, 1, deliver_retained_messages, broker);
+        broker->retain_deliver_timer = tmq_event_loop_add_timer(&broker->loop, timer);
+        broker->retain_delivering = 1;
+    }
+    if(!delivery->budget)
+        tmq_notifier_notify(&broker->retain_deliver_notifier);
+}
+
+/* whether an io group may still deliver messages queued to it by the broker */
+static int fanout_pending(tmq_broker_t* broker, int idx)
+{
+    return !tmq_vec_empty(broker->fanout_staging[idx]) ||
+           atomicGet(broker->io_groups[idx].fanout_done_seq) < broker->fanout_group_seq[idx];
+}
+
+/* a closed session keeps the io group of its last connection, and a resumed session
+ * doesn't move to the group of its new connection until the old group is done with it */
+static int io_group_index(tmq_broker_t* broker, tmq_session_t* session)
+{
+    if(session->state == OPEN)
+    {
+        int idx = (int) (session->conn->group - broker->io_groups);
+        if(idx != session->fanout_group && !fanout_pending(broker, session->fanout_group))
+            session->fanout_group = idx;
+    }
+    return session->fanout_group;
+}
+
+/* whether all the fan-out requests queued until seq are processed */
+static int fanout_done(tmq_broker_t* broker, uint64_t seq)
+{
+    for(int i = 0; i < MQTT_IO_THREAD; i++)
+    {
+        uint64_t queued = broker->fanout_group_seq[i] < seq ? broker->fanout_group_seq[i] : seq;
+        if(atomicGet(broker->io_groups[i].fanout_done_seq) < queued)
+            return 0;
+    }
+    return 1;
+}
+
+/* a session may still be referenced by the fan-out requests in the io groups */
+static void free_session(tmq_broker_t* broker, tmq_session_t* session)
+{
+    if(fanout_done(broker, broker->fanout_seq))
+    {
+        tmq_session_free(session);
+        return;
+    }
+    deferred_session_t deferred = {
+            .session = session,
+            .seq = broker->fanout_seq
+    };
+    tmq_vec_push_back(broker->deferred_sessions, deferred);
+}
+
+static void free_deferred_sessions(tmq_broker_t* broker)
+{
+    size_t remain = 0;
+    for(size_t i = 0; i < tmq_vec_size(broker->deferred_sessions); i++)
+    {
+        deferred_session_t* deferred = tmq_vec_at(broker->deferred_sessions, i);
+        if(fanout_done(broker, deferred->seq))
+            tmq_session_free(deferred->session);
+        else
+            tmq_vec_set(broker->deferred_sessions, remain++, *deferred);
+    }
+    tmq_vec_resize(broker->deferred_sessions, remain);
+}
+
+/* hand the delivery of messages to a session over to its io group */
+static void stage_fanout(tmq_broker_t* broker, tmq_session_t* session, tmq_interned_topic_t* topic,
+                         uint8_t required_qos, tmq_message* messages, size_t n)
+{
+    /* the messages are copied once and shared by all the io groups */
+    if(!broker->fanout_current)
+    {
+        fanout_batch* batch = malloc(sizeof(fanout_batch) + n * sizeof(tmq_message));
+        if(!batch) fatal_error("malloc() error: out of memory");
+        batch->refcnt = 1;
+        batch->topic = tmq_interned_topic_get(topic);
+        batch->n = n;
+        for(size_t i = 0; i < n; i++)
+        {
+            batch->messages[i].message = tmq_str_new(messages[i].message);
+            batch->messages[i].qos = messages[i].qos;
+        }
+        broker->fanout_current = batch;
+    }
+    /* not visible to the io groups until flush_fanout() */
+    broker->fanout_current->refcnt++;
+    fanout_req req = {
+            .session = session,
+            .qos = required_qos,
+            .batch = broker->fanout_current
+    };
+    tmq_vec_push_back(broker->fanout_staging[io_group_index(broker, session)], req);
+}
+
+/* called after every match on the broker thread */
+static void flush_fanout(tmq_broker_t* broker)
+{
+    if(!broker->fanout_current)
+        return;
+    broker->fanout_seq++;
+    for(int i = 0; i < MQTT_IO_THREAD; i++)
+    {
+        if(tmq_vec_empty(broker->fanout_staging[i]))
+            continue;
+        broker->fanout_group_seq[i] = broker->fanout_seq;
+        tmq_io_group_add_fanout(&broker->io_groups[i], &broker->fanout_staging[i], broker->fanout_seq);
+    }
+    fanout_batch_release(broker->fanout_current);
+    broker->fanout_current = NULL;
+}
+
 static void session_states_cleanup(void* arg, tmq_session_t* session)
 {
+    tmq_broker_t* broker = arg;
+    /* stop delivering retained messages to this session */
+    cancel_retain_deliveries(broker, session, NULL);
     if(!session->clean_session)
         return;
-    tmq_broker_t* broker = arg;
     /* unsubsribe all topics */
-    tmq_map_iter_t sub_it = tmq_map_iter(session->subscriptions);
-    for(; tmq_map_has_next(sub_it); tmq_map_next(session->subscriptions, sub_it))
-        tmq_topics_remove_subscription(&broker->topics_tree, (char*) sub_it.first, session->client_id);
+    tmq_topics_drop_all_subscriptions(&broker->topics_tree, session, &session->subscriptions);
     /* remove this session from the broker */
     tmq_map_erase(broker->sessions, session->client_id);
 }
@@ -122,10 +342,11 @@ static void start_session(tmq_broker_t* broker, tmq_tcp_conn_t* conn, tmq_connec
         {
             (*session)->clean_session = 1;
             tmq_session_close(*session);
-            tmq_session_free(*session);
+            free_session(broker, *session);
             tmq_session_t* new_session = tmq_session_new(broker, mqtt_publish_deliver, session_states_cleanup, conn,
                                                          connect_pkt->client_id, 1, connect_pkt->keep_alive, will_topic,
                                                          will_message, will_qos, will_retain, broker->inflight_window_size);
+            new_session->fanout_group = (int) (conn->group - broker->io_groups);
             tmq_map_put(broker->sessions, connect_pkt->client_id, new_session);
             make_connect_respond(conn->group, conn, CONNECTION_ACCEPTED, new_session, 1);
         }
@@ -144,6 +365,7 @@ static void start_session(tmq_broker_t* broker, tmq_tcp_conn_t* conn, tmq_connec
         tmq_session_t* new_session = tmq_session_new(broker, mqtt_publish_deliver, session_states_cleanup, conn,
                                                      connect_pkt->client_id, clean_session, connect_pkt->keep_alive, will_topic,
                                                      will_message, will_qos, will_retain, broker->inflight_window_size);
+        new_session->fanout_group = (int) (conn->group - broker->io_groups);
         tmq_map_put(broker->sessions, connect_pkt->client_id, new_session);
         make_connect_respond(conn->group, conn, CONNECTION_ACCEPTED, new_session, 0);
     }
@@ -156,14 +378,23 @@ static void start_session(tmq_broker_t* broker, tmq_tcp_conn_t* conn, tmq_connec
 static void handle_session_ctl(void* arg)
 {
     tmq_broker_t* broker = arg;
+    int64_t start = time_now();
 
-    session_ctl_list ctls = tmq_vec_make(session_ctl);
-    pthread_mutex_lock(&broker->session_ctl_lk);
-    tmq_vec_swap(ctls, broker->session_ctl_reqs);
-    pthread_mutex_unlock(&broker->session_ctl_lk);
-
-    for(session_ctl* ctl = tmq_vec_begin(ctls); ctl != tmq_vec_end(ctls); ctl++)
+    int refilled = 0;
+    if(broker->session_ctl_next == tmq_vec_size(broker->session_ctl_backlog))
     {
+        tmq_vec_clear(broker->session_ctl_backlog);
+        broker->session_ctl_next = 0;
+        pthread_mutex_lock(&broker->session_ctl_lk);
+        tmq_vec_swap(broker->session_ctl_backlog, broker->session_ctl_reqs);
+        pthread_mutex_unlock(&broker->session_ctl_lk);
+        refilled = 1;
+    }
+    size_t budget = BROKER_CTL_BUDGET;
+    while(broker->session_ctl_next < tmq_vec_size(broker->session_ctl_backlog) &&
+          budget-- && time_now() - start < BROKER_CTL_TIME_BUDGET)
+    {
+        session_ctl* ctl = tmq_vec_at(broker->session_ctl_backlog, broker->session_ctl_next++);
         /* handle connect request */
         if(ctl->op == SESSION_CONNECT)
         {
@@ -181,32 +412,95 @@ static void handle_session_ctl(void* arg)
             {
                 /* send the will-message if session closed without receiving a disconnect packet */
                 if(session->will_publish_req.topic)
+                {
                     tmq_topics_publish(&broker->topics_tree, 0, session->will_publish_req.topic,
                                        &session->will_publish_req.message, session->will_publish_req.retain);
+                    flush_fanout(broker);
+                }
             }
             tmq_str_free(session->will_publish_req.topic);
             tmq_str_free(session->will_publish_req.message.message);
             if(session->clean_session)
-                tmq_session_free(session);
+                free_session(broker, session);
         }
     }
-    tmq_vec_free(ctls);
+    /* the notifications of the requests queued while finishing an old backlog are already consumed */
+    if(broker->session_ctl_next < tmq_vec_size(broker->session_ctl_backlog) || !refilled)
+        tmq_notifier_notify(&broker->session_ctl_notifier);
+    tmq_histogram_record(&broker->session_ctl_latency, time_now() - start);
 }
 
 /* handle subscribe/unsubscribe/publish requests */
+typedef tmq_map(char*, size_t) publish_batch_index;
+
+/* add a publish request to the batch of its topic, retained messages are stored right away */
+static void batch_publish_req(tmq_broker_t* broker, publish_batch_list* batches, publish_batch_index* index,
+                              publish_req* req)
+{
+    if(req->retain)
+        tmq_retain_store_put(&broker->topics_tree.retain_store, req->topic, &req->message);
+    size_t* idx = tmq_map_get(*index, req->topic);
+    publish_batch* batch;
+    if(idx)
+    {
+        batch = tmq_vec_at(*batches, *idx);
+        tmq_str_free(req->topic);
+    }
+    else
+    {
+        publish_batch new_batch = {.topic = req->topic};
+        tmq_vec_init(&new_batch.messages, tmq_message);
+        tmq_vec_push_back(*batches, new_batch);
+        tmq_map_put(*index, req->topic, tmq_vec_size(*batches) - 1);
+        batch = tmq_vec_at(*batches, tmq_vec_size(*batches) - 1);
+    }
+    tmq_vec_push_back(batch->messages, req->message);
+}
+
+/* route the batched messages, each topic is matched only once */
+static void route_publish_batches(tmq_broker_t* broker, publish_batch_list* batches, publish_batch_index* index)
+{
+    for(publish_batch* batch = tmq_vec_begin(*batches); batch != tmq_vec_end(*batches); batch++)
+    {
+        tmq_topics_publish_batch(&broker->topics_tree, 0, batch->topic,
+                                 tmq_vec_begin(batch->messages), tmq_vec_size(batch->messages));
+        flush_fanout(broker);
+        for(tmq_message* message = tmq_vec_begin(batch->messages); message != tmq_vec_end(batch->messages); message++)
+            tmq_str_free(message->message);
+        tmq_vec_free(batch->messages);
+        tmq_str_free(batch->topic);
+    }
+    tmq_vec_clear(*batches);
+    tmq_map_clear(*index);
+}
+
 static void handle_message_ctl(void* arg)
 {
     tmq_broker_t* broker = arg;
+    int64_t start = time_now();
 
-    message_ctl_list ctls = tmq_vec_make(message_ctl);
-    pthread_mutex_lock(&broker->message_ctl_lk);
-    tmq_vec_swap(ctls, broker->message_ctl_reqs);
-    pthread_mutex_unlock(&broker->message_ctl_lk);
-
-    for(message_ctl * ctl = tmq_vec_begin(ctls); ctl != tmq_vec_end(ctls); ctl++)
+    int refilled = 0;
+    if(broker->message_ctl_next == tmq_vec_size(broker->message_ctl_backlog))
     {
+        tmq_vec_clear(broker->message_ctl_backlog);
+        broker->message_ctl_next = 0;
+        pthread_mutex_lock(&broker->message_ctl_lk);
+        tmq_vec_swap(broker->message_ctl_backlog, broker->message_ctl_reqs);
+        pthread_mutex_unlock(&broker->message_ctl_lk);
+        refilled = 1;
+    }
+    publish_batch_list batches = tmq_vec_make(publish_batch);
+    publish_batch_index index = tmq_map_str(size_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
+    size_t budget = BROKER_CTL_BUDGET;
+    size_t first = broker->message_ctl_next;
+    while(broker->message_ctl_next < tmq_vec_size(broker->message_ctl_backlog) &&
+          budget-- && time_now() - start < BROKER_CTL_TIME_BUDGET)
+    {
+        message_ctl* ctl = tmq_vec_at(broker->message_ctl_backlog, broker->message_ctl_next++);
         if(ctl->op == SUBSCRIBE || ctl->op == UNSUBSCRIBE)
         {
+            /* messages published before a subscription change are routed before it */
+            route_publish_batches(broker, &batches, &index);
             subscribe_unsubscribe_req req = ctl->context.sub_unsub_req;
             tmq_session_t** session = tmq_map_get(broker->sessions, req.client_id);
             if(!session || (*session)->state == CLOSED)
@@ -216,52 +510,59 @@ static void handle_message_ctl(void* arg)
             /* handle subscribe request */
             if(ctl->op == SUBSCRIBE)
             {
-                /* the subscription will always success. */
-                tmq_suback_pkt* sub_ack = malloc(sizeof(tmq_suback_pkt));
+                /* a malformed $share filter is refused with 0x80 */
+                tmq_suback_pkt* sub_ack = tmq_obj_new(tmq_suback_pkt, OBJ_PACKET);
                 sub_ack->packet_id = req.sub_unsub_pkt.subscribe_pkt.packet_id;
                 tmq_vec_init(&sub_ack->return_codes, uint8_t);
 
-                retain_message_list all_retain = tmq_vec_make(retain_message_t*);
-
                 /* add all the topic filters into the topic tree. */
                 topic_filter_qos* tf = tmq_vec_begin(req.sub_unsub_pkt.subscribe_pkt.topics);
                 for(; tf != tmq_vec_end(req.sub_unsub_pkt.subscribe_pkt.topics); tf++)
                 {
                     tlog_info("subscribe{client=%s, topic=%s, qos=%u}", req.client_id, tf->topic_filter, tf->qos);
-                    retain_message_list retain = tmq_topics_add_subscription(&broker->topics_tree, tf->topic_filter,
-                                                                             req.client_id, tf->qos);
-
-                    tmq_vec_extend(all_retain, retain);
-                    tmq_vec_free(retain);
+                    topic_subscription_t sub;
+                    if(tmq_topics_add_subscription(&broker->topics_tree, tf->topic_filter, *session, tf->qos, &sub) == 0)
+                    {
+                        /* a subscription to the same topic filter replaces the old one */
+                        topic_subscription_t* old = tmq_map_get((*session)->subscriptions, tf->topic_filter);
+                        if(old)
+                            tmq_str_free(old->group_name);
+                        tmq_map_put((*session)->subscriptions, tf->topic_filter, sub);
+                        tmq_vec_push_back(sub_ack->return_codes, tf->qos);
+                    }
+                    else
+                        tmq_vec_push_back(sub_ack->return_codes, 0x80);
                     //tmq_topics_info(&broker->topics_tree);
-                    tmq_vec_push_back(sub_ack->return_codes, tf->qos);
                 }
-                tmq_subscribe_pkt_cleanup(&req.sub_unsub_pkt.subscribe_pkt);
                 ack.packet_type = MQTT_SUBACK;
                 ack.packet = sub_ack;
                 tmq_session_send_packet(*session, &ack);
-                /* send all the retained messages that match the subscription */
-                for(retain_message_t** it = tmq_vec_begin(all_retain); it != tmq_vec_end(all_retain); it++)
+                /* send all the retained messages that match the subscription,
+                 * shared subscriptions don't receive retained messages */
+                tf = tmq_vec_begin(req.sub_unsub_pkt.subscribe_pkt.topics);
+                for(; tf != tmq_vec_end(req.sub_unsub_pkt.subscribe_pkt.topics); tf++)
                 {
-                    retain_message_t* retain_msg = *it;
-                    uint8_t final_qos = tf->qos < retain_msg->retain_msg.qos ? tf->qos :
-                                        retain_msg->retain_msg.qos;
-                    tmq_session_publish(*session, retain_msg->retain_topic,
-                                        retain_msg->retain_msg.message, final_qos, 1);
+                    if(!tmq_topic_filter_is_shared(tf->topic_filter))
+                        start_retain_delivery(broker, *session, tf->topic_filter, tf->qos);
                 }
-                tmq_vec_free(all_retain);
+                tmq_subscribe_pkt_cleanup(&req.sub_unsub_pkt.subscribe_pkt);
             }
             /* handle unsubscribe request */
             else
             {
-                tmq_unsuback_pkt* unsub_ack = malloc(sizeof(tmq_unsuback_pkt));
+                tmq_unsuback_pkt* unsub_ack = tmq_obj_new(tmq_unsuback_pkt, OBJ_PACKET);
                 unsub_ack->packet_id = req.sub_unsub_pkt.unsubscribe_pkt.packet_id;
 
                 tmq_str_t* tf = tmq_vec_begin(req.sub_unsub_pkt.unsubscribe_pkt.topics);
                 for(; tf != tmq_vec_end(req.sub_unsub_pkt.unsubscribe_pkt.topics); tf++)
                 {
                     tlog_info("unsubscribe{client=%s, topic=%s}", req.client_id, *tf);
-                    tmq_topics_remove_subscription(&broker->topics_tree, *tf, req.client_id);
+                    topic_subscription_t* sub = tmq_map_get((*session)->subscriptions, *tf);
+                    if(!sub)
+                        continue;
+                    tmq_topics_drop_subscription(&broker->topics_tree, *session, sub);
+                    tmq_map_erase((*session)->subscriptions, *tf);
+                    cancel_retain_deliveries(broker, *session, *tf);
                     //tmq_topics_info(&broker->topics_tree);
                 }
                 tmq_unsubscribe_pkt_cleanup(&req.sub_unsub_pkt.unsubscribe_pkt);
@@ -271,15 +572,18 @@ static void handle_message_ctl(void* arg)
             }
             tmq_str_free(req.client_id);
         }
-        /* handle publish request */
+        /* publish requests are grouped by topic */
         else
-        {
-            publish_req req = ctl->context.pub_req;
-            tmq_topics_publish(&broker->topics_tree, 0, req.topic, &req.message, req.retain);
-            tmq_str_free(req.topic);
-            tmq_str_free(req.message.message);
-        }
+            batch_publish_req(broker, &batches, &index, &ctl->context.pub_req);
     }
+    route_publish_batches(broker, &batches, &index);
+    tmq_vec_free(batches);
+    tmq_map_free(index);
+    decrementAndGet(broker->message_ctl_depth, broker->message_ctl_next - first);
+    /* the notifications of the requests queued while finishing an old backlog are already consumed */
+    if(broker->message_ctl_next < tmq_vec_size(broker->message_ctl_backlog) || !refilled)
+        tmq_notifier_notify(&broker->message_ctl_notifier);
+    tmq_histogram_record(&broker->message_ctl_latency, time_now() - start);
 }
 
 void mqtt_connect_request(tmq_broker_t* broker, tmq_tcp_conn_t* conn, tmq_connect_pkt* connect_pkt)
@@ -322,6 +626,7 @@ void mqtt_subscribe_unsubscribe_request(tmq_broker_t* broker, subscribe_unsubscr
     pthread_mutex_lock(&broker->message_ctl_lk);
     tmq_vec_push_back(broker->message_ctl_reqs, ctl);
     pthread_mutex_unlock(&broker->message_ctl_lk);
+    incrementAndGet(broker->message_ctl_depth, 1);
 
     tmq_notifier_notify(&broker->message_ctl_notifier);
 }
@@ -329,6 +634,19 @@ void mqtt_subscribe_unsubscribe_request(tmq_broker_t* broker, subscribe_unsubscr
 void mqtt_publish_deliver(void* arg, char* topic, tmq_message* message, uint8_t retain)
 {
     tmq_broker_t* broker = arg;
+    /* nobody subscribes to this topic, a retained message still has to be stored */
+    if(!retain && !tmq_topics_may_match(&broker->topics_tree, topic))
+    {
+        tmq_str_free(message->message);
+        return;
+    }
+    /* route the message in this io thread instead of handing it to the broker thread */
+    if(broker->io_thread_routing)
+    {
+        tmq_topics_reader_publish(&broker->topics_tree, topic, message, retain);
+        tmq_str_free(message->message);
+        return;
+    }
 
     message_ctl ctl = {
             .op = PUBLISH,
@@ -342,21 +660,214 @@ void mqtt_publish_deliver(void* arg, char* topic, tmq_message* message, uint8_t
     pthread_mutex_lock(&broker->message_ctl_lk);
     tmq_vec_push_back(broker->message_ctl_reqs, ctl);
     pthread_mutex_unlock(&broker->message_ctl_lk);
+    incrementAndGet(broker->message_ctl_depth, 1);
 
     tmq_notifier_notify(&broker->message_ctl_notifier);
 }
 
-static void mqtt_publish_forward(tmq_broker_t* broker, char* client_id,
-                                 char* topic, uint8_t required_qos, tmq_message* message)
+int tmq_broker_ingress_blocked(tmq_broker_t* broker)
+{
+    if(!broker->ingress_queue_limit)
+        return 0;
+    /* once blocked, stay blocked until the queues are half drained */
+    size_t limit = atomicGet(broker->ingress_blocked) ? broker->ingress_queue_limit / 2 : broker->ingress_queue_limit;
+    int blocked = atomicGet(broker->message_ctl_depth) > (int64_t) limit;
+    /* with io thread routing, the messages are matched by the publishers' io threads
+     * and wait for the io groups of the subscribers to take them */
+    for(int i = 0; i < MQTT_IO_THREAD && !blocked; i++)
+        blocked = atomicGet(broker->io_groups[i].fanout_depth) > (int64_t) limit ||
+                  atomicGet(broker->io_groups[i].sending_depth) > (int64_t) limit;
+    atomicSet(broker->ingress_blocked, blocked);
+    return blocked;
+}
+
+extern void tmq_session_handle_publish(tmq_session_t* session, tmq_publish_pkt* publish_pkt);
+
+/* stop reading from a publisher while the queues behind it are too deep */
+static void broker_handle_publish(tmq_session_t* session, tmq_publish_pkt* publish_pkt)
 {
-    tmq_session_t** session = tmq_map_get(broker->sessions, client_id);
-    if(!session) return;
-    uint8_t final_qos = required_qos < message->qos ? required_qos : message->qos;
-    /* if this session isn't active, save this message in its context */
-    if((*session)->state == CLOSED)
-        tmq_session_store_publish(*session, topic, message->message, final_qos, 0);
+    tmq_session_handle_publish(session, publish_pkt);
+    if(tmq_broker_ingress_blocked(session->upstream))
+        tmq_io_group_pause_reading(session->conn->group, session->conn);
+}
+
+/* may be called by io threads, the session can't be freed while it is still in the topic tree */
+static void mqtt_publish_forward(tmq_broker_t* broker, void* subscriber, tmq_interned_topic_t* topic,
+                                 uint8_t required_qos, tmq_message* messages, size_t n)
+{
+    tmq_session_t* session = subscriber;
+    /* messages must not overtake the ones still queued to the io group of this session,
+     * no matter whether the session is closed after they are queued */
+    if(broker->topics_tree.fanout_threshold && fanout_pending(broker, io_group_index(broker, session)))
+    {
+        stage_fanout(broker, session, topic, required_qos, messages, n);
+        return;
+    }
+    /* the session may be closed or resumed by the broker thread at the same time */
+    pthread_mutex_lock(&session->lk);
+    /* if this session isn't active, save these messages in its context */
+    if(session->state == CLOSED)
+    {
+        for(size_t i = 0; i < n; i++)
+        {
+            uint8_t final_qos = required_qos < messages[i].qos ? required_qos : messages[i].qos;
+            tmq_session_store_publish(session, topic, messages[i].message, final_qos, 0);
+        }
+    }
+    else
+        tmq_session_publish_batch(session, topic, messages, n, required_qos);
+    pthread_mutex_unlock(&session->lk);
+}
+
+/* called by the broker thread for the subscribers of a topic with a large number of subscribers */
+static void mqtt_publish_fanout(tmq_broker_t* broker, void* subscriber, tmq_interned_topic_t* topic,
+                                uint8_t required_qos, tmq_message* messages, size_t n)
+{
+    tmq_session_t* session = subscriber;
+    /* a closed session stores the messages itself unless its io group still has some of them queued */
+    if(session->state == CLOSED && !fanout_pending(broker, io_group_index(broker, session)))
+        mqtt_publish_forward(broker, subscriber, topic, required_qos, messages, n);
     else
-        tmq_session_publish(*session, topic, message->message, final_qos, 0);
+        stage_fanout(broker, session, topic, required_qos, messages, n);
+}
+
+static int shared_member_load(tmq_broker_t* broker, void* subscriber)
+{
+    tmq_session_t* session = subscriber;
+    if(session->state == CLOSED)
+        return -1;
+    return session->inflight_packets + session->pending_packets;
+}
+
+static const char* subscriber_client_id(void* subscriber)
+{
+    return ((tmq_session_t*) subscriber)->client_id;
+}
+
+static void topic_gc(void* arg)
+{
+    tmq_broker_t* broker = arg;
+    tmq_topics_gc(&broker->topics_tree, TOPIC_GC_BATCH);
+    free_deferred_sessions(broker);
+}
+
+/* objects of each type allocated by the broker and io threads since the last report, and how many of them
+ * had to be malloc-ed. in a steady state they all come from the pools */
+static void log_obj_pool_stats(tmq_broker_t* broker)
+{
+    tmq_obj_pool_t* pools[MQTT_IO_THREAD + 1];
+    pools[0] = &broker->obj_pool;
+    for(int i = 0; i < MQTT_IO_THREAD; i++)
+        pools[i + 1] = &broker->io_groups[i].obj_pool;
+    char counts[512];
+    int len = 0;
+    for(int type = 0; type < OBJ_TYPES; type++)
+    {
+        uint64_t allocs = 0, mallocs = 0;
+        for(int i = 0; i <= MQTT_IO_THREAD; i++)
+        {
+            allocs += atomicExchange(pools[i]->allocs[type], 0);
+            mallocs += atomicExchange(pools[i]->mallocs[type], 0);
+        }
+        len += snprintf(counts + len, sizeof(counts) - len, " %s=%lu/%lu", tmq_obj_type_name(type), mallocs, allocs);
+    }
+    uint64_t remote_freed = 0, held = 0;
+    for(int i = 0; i <= MQTT_IO_THREAD; i++)
+    {
+        remote_freed += atomicExchange(pools[i]->remote_freed, 0);
+        held += atomicGet(pools[i]->held_bytes);
+    }
+    tlog_info("object pools(malloc/alloc):%s freed by other threads=%lu held=%luKB", counts, remote_freed, held / 1024);
+}
+
+static void log_handler_stats(void* arg)
+{
+    tmq_broker_t* broker = arg;
+    tmq_histogram_t session_ctl, message_ctl, send_packets, fanout;
+    tmq_histogram_init(&session_ctl);
+    tmq_histogram_init(&message_ctl);
+    tmq_histogram_init(&send_packets);
+    tmq_histogram_init(&fanout);
+    tmq_histogram_drain(&broker->session_ctl_latency, &session_ctl);
+    tmq_histogram_drain(&broker->message_ctl_latency, &message_ctl);
+    for(int i = 0; i < MQTT_IO_THREAD; i++)
+    {
+        tmq_histogram_drain(&broker->io_groups[i].send_packets_latency, &send_packets);
+        tmq_histogram_drain(&broker->io_groups[i].fanout_latency, &fanout);
+    }
+    tlog_info("handler latency(us) p99/max: session_ctl=%ld/%ld message_ctl=%ld/%ld "
+              "send_packets=%ld/%ld fanout=%ld/%ld",
+              tmq_histogram_percentile(&session_ctl, 99), session_ctl.max,
+              tmq_histogram_percentile(&message_ctl, 99), message_ctl.max,
+              tmq_histogram_percentile(&send_packets, 99), send_packets.max,
+              tmq_histogram_percentile(&fanout, 99), fanout.max);
+    uint64_t dropped = 0, conflated = 0, disconnects = 0, paused = 0;
+    for(int i = 0; i < MQTT_IO_THREAD; i++)
+    {
+        dropped += atomicGet(broker->io_groups[i].dropped_messages);
+        conflated += atomicGet(broker->io_groups[i].conflated_messages);
+        disconnects += atomicGet(broker->io_groups[i].slow_consumer_disconnects);
+        paused += atomicGet(broker->io_groups[i].paused_reads);
+    }
+    tlog_info("egress backpressure: qos0 dropped=%lu conflated=%lu slow consumers disconnected=%lu",
+              dropped, conflated, disconnects);
+    tlog_info("ingress flow control: publishers paused=%lu", paused);
+    uint64_t pool_hits = 0, pool_misses = 0, pool_held = 0;
+    for(int i = 0; i < MQTT_IO_THREAD; i++)
+    {
+        pool_hits += atomicGet(broker->io_groups[i].chunk_pool.hits);
+        pool_misses += atomicGet(broker->io_groups[i].chunk_pool.misses);
+        pool_held += atomicGet(broker->io_groups[i].chunk_pool.held_bytes);
+    }
+    tlog_info("chunk pool: hit rate=%.1f%% (%lu/%lu) held=%luKB",
+              pool_hits + pool_misses ? 100.0 * pool_hits / (pool_hits + pool_misses) : 0.0,
+              pool_hits, pool_hits + pool_misses, pool_held / 1024);
+    size_t conns = 0, idle_conns = 0, conn_memory = 0;
+    for(int i = 0; i < MQTT_IO_THREAD; i++)
+    {
+        conns += atomicGet(broker->io_groups[i].conn_count);
+        idle_conns += atomicGet(broker->io_groups[i].idle_conn_count);
+        conn_memory += atomicGet(broker->io_groups[i].conn_memory);
+    }
+    tlog_info("connection memory: %zu connections(%zu idle) %zuKB, %zu bytes per connection",
+              conns, idle_conns, conn_memory / 1024, conns ? conn_memory / conns : 0);
+    log_obj_pool_stats(broker);
+    if(broker->busy_poll_us)
+    {
+        uint64_t io_spin = 0, io_work = 0;
+        for(int i = 0; i < MQTT_IO_THREAD; i++)
+        {
+            io_spin += atomicExchange(broker->io_groups[i].loop.spin_time, 0);
+            io_work += atomicExchange(broker->io_groups[i].loop.work_time, 0);
+        }
+        tlog_info("busy polling(ms) spin/work: broker=%lu/%lu io=%lu/%lu",
+                  atomicExchange(broker->loop.spin_time, 0) / 1000, atomicExchange(broker->loop.work_time, 0) / 1000,
+                  io_spin / 1000, io_work / 1000);
+    }
+}
+
+static size_t config_get_size(tmq_config_t* conf, const char* key, size_t default_value)
+{
+    tmq_str_t value_str = tmq_config_get(conf, key);
+    size_t value = value_str ? strtoul(value_str, NULL, 10) : default_value;
+    tmq_str_free(value_str);
+    return value;
+}
+
+static shared_policy_e parse_shared_policy(tmq_config_t* conf)
+{
+    shared_policy_e policy = SHARED_ROUND_ROBIN;
+    tmq_str_t policy_str = tmq_config_get(conf, "shared_subscription_policy");
+    if(!policy_str)
+        return policy;
+    if(!strcmp(policy_str, "least_inflight"))
+        policy = SHARED_LEAST_INFLIGHT;
+    else if(!strcmp(policy_str, "sticky"))
+        policy = SHARED_STICKY;
+    else if(strcmp(policy_str, "round_robin") != 0)
+        tlog_warn("unknown shared_subscription_policy %s, use round_robin", policy_str);
+    tmq_str_free(policy_str);
+    return policy;
 }
 
 int tmq_broker_init(tmq_broker_t* broker, const char* cfg)
@@ -382,8 +893,21 @@ int tmq_broker_init(tmq_broker_t* broker, const char* cfg)
     }
     tmq_str_free(pwd_file_path);
 
-    tmq_event_loop_init(&broker->loop);
+    tmq_str_t backend_str = tmq_config_get(&broker->conf, "event_backend");
+    broker->io_uring = backend_str && !strcmp(backend_str, "io_uring");
+    tmq_str_free(backend_str);
+    if(!broker->io_uring)
+        tmq_event_loop_init(&broker->loop);
+    else if(tmq_event_loop_init_uring(&broker->loop) < 0)
+    {
+        tlog_warn("io_uring isn't available, using epoll");
+        broker->io_uring = 0;
+    }
+    else
+        tlog_info("using io_uring");
+    tmq_event_loop_set_owner_only(&broker->loop);
     tmq_codec_init(&broker->codec, SERVER_CODEC);
+    broker->codec.on_publish = broker_handle_publish;
 
     tmq_str_t port_str = tmq_config_get(&broker->conf, "port");
     unsigned int port = port_str ? strtoul(port_str, NULL, 10): 1883;
@@ -394,6 +918,32 @@ int tmq_broker_init(tmq_broker_t* broker, const char* cfg)
     broker->inflight_window_size = inflight_window_str ? strtoul(inflight_window_str, NULL, 10): 1;
     tmq_str_free(inflight_window_str);
 
+    broker->egress_high_water = config_get_size(&broker->conf, "egress_high_water", EGRESS_DEFAULT_HIGH_WATER);
+    broker->egress_low_water = config_get_size(&broker->conf, "egress_low_water", EGRESS_DEFAULT_LOW_WATER);
+    broker->egress_hard_limit = config_get_size(&broker->conf, "egress_hard_limit", EGRESS_DEFAULT_HARD_LIMIT);
+    broker->slow_consumer_timeout = config_get_size(&broker->conf, "slow_consumer_timeout",
+                                                    SLOW_CONSUMER_DEFAULT_TIMEOUT);
+    if(broker->egress_low_water > broker->egress_high_water)
+        broker->egress_low_water = broker->egress_high_water;
+    broker->ingress_queue_limit = config_get_size(&broker->conf, "ingress_queue_limit", INGRESS_DEFAULT_QUEUE_LIMIT);
+    broker->ingress_read_budget = config_get_size(&broker->conf, "ingress_read_budget", INGRESS_DEFAULT_READ_BUDGET);
+    broker->input_ring_size = config_get_size(&broker->conf, "input_ring_size", 0);
+    broker->chunk_pool_limit = config_get_size(&broker->conf, "chunk_pool_limit", CHUNK_POOL_DEFAULT_LIMIT);
+    broker->obj_pool_limit = config_get_size(&broker->conf, "object_pool_limit", OBJ_POOL_DEFAULT_LIMIT);
+    tmq_obj_pool_init(&broker->obj_pool, broker->obj_pool_limit);
+    broker->idle_compact_seconds = config_get_size(&broker->conf, "idle_compact_seconds", IDLE_COMPACT_DEFAULT_SECONDS);
+    broker->message_ctl_depth = 0;
+    broker->ingress_blocked = 0;
+    tmq_str_t edge_triggered_str = tmq_config_get(&broker->conf, "edge_triggered");
+    broker->edge_triggered = edge_triggered_str && !strcmp(edge_triggered_str, "true");
+    tmq_str_free(edge_triggered_str);
+    broker->busy_poll_us = (int64_t) config_get_size(&broker->conf, "busy_poll_us", 0);
+    broker->socket_busy_poll_us = (int) config_get_size(&broker->conf, "socket_busy_poll_us", 0);
+    tmq_event_loop_set_busy_poll(&broker->loop, broker->busy_poll_us);
+    tmq_str_t conflate_str = tmq_config_get(&broker->conf, "conflate_topics");
+    broker->conflate_filters = tmq_str_split(conflate_str, ", ");
+    tmq_str_free(conflate_str);
+
     tmq_acceptor_init(&broker->acceptor, &broker->loop, port);
     tmq_acceptor_set_cb(&broker->acceptor, dispatch_new_connection, broker);
 
@@ -408,12 +958,63 @@ int tmq_broker_init(tmq_broker_t* broker, const char* cfg)
 
     tmq_vec_init(&broker->session_ctl_reqs, session_ctl);
     tmq_vec_init(&broker->message_ctl_reqs, message_ctl);
+    tmq_vec_init(&broker->session_ctl_backlog, session_ctl);
+    tmq_vec_init(&broker->message_ctl_backlog, message_ctl);
+    broker->session_ctl_next = broker->message_ctl_next = 0;
+    tmq_histogram_init(&broker->session_ctl_latency);
+    tmq_histogram_init(&broker->message_ctl_latency);
 
     tmq_notifier_init(&broker->session_ctl_notifier, &broker->loop, handle_session_ctl, broker);
     tmq_notifier_init(&broker->message_ctl_notifier, &broker->loop, handle_message_ctl, broker);
+    tmq_notifier_init(&broker->retain_deliver_notifier, &broker->loop, deliver_retained_messages, broker);
 
     tmq_map_str_init(&broker->sessions, tmq_session_t*, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
-    tmq_topics_init(&broker->topics_tree, broker, mqtt_publish_forward);
+    tmq_topics_init(&broker->topics_tree, broker, mqtt_publish_forward, subscriber_client_id);
+    tmq_topics_set_shared_policy(&broker->topics_tree, parse_shared_policy(&broker->conf), shared_member_load);
+    tmq_str_t routing_str = tmq_config_get(&broker->conf, "io_thread_routing");
+    broker->io_thread_routing = routing_str && !strcmp(routing_str, "true");
+    tmq_str_free(routing_str);
+    if(broker->io_thread_routing)
+    {
+        tmq_topics_enable_concurrent_readers(&broker->topics_tree);
+        tlog_info("publish messages are routed by io threads");
+    }
+    /* io threads deliver the messages they route themselves, fan-out is only used by the broker thread */
+    else
+    {
+        tmq_str_t fanout_str = tmq_config_get(&broker->conf, "fanout_threshold");
+        size_t fanout_threshold = fanout_str ? strtoul(fanout_str, NULL, 10) : FANOUT_DEFAULT_THRESHOLD;
+        tmq_str_free(fanout_str);
+        tmq_topics_set_fanout(&broker->topics_tree, fanout_threshold, mqtt_publish_fanout);
+    }
+    for(int i = 0; i < MQTT_IO_THREAD; i++)
+    {
+        tmq_vec_init(&broker->fanout_staging[i], fanout_req);
+        broker->fanout_group_seq[i] = 0;
+    }
+    broker->fanout_current = NULL;
+    broker->fanout_seq = 0;
+    tmq_vec_init(&broker->deferred_sessions, deferred_session_t);
+    tmq_str_t intern_file = tmq_config_get(&broker->conf, "topic_intern_file");
+    if(intern_file)
+    {
+        int n = tmq_intern_table_preload(&broker->topics_tree.topic_table, intern_file);
+        if(n >= 0)
+            tlog_info("%d topics preloaded from %s", n, intern_file);
+        tmq_str_free(intern_file);
+    }
+    tmq_timer_t* gc_timer = tmq_timer_new(TOPIC_GC_INTERVAL, 1, topic_gc, broker);
+    broker->topic_gc_timer = tmq_event_loop_add_timer(&broker->loop, gc_timer);
+    tmq_vec_init(&broker->retain_deliveries, retain_delivery_t*);
+    broker->retain_delivering = 0;
+    tmq_str_t stats_str = tmq_config_get(&broker->conf, "stats_interval");
+    unsigned int stats_interval = stats_str ? strtoul(stats_str, NULL, 10) : STATS_DEFAULT_INTERVAL;
+    tmq_str_free(stats_str);
+    if(stats_interval)
+    {
+        tmq_timer_t* stats_timer = tmq_timer_new(SEC_MS(stats_interval), 1, log_handler_stats, broker);
+        broker->stats_timer = tmq_event_loop_add_timer(&broker->loop, stats_timer);
+    }
 
     /* ignore SIGPIPE signal */
     signal(SIGPIPE, SIG_IGN);
@@ -426,6 +1027,7 @@ void tmq_broker_run(tmq_broker_t* broker)
     for(int i = 0; i < MQTT_IO_THREAD; i++)
         tmq_io_group_run(&broker->io_groups[i]);
     tmq_acceptor_listen(&broker->acceptor);
+    tmq_obj_pool_attach(&broker->obj_pool);
     tmq_event_loop_run(&broker->loop);
 
     /* clean up */
@@ -437,5 +1039,10 @@ void tmq_broker_run(tmq_broker_t* broker)
         tmq_io_group_stop(&broker->io_groups[i]);
         pthread_join(broker->io_groups[i].io_thread, NULL);
     }
+    for(tmq_str_t* filter = tmq_vec_begin(broker->conflate_filters); filter != tmq_vec_end(broker->conflate_filters); filter++)
+        tmq_str_free(*filter);
+    tmq_vec_free(broker->conflate_filters);
     tmq_event_loop_destroy(&broker->loop);
+    tmq_obj_pool_attach(NULL);
+    tmq_obj_pool_destroy(&broker->obj_pool);
 }
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include "base/mqtt_str.h"
 #include "base/mqtt_map.h"
 #include "base/mqtt_config.h"
+#include "base/mqtt_histogram.h"
 #include "mqtt_codec.h"
 #include "mqtt_io_group.h"
 #include "mqtt_topic.h"
@@ -16,6 +17,57 @@
 
 #define MQTT_IO_THREAD  4
 
+/* retained messages are delivered to a new subscriber in batches every RETAIN_DELIVER_INTERVAL ms */
+#define RETAIN_DELIVER_INTERVAL     10
+#define RETAIN_DELIVER_BATCH        64
+/* stop delivering retained messages while the subscriber's connection has this many bytes unsent */
+#define RETAIN_OUT_BUFFER_HIGH      (256 * 1024)
+/* empty topic tree nodes are reclaimed every TOPIC_GC_INTERVAL ms */
+#define TOPIC_GC_INTERVAL           100
+/* messages to a topic with this many subscribers are delivered by the io groups of the subscribers */
+#define FANOUT_DEFAULT_THRESHOLD    1024
+/* a control handler processes at most BROKER_CTL_BUDGET requests or runs for BROKER_CTL_TIME_BUDGET us,
+ * the remaining requests are left to the next loop iteration so timers and sockets aren't starved */
+#define BROKER_CTL_BUDGET           1024
+#define BROKER_CTL_TIME_BUDGET      2000
+/* handler latencies are logged every STATS_DEFAULT_INTERVAL seconds */
+#define STATS_DEFAULT_INTERVAL      60
+/* qos 0 messages to a connection with more than egress_high_water bytes unsent are dropped and
+ * qos 1/2 messages are held by the session until it drains below egress_low_water.
+ * a connection staying above egress_hard_limit for slow_consumer_timeout seconds is closed */
+#define EGRESS_DEFAULT_HIGH_WATER       (8 * 1024 * 1024)
+#define EGRESS_DEFAULT_LOW_WATER        (2 * 1024 * 1024)
+#define EGRESS_DEFAULT_HARD_LIMIT       (64 * 1024 * 1024)
+#define SLOW_CONSUMER_DEFAULT_TIMEOUT   30
+/* publishing connections stop being read while more than ingress_queue_limit publish requests wait for
+ * the broker thread, an io group's fan-out or an io group to take the packets sent to its connections,
+ * until the queues drop below half of the limit.
+ * paused connections are checked every INGRESS_CHECK_INTERVAL ms */
+#define INGRESS_DEFAULT_QUEUE_LIMIT     65536
+#define INGRESS_CHECK_INTERVAL          10
+/* bytes read from one connection per read event, so a fast publisher can't hog an io thread */
+#define INGRESS_DEFAULT_READ_BUDGET     16384
+/* connections without input for this long are compacted by the checkalive pass */
+#define IDLE_COMPACT_DEFAULT_SECONDS    60
+
+typedef struct retain_delivery_s
+{
+    tmq_str_t client_id;
+    tmq_session_t* session;
+    uint8_t qos;
+    size_t budget;
+    tmq_retain_cursor_t cursor;
+} retain_delivery_t;
+typedef tmq_vec(retain_delivery_t*) retain_delivery_list;
+
+/* a session that can't be freed before the io groups process the fan-out requests queued until seq */
+typedef struct deferred_session_s
+{
+    tmq_session_t* session;
+    uint64_t seq;
+} deferred_session_t;
+typedef tmq_vec(deferred_session_t) deferred_session_list;
+
 typedef tmq_map(char*, tmq_session_t*) tmq_session_map;
 typedef struct tmq_broker_s
 {
@@ -28,20 +80,76 @@ typedef struct tmq_broker_s
     tmq_session_map sessions;
     tmq_topics_t topics_tree;
     uint8_t inflight_window_size;
+    size_t egress_high_water;
+    size_t egress_low_water;
+    size_t egress_hard_limit;
+    unsigned int slow_consumer_timeout;
+    size_t ingress_queue_limit;
+    size_t ingress_read_budget;
+    /* initial size of the ring buffers client input is read into, 0 uses chunked buffers */
+    size_t input_ring_size;
+    /* bytes of free buffer chunks each io thread keeps for reuse */
+    size_t chunk_pool_limit;
+    /* bytes of free objects each thread keeps for reuse, see tmq_obj_pool_t */
+    size_t obj_pool_limit;
+    tmq_obj_pool_t obj_pool;
+    /* buffers and queues of a connection without input for this many seconds are released, 0 disables it */
+    unsigned int idle_compact_seconds;
+    /* client connections are watched in edge-triggered mode */
+    int edge_triggered;
+    /* the broker and io loops keep polling for busy_poll_us after handling events */
+    int64_t busy_poll_us;
+    /* SO_BUSY_POLL of client sockets, 0 leaves it unset */
+    int socket_busy_poll_us;
+    /* the broker and io loops use io_uring instead of epoll */
+    int io_uring;
+    /* requests in message_ctl_reqs and message_ctl_backlog */
+    int64_t message_ctl_depth;
+    int ingress_blocked;
+    /* topic filters of the conflated topics, only the latest qos 0 message of such a topic waits for a subscriber */
+    str_vec conflate_filters;
+    /* publish messages are matched against the topic tree by the io threads */
+    int io_thread_routing;
+    tmq_timerid_t topic_gc_timer;
+
+    /* fan-out requests of the messages being routed, moved to the io groups once a batch is matched */
+    fanout_req_list fanout_staging[MQTT_IO_THREAD];
+    fanout_batch* fanout_current;
+    uint64_t fanout_seq;
+    /* sequence number of the last fan-out requests sent to each io group */
+    uint64_t fanout_group_seq[MQTT_IO_THREAD];
+    deferred_session_list deferred_sessions;
+
+    /* subscribers still receiving the retained messages matching their new subscriptions */
+    retain_delivery_list retain_deliveries;
+    tmq_timerid_t retain_deliver_timer;
+    int retain_delivering;
 
     /* guarded by session_ctl_lk */
     session_ctl_list session_ctl_reqs;
     /* guarded by message_ctl_lk */
     message_ctl_list message_ctl_reqs;
+    /* requests taken from the queues but not processed yet, starting from the index of the next one */
+    session_ctl_list session_ctl_backlog;
+    size_t session_ctl_next;
+    message_ctl_list message_ctl_backlog;
+    size_t message_ctl_next;
+
+    tmq_histogram_t session_ctl_latency;
+    tmq_histogram_t message_ctl_latency;
+    tmq_timerid_t stats_timer;
 
     pthread_mutex_t session_ctl_lk;
     pthread_mutex_t message_ctl_lk;
 
     tmq_notifier_t session_ctl_notifier;
     tmq_notifier_t message_ctl_notifier;
+    tmq_notifier_t retain_deliver_notifier;
 } tmq_broker_t;
 
 int tmq_broker_init(tmq_broker_t* broker, const char* cfg);
 void tmq_broker_run(tmq_broker_t* broker);
+/* whether the io groups should stop reading from publishers, called by io threads */
+int tmq_broker_ingress_blocked(tmq_broker_t* broker);
 
 #endif //TINYMQTT_MQTT_BROKER_H
@@ -167,22 +167,46 @@ static decode_status parse_publish_packet(tmq_codec_t* codec, tmq_tcp_conn_t* co
     tmq_publish_pkt publish_pkt;
     tcp_conn_ctx* ctx = conn->context;
     publish_pkt.flags = FLAGS(ctx->parsing_ctx.fixed_header);
+    publish_pkt.interned = NULL;
     uint16_t topic_name_len;
-    tmq_buffer_read16(buffer, &topic_name_len);
-    publish_pkt.topic = tmq_str_new_len(NULL, topic_name_len);
-    tmq_buffer_read(buffer, publish_pkt.topic, topic_name_len);
-    ssize_t payload_len = len - 2 - topic_name_len;
-
-    if(PUBLISH_QOS(publish_pkt.flags) != 0)
+    /* a packet stored contiguously(e.g. in a ring buffer) is parsed in place */
+    const char* body = tmq_buffer_contiguous(buffer, len);
+    if(body)
     {
-        tmq_buffer_read16(buffer, &publish_pkt.packet_id);
-        payload_len -= 2;
+        if(len < 2)
+            return BAD_PACKET_FORMAT;
+        memcpy(&topic_name_len, body, 2);
+        topic_name_len = be16toh(topic_name_len);
+        ssize_t payload_len = (ssize_t) len - 2 - topic_name_len - (PUBLISH_QOS(publish_pkt.flags) ? 2 : 0);
+        if(payload_len < 0)
+            return BAD_PACKET_FORMAT;
+        publish_pkt.topic = tmq_str_new_len(body + 2, topic_name_len);
+        if(PUBLISH_QOS(publish_pkt.flags) != 0)
+        {
+            memcpy(&publish_pkt.packet_id, body + 2 + topic_name_len, 2);
+            publish_pkt.packet_id = be16toh(publish_pkt.packet_id);
+        }
+        publish_pkt.payload = tmq_str_new_len(body + len - payload_len, payload_len);
+        tmq_buffer_remove(buffer, len);
     }
+    else
+    {
+        tmq_buffer_read16(buffer, &topic_name_len);
+        publish_pkt.topic = tmq_str_new_len(NULL, topic_name_len);
+        tmq_buffer_read(buffer, publish_pkt.topic, topic_name_len);
+        ssize_t payload_len = len - 2 - topic_name_len;
 
-    if(payload_len < 0)
-        return BAD_PACKET_FORMAT;
-    publish_pkt.payload = tmq_str_new_len(NULL, payload_len);
-    tmq_buffer_read(buffer, publish_pkt.payload, payload_len);
+        if(PUBLISH_QOS(publish_pkt.flags) != 0)
+        {
+            tmq_buffer_read16(buffer, &publish_pkt.packet_id);
+            payload_len -= 2;
+        }
+
+        if(payload_len < 0)
+            return BAD_PACKET_FORMAT;
+        publish_pkt.payload = tmq_str_new_len(NULL, payload_len);
+        tmq_buffer_read(buffer, publish_pkt.payload, payload_len);
+    }
 
     /* qos = 1, respond with a puback message */
     if(PUBLISH_QOS(publish_pkt.flags) == 1)
@@ -593,7 +617,7 @@ void send_connack_packet(tmq_tcp_conn_t* conn, void* pkt)
     }
     tmq_vec_push_back(buf, connack_pkt->ack_flags);
     tmq_vec_push_back(buf, connack_pkt->return_code);
-    tmq_tcp_conn_write(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
+    tmq_tcp_conn_write_urgent(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
     tmq_vec_free(buf);
 }
 
@@ -638,7 +662,7 @@ void send_puback_packet(tmq_tcp_conn_t* conn, void* pkt)
     }
     pack_uint16(&buf, puback_pkt->packet_id);
 
-    tmq_tcp_conn_write(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
+    tmq_tcp_conn_write_urgent(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
     tmq_vec_free(buf);
 }
 
@@ -653,7 +677,7 @@ void send_pubrec_packet(tmq_tcp_conn_t* conn, void* pkt)
     }
     pack_uint16(&buf, pubrec_pkt->packet_id);
 
-    tmq_tcp_conn_write(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
+    tmq_tcp_conn_write_urgent(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
     tmq_vec_free(buf);
 }
 
@@ -668,7 +692,7 @@ void send_pubrel_packet(tmq_tcp_conn_t* conn, void* pkt)
     }
     pack_uint16(&buf, pubrel_pkt->packet_id);
 
-    tmq_tcp_conn_write(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
+    tmq_tcp_conn_write_urgent(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
     tmq_vec_free(buf);
 }
 
@@ -683,7 +707,7 @@ void send_pubcomp_packet(tmq_tcp_conn_t* conn, void* pkt)
     }
     pack_uint16(&buf, pubcomp_pkt->packet_id);
 
-    tmq_tcp_conn_write(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
+    tmq_tcp_conn_write_urgent(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
     tmq_vec_free(buf);
 }
 
@@ -728,7 +752,7 @@ void send_suback_packet(tmq_tcp_conn_t* conn, void* pkt)
     uint8_t* code = tmq_vec_begin(suback_pkt->return_codes);
     for(; code != tmq_vec_end(suback_pkt->return_codes); code++)
         tmq_vec_push_back(buf, *code);
-    tmq_tcp_conn_write(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
+    tmq_tcp_conn_write_urgent(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
     tmq_vec_free(buf);
 }
 
@@ -768,7 +792,7 @@ void send_unsuback_packet(tmq_tcp_conn_t* conn, void* pkt)
     }
     pack_uint16(&buf, unsuback_pkt->packet_id);
 
-    tmq_tcp_conn_write(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
+    tmq_tcp_conn_write_urgent(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
     tmq_vec_free(buf);
 }
 
@@ -780,7 +804,7 @@ void send_pingreq_packet(tmq_tcp_conn_t* conn, void* pkt)
         tmq_vec_free(buf);
         return;
     }
-    tmq_tcp_conn_write(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
+    tmq_tcp_conn_write_urgent(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
     tmq_vec_free(buf);
 }
 
@@ -792,7 +816,7 @@ void send_pingresp_packet(tmq_tcp_conn_t* conn, void* pkt)
         tmq_vec_free(buf);
         return;
     }
-    tmq_tcp_conn_write(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
+    tmq_tcp_conn_write_urgent(conn, (char*) tmq_vec_begin(buf), tmq_vec_size(buf));
     tmq_vec_free(buf);
 }
 
@@ -0,0 +1,219 @@
+//
+// Created by zr on 23-7-16.
+//
+#include "mqtt_intern.h"
+#include "base/mqtt_util.h"
+#include "tlog.h"
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned intern_key_hash(const void* key) {return ((const intern_key_t*)key)->hash;}
+
+static int intern_key_equal(const void* k1, const void* k2)
+{
+    const intern_key_t* a = k1, *b = k2;
+    return a->hash == b->hash && !strcmp(a->name, b->name);
+}
+
+void tmq_intern_table_init(tmq_intern_table_t* table)
+{
+    for(int i = 0; i < INTERN_TABLE_STRIPES; i++)
+    {
+        intern_stripe_t* stripe = &table->stripes[i];
+        pthread_mutex_init(&stripe->lk, NULL);
+        tmq_map_custom_init(&stripe->topics, intern_key_t, tmq_interned_topic_t*,
+                            MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR, intern_key_hash, intern_key_equal);
+        stripe->unused_head = stripe->unused_tail = NULL;
+        stripe->unused = 0;
+    }
+    table->next_id = 0;
+}
+
+static void interned_topic_free(tmq_interned_topic_t* topic)
+{
+    tmq_str_free(topic->name);
+    free(topic);
+}
+
+void tmq_intern_table_destroy(tmq_intern_table_t* table)
+{
+    for(int i = 0; i < INTERN_TABLE_STRIPES; i++)
+    {
+        intern_stripe_t* stripe = &table->stripes[i];
+        tmq_map_iter_t it = tmq_map_iter(stripe->topics);
+        for(; tmq_map_has_next(it); tmq_map_next(stripe->topics, it))
+            interned_topic_free(*(tmq_interned_topic_t**)it.second);
+        tmq_map_free(stripe->topics);
+        pthread_mutex_destroy(&stripe->lk);
+    }
+}
+
+/* the unused list is only changed under the stripe lock */
+static void unused_link(intern_stripe_t* stripe, tmq_interned_topic_t* topic)
+{
+    topic->unused_prev = stripe->unused_tail;
+    topic->unused_next = NULL;
+    if(stripe->unused_tail)
+        stripe->unused_tail->unused_next = topic;
+    else
+        stripe->unused_head = topic;
+    stripe->unused_tail = topic;
+    atomicSet(stripe->unused, stripe->unused + 1);
+}
+
+static void unused_unlink(intern_stripe_t* stripe, tmq_interned_topic_t* topic)
+{
+    if(topic->unused_prev)
+        topic->unused_prev->unused_next = topic->unused_next;
+    else
+        stripe->unused_head = topic->unused_next;
+    if(topic->unused_next)
+        topic->unused_next->unused_prev = topic->unused_prev;
+    else
+        stripe->unused_tail = topic->unused_prev;
+    topic->unused_prev = topic->unused_next = NULL;
+    atomicSet(stripe->unused, stripe->unused - 1);
+}
+
+static inline intern_stripe_t* topic_stripe(tmq_intern_table_t* table, unsigned hash)
+{
+    /* the low bits select the bucket inside the stripe map */
+    return &table->stripes[(hash >> 24) % INTERN_TABLE_STRIPES];
+}
+
+static tmq_interned_topic_t* intern_topic(tmq_intern_table_t* table, const char* topic, int pinned)
+{
+    intern_key_t key = {.name = topic, .hash = hash_bytes(topic, strlen(topic))};
+    intern_stripe_t* stripe = topic_stripe(table, key.hash);
+    pthread_mutex_lock(&stripe->lk);
+    tmq_interned_topic_t** found = tmq_map_get_(stripe->topics.base, &key);
+    tmq_interned_topic_t* entry;
+    if(found)
+    {
+        entry = *found;
+        /* revived a topic that was waiting for eviction */
+        if(incrementAndGet(entry->refcnt, 1) == 1 && !entry->pinned)
+            unused_unlink(stripe, entry);
+        if(pinned && !entry->pinned)
+        {
+            entry->pinned = 1;
+            decrementAndGet(entry->refcnt, 1);
+        }
+    }
+    else
+    {
+        entry = malloc(sizeof(tmq_interned_topic_t));
+        if(!entry) fatal_error("malloc() error: out of memory");
+        entry->stripe = stripe;
+        entry->name = tmq_str_new(topic);
+        entry->id = incrementAndGet(table->next_id, 1);
+        entry->hash = key.hash;
+        /* a pinned topic holds no reference for itself */
+        entry->refcnt = pinned ? 0 : 1;
+        entry->pinned = pinned;
+        entry->unused_prev = entry->unused_next = NULL;
+        entry->conflate = TOPIC_CONFLATE_UNKNOWN;
+        key.name = entry->name;
+        tmq_map_put(stripe->topics, key, entry);
+    }
+    pthread_mutex_unlock(&stripe->lk);
+    return entry;
+}
+
+tmq_interned_topic_t* tmq_intern_topic(tmq_intern_table_t* table, const char* topic)
+{
+    return intern_topic(table, topic, 0);
+}
+
+tmq_interned_topic_t* tmq_interned_topic_get(tmq_interned_topic_t* topic)
+{
+    incrementAndGet(topic->refcnt, 1);
+    return topic;
+}
+
+void tmq_interned_topic_put(tmq_interned_topic_t* topic)
+{
+    int refcnt = atomicGet(topic->refcnt);
+    while(refcnt > 1)
+        if(atomicCompareExchange(topic->refcnt, refcnt, refcnt - 1))
+            return;
+    /* the last reference is dropped under the stripe lock, so a topic without holders
+     * is revived and evicted only under the lock */
+    intern_stripe_t* stripe = topic->stripe;
+    pthread_mutex_lock(&stripe->lk);
+    if(!decrementAndGet(topic->refcnt, 1) && !topic->pinned)
+        unused_link(stripe, topic);
+    pthread_mutex_unlock(&stripe->lk);
+}
+
+int tmq_intern_table_preload(tmq_intern_table_t* table, const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if(!fp)
+    {
+        tlog_error("fopen() error %d: %s", errno, strerror(errno));
+        return -1;
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int n = 0;
+    while((len = getline(&line, &cap, fp)) >= 0)
+    {
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+            line[--len] = 0;
+        /* topic names never contain '#', so it starts a comment line */
+        if(!len || line[0] == '#')
+            continue;
+        if(strchr(line, '+'))
+        {
+            tlog_warn("ignored preloaded topic with wildcard: %s", line);
+            continue;
+        }
+        intern_topic(table, line, 1);
+        n++;
+    }
+    free(line);
+    fclose(fp);
+    return n;
+}
+
+size_t tmq_intern_table_evict(tmq_intern_table_t* table, size_t max_unused)
+{
+    size_t evicted = 0;
+    size_t stripe_max = max_unused / INTERN_TABLE_STRIPES;
+    for(int i = 0; i < INTERN_TABLE_STRIPES; i++)
+    {
+        intern_stripe_t* stripe = &table->stripes[i];
+        /* the lock is released between batches, so interning isn't stalled by a large eviction */
+        while(atomicGet(stripe->unused) > stripe_max)
+        {
+            pthread_mutex_lock(&stripe->lk);
+            for(int n = 0; n < INTERN_EVICT_BATCH && stripe->unused > stripe_max; n++)
+            {
+                tmq_interned_topic_t* victim = stripe->unused_head;
+                unused_unlink(stripe, victim);
+                intern_key_t key = {.name = victim->name, .hash = victim->hash};
+                tmq_map_erase(stripe->topics, key);
+                interned_topic_free(victim);
+                evicted++;
+            }
+            pthread_mutex_unlock(&stripe->lk);
+        }
+    }
+    return evicted;
+}
+
+size_t tmq_intern_table_size(tmq_intern_table_t* table)
+{
+    size_t size = 0;
+    for(int i = 0; i < INTERN_TABLE_STRIPES; i++)
+    {
+        pthread_mutex_lock(&table->stripes[i].lk);
+        size += tmq_map_size(table->stripes[i].topics);
+        pthread_mutex_unlock(&table->stripes[i].lk);
+    }
+    return size;
+}
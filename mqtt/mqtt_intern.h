@@ -0,0 +1,77 @@
+//
+// Created by zr on 23-7-16.
+//
+
+#ifndef TINYMQTT_MQTT_INTERN_H
+#define TINYMQTT_MQTT_INTERN_H
+#include "base/mqtt_str.h"
+#include "base/mqtt_map.h"
+#include <pthread.h>
+
+/* the table is split into stripes by topic hash, so threads interning different topics rarely contend */
+#define INTERN_TABLE_STRIPES    16
+/* topics without holders kept in the table, so topics published again soon aren't interned again */
+#define INTERN_MAX_UNUSED       4096
+/* a stripe lock is held for at most INTERN_EVICT_BATCH evictions at a time */
+#define INTERN_EVICT_BATCH      256
+
+/* whether the qos 0 messages of a topic are conflated, resolved against the configured filters on first use */
+#define TOPIC_CONFLATE_UNKNOWN  0
+#define TOPIC_CONFLATE_YES      1
+#define TOPIC_CONFLATE_NO       2
+
+struct intern_stripe_s;
+
+/* a topic name shared by all the messages published to it */
+typedef struct tmq_interned_topic_s
+{
+    struct intern_stripe_s* stripe;
+    tmq_str_t name;
+    uint32_t id;
+    unsigned hash;
+    /* number of holders, an unpinned topic is evicted some time after it drops to zero */
+    int refcnt;
+    /* links in the unused list of the stripe while the topic has no holders */
+    struct tmq_interned_topic_s* unused_prev, *unused_next;
+    /* preloaded topics are never evicted */
+    uint8_t pinned;
+    uint8_t conflate;
+} tmq_interned_topic_t;
+
+/* carries the hash of the name, so a topic is hashed only once for both the stripe and the bucket */
+typedef struct intern_key_s
+{
+    const char* name;
+    unsigned hash;
+} intern_key_t;
+
+typedef tmq_map(intern_key_t, tmq_interned_topic_t*) interned_topic_map;
+typedef struct intern_stripe_s
+{
+    pthread_mutex_t lk;
+    interned_topic_map topics;
+    /* unpinned topics without holders in the order they lost their last holder, evicted from the head */
+    tmq_interned_topic_t* unused_head, *unused_tail;
+    size_t unused;
+} intern_stripe_t;
+
+typedef struct tmq_intern_table_s
+{
+    intern_stripe_t stripes[INTERN_TABLE_STRIPES];
+    uint32_t next_id;
+} tmq_intern_table_t;
+
+void tmq_intern_table_init(tmq_intern_table_t* table);
+void tmq_intern_table_destroy(tmq_intern_table_t* table);
+/* returns the interned topic with a reference held by the caller */
+tmq_interned_topic_t* tmq_intern_topic(tmq_intern_table_t* table, const char* topic);
+tmq_interned_topic_t* tmq_interned_topic_get(tmq_interned_topic_t* topic);
+void tmq_interned_topic_put(tmq_interned_topic_t* topic);
+/* intern the topics listed in a file, one per line, and pin them. returns the number of topics or -1 on error */
+int tmq_intern_table_preload(tmq_intern_table_t* table, const char* path);
+/* evict the least recently used topics without holders until each stripe keeps at most
+ * max_unused / INTERN_TABLE_STRIPES of them, returns the number of topics evicted */
+size_t tmq_intern_table_evict(tmq_intern_table_t* table, size_t max_unused);
+size_t tmq_intern_table_size(tmq_intern_table_t* table);
+
+#endif //TINYMQTT_MQTT_INTERN_H
@@ -49,20 +49,42 @@ static void tcp_checkalive(void* arg)
 
     int64_t now = time_now();
     tmq_vec(tmq_tcp_conn_t*) timeout_conns = tmq_vec_make(tmq_tcp_conn_t*);
+    int64_t idle_period = SEC_US(group->broker->idle_compact_seconds);
+    size_t conns = 0, idle_conns = 0, memory = 0;
     tmq_map_iter_t it = tmq_map_iter(group->tcp_conns);
     for(; tmq_map_has_next(it); tmq_map_next(group->tcp_conns, it))
     {
         tmq_tcp_conn_t* conn = *(tmq_tcp_conn_t**) (it.second);
-        tcp_conn_ctx* ctx = conn->context;
+        tcp_conn_broker_ctx* ctx = conn->context;
         if((ctx->conn_state == NO_SESSION && now - ctx->last_msg_time > SEC_US(MQTT_CONNECT_MAX_PENDING)) ||
            (ctx->conn_state != NO_SESSION && now - ctx->last_msg_time > SEC_US(MQTT_TCP_MAX_IDLE)))
+        {
             tmq_vec_push_back(timeout_conns, conn);
+            continue;
+        }
+        if(idle_period && now - ctx->last_msg_time > idle_period)
+        {
+            tmq_tcp_conn_compact(conn);
+            tcp_conn_broker_ctx_compact(ctx);
+            if(ctx->conn_state == IN_SESSION)
+                tmq_session_compact(ctx->upstream.session);
+            idle_conns++;
+        }
+        conns++;
+        memory += tmq_tcp_conn_memory(conn) + tcp_conn_broker_ctx_memory(ctx);
+        if(ctx->conn_state == IN_SESSION)
+            memory += tmq_session_memory(ctx->upstream.session);
     }
+    atomicSet(group->conn_count, conns);
+    atomicSet(group->idle_conn_count, idle_conns);
+    atomicSet(group->conn_memory, memory);
     /* do remove after iteration to prevent iterator failure */
     tmq_tcp_conn_t** conn_it = tmq_vec_begin(timeout_conns);
     for(; conn_it != tmq_vec_end(timeout_conns); conn_it++)
         tmq_tcp_conn_close(get_ref(*conn_it));
     tmq_vec_free(timeout_conns);
+    tmq_chunk_pool_trim(&group->chunk_pool);
+    tmq_obj_pool_trim(&group->obj_pool);
 }
 
 static void mqtt_keepalive(void* arg)
@@ -71,14 +93,31 @@ static void mqtt_keepalive(void* arg)
 
     int64_t now = time_now();
     tmq_vec(tmq_tcp_conn_t*) timeout_conns = tmq_vec_make(tmq_tcp_conn_t*);
+    tmq_vec(tmq_tcp_conn_t*) slow_conns = tmq_vec_make(tmq_tcp_conn_t*);
     tmq_map_iter_t it = tmq_map_iter(group->tcp_conns);
     for(; tmq_map_has_next(it); tmq_map_next(group->tcp_conns, it))
     {
         tmq_tcp_conn_t* conn = *(tmq_tcp_conn_t**) (it.second);
-        tcp_conn_ctx* ctx = conn->context;
+        tcp_conn_broker_ctx* ctx = conn->context;
         if(ctx->conn_state != IN_SESSION)
             continue;
         tmq_session_t* session = ctx->upstream.session;
+        /* a consumer that can't keep up is disconnected before it takes up all the memory */
+        if(group->broker->egress_hard_limit && tmq_tcp_conn_pending_bytes(conn) > group->broker->egress_hard_limit)
+        {
+            if(!ctx->over_limit_since)
+                ctx->over_limit_since = now;
+            else if(now - ctx->over_limit_since >= SEC_US(group->broker->slow_consumer_timeout))
+            {
+                tlog_warn("client[%s] is too slow, %zu bytes unsent", session->client_id,
+                          tmq_tcp_conn_pending_bytes(conn));
+                incrementAndGet(group->slow_consumer_disconnects, 1);
+                tmq_vec_push_back(slow_conns, conn);
+                continue;
+            }
+        }
+        else
+            ctx->over_limit_since = 0;
         if(!session->keep_alive)
             continue;
         if(now - session->last_pkt_ts >= (int64_t) SEC_US(session->keep_alive * 1.5))
@@ -92,9 +131,27 @@ static void mqtt_keepalive(void* arg)
     for(; conn_it != tmq_vec_end(timeout_conns); conn_it++)
         tmq_tcp_conn_close(get_ref(*conn_it));
     tmq_vec_free(timeout_conns);
+    /* the output of a slow consumer may never drain, don't wait for it */
+    for(conn_it = tmq_vec_begin(slow_conns); conn_it != tmq_vec_end(slow_conns); conn_it++)
+        tmq_tcp_conn_abort(get_ref(*conn_it));
+    tmq_vec_free(slow_conns);
 }
 
 extern void tcp_conn_broker_ctx_cleanup(void* arg);
+static void flush_conflated(void* arg);
+
+/* the congestion of the connection ended, send the messages held by its session */
+static void tcp_conn_drained(tmq_tcp_conn_t* conn, void* arg)
+{
+    tcp_conn_ctx* ctx = conn->context;
+    if(ctx->conn_state != IN_SESSION)
+        return;
+    tmq_session_t* session = ctx->upstream.session;
+    pthread_mutex_lock(&session->lk);
+    if(session->state == OPEN)
+        tmq_session_send_pending(session);
+    pthread_mutex_unlock(&session->lk);
+}
 
 static void handle_new_connection(void* arg)
 {
@@ -110,19 +167,39 @@ static void handle_new_connection(void* arg)
         tmq_tcp_conn_t* conn = tmq_tcp_conn_new(&group->loop, group, *it, &group->broker->codec);
         conn->on_close = tcp_conn_cleanup;
         conn->state = CONNECTED;
+        tmq_tcp_conn_set_water_marks(conn, group->broker->egress_high_water,
+                                     group->broker->egress_low_water, tcp_conn_drained);
+        tmq_tcp_conn_set_read_budget(conn, group->broker->ingress_read_budget);
+        if(group->broker->input_ring_size && tmq_tcp_conn_set_ring_input(conn, group->broker->input_ring_size) < 0)
+            tlog_warn("can't map the input ring buffer, use chunks");
+        if(group->broker->edge_triggered)
+            tmq_tcp_conn_set_edge_triggered(conn);
+        if(group->broker->socket_busy_poll_us && tmq_socket_busy_poll(*it, group->broker->socket_busy_poll_us) < 0)
+            tlog_warn("setsockopt(SO_BUSY_POLL) error %d: %s", errno, strerror(errno));
 
         tcp_conn_broker_ctx* conn_ctx = malloc(sizeof(tcp_conn_broker_ctx));
         tmq_vec_init(&conn_ctx->pending_packets, tmq_any_packet_t);
+        tmq_vec_init(&conn_ctx->send_queue, tmq_any_packet_t);
+        conn_ctx->send_head = 0;
+        conn_ctx->over_limit_since = 0;
+        tmq_vec_init(&conn_ctx->conflated, tmq_any_packet_t);
+        conn_ctx->conflated_index.base = NULL;
         conn_ctx->upstream.broker = group->broker;
         conn_ctx->conn_state = NO_SESSION;
         conn_ctx->parsing_ctx.state = PARSING_FIXED_HEADER;
         conn_ctx->last_msg_time = time_now();
         tmq_tcp_conn_set_context(conn, conn_ctx, tcp_conn_broker_ctx_cleanup);
+        if(!tmq_vec_empty(group->broker->conflate_filters))
+        {
+            conn->on_write_complete = flush_conflated;
+            conn->cb_arg = conn;
+        }
 
         char conn_name[50];
         tmq_tcp_conn_id(conn, conn_name, sizeof(conn_name));
         tmq_map_put(group->tcp_conns, conn_name, get_ref(conn));
-        assert(conn->ref_cnt == 1);
+        /* the recv in flight of io_uring holds a reference too */
+        assert(conn->ref_cnt == (conn->recv_armed ? 2 : 1));
 
         tlog_info("new connection [%s] group=%p thread=%lu", conn_name, group, mqtt_tid);
     }
@@ -182,30 +259,260 @@ static void handle_new_session(void* arg)
     tmq_vec_free(resps);
 }
 
+/* qos 0 messages to a congested connection are dropped, qos 1/2 messages are already held by the session */
+static int drop_publish(tmq_io_group_t* group, tmq_tcp_conn_t* conn, tmq_any_packet_t* pkt)
+{
+    if(!conn->congested || pkt->packet_type != MQTT_PUBLISH ||
+       PUBLISH_QOS(((tmq_publish_pkt*) pkt->packet)->flags) != 0)
+        return 0;
+    tmq_any_pkt_cleanup(pkt);
+    incrementAndGet(group->dropped_messages, 1);
+    return 1;
+}
+
+static int topic_conflated(tmq_broker_t* broker, tmq_publish_pkt* publish_pkt)
+{
+    if(!publish_pkt->interned || PUBLISH_QOS(publish_pkt->flags) || tmq_vec_empty(broker->conflate_filters))
+        return 0;
+    uint8_t conflate = atomicGet(publish_pkt->interned->conflate);
+    if(conflate == TOPIC_CONFLATE_UNKNOWN)
+    {
+        conflate = TOPIC_CONFLATE_NO;
+        for(tmq_str_t* filter = tmq_vec_begin(broker->conflate_filters);
+            filter != tmq_vec_end(broker->conflate_filters) && conflate == TOPIC_CONFLATE_NO; filter++)
+        {
+            if(tmq_topic_filter_match(*filter, publish_pkt->topic))
+                conflate = TOPIC_CONFLATE_YES;
+        }
+        atomicSet(publish_pkt->interned->conflate, conflate);
+    }
+    return conflate == TOPIC_CONFLATE_YES;
+}
+
+/* a message of a conflated topic waits while the connection has unsent output,
+ * and is replaced in place if a newer message of the topic comes before it's written */
+static int conflate_publish(tmq_io_group_t* group, tmq_tcp_conn_t* conn, tmq_any_packet_t* pkt)
+{
+    tcp_conn_broker_ctx* ctx = conn->context;
+    if(pkt->packet_type != MQTT_PUBLISH || !topic_conflated(group->broker, pkt->packet))
+        return 0;
+    if(!tmq_tcp_conn_pending_bytes(conn) && tmq_vec_empty(ctx->conflated))
+        return 0;
+    if(!ctx->conflated_index.base)
+        tmq_map_64_init(&ctx->conflated_index, size_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
+    tmq_interned_topic_t* topic = ((tmq_publish_pkt*) pkt->packet)->interned;
+    size_t* idx = tmq_map_get(ctx->conflated_index, topic);
+    if(idx)
+    {
+        tmq_any_pkt_cleanup(tmq_vec_at(ctx->conflated, *idx));
+        tmq_vec_set(ctx->conflated, *idx, *pkt);
+        incrementAndGet(group->conflated_messages, 1);
+    }
+    else
+    {
+        tmq_map_put(ctx->conflated_index, topic, tmq_vec_size(ctx->conflated));
+        tmq_vec_push_back(ctx->conflated, *pkt);
+    }
+    return 1;
+}
+
+/* the output of the connection is written, send the conflated messages */
+static void flush_conflated(void* arg)
+{
+    tmq_tcp_conn_t* conn = arg;
+    tcp_conn_broker_ctx* ctx = conn->context;
+    if(tmq_vec_empty(ctx->conflated) || conn->state != CONNECTED)
+        return;
+    packet_list conflated = tmq_vec_make(tmq_any_packet_t);
+    tmq_vec_swap(conflated, ctx->conflated);
+    tmq_map_clear(ctx->conflated_index);
+    for(tmq_any_packet_t* pkt = tmq_vec_begin(conflated); pkt != tmq_vec_end(conflated); pkt++)
+    {
+        send_any_packet(conn, pkt);
+        tmq_any_pkt_cleanup(pkt);
+    }
+    tmq_vec_free(conflated);
+}
+
 static void send_packets(void* arg)
 {
     tmq_io_group_t *group = arg;
+    int64_t start = time_now();
 
     packet_send_list packets = tmq_vec_make(packet_send_req);
     pthread_mutex_lock(&group->sending_packets_lk);
     tmq_vec_swap(packets, group->sending_packets);
     pthread_mutex_unlock(&group->sending_packets_lk);
+    decrementAndGet(group->sending_depth, tmq_vec_size(packets));
 
+    /* move the packets into the send queues of their connections,
+     * a connection joins the round-robin with the reference of its first packet */
     packet_send_req* req = tmq_vec_begin(packets);
     for(; req != tmq_vec_end(packets); req++)
     {
-        send_any_packet(req->conn, &req->pkt);
-        tmq_any_pkt_cleanup(&req->pkt);
-        release_ref(req->conn);
+        /* control packets don't wait for their turn, they're written ahead of the queued messages */
+        if(req->pkt.packet_type != MQTT_PUBLISH)
+        {
+            send_any_packet(req->conn, &req->pkt);
+            tmq_any_pkt_cleanup(&req->pkt);
+            release_ref(req->conn);
+            continue;
+        }
+        if(drop_publish(group, req->conn, &req->pkt) || conflate_publish(group, req->conn, &req->pkt))
+        {
+            release_ref(req->conn);
+            continue;
+        }
+        tcp_conn_broker_ctx* ctx = req->conn->context;
+        if(tmq_vec_empty(ctx->send_queue))
+            tmq_vec_push_back(group->send_conns, req->conn);
+        else
+            release_ref(req->conn);
+        tmq_vec_push_back(ctx->send_queue, req->pkt);
     }
     tmq_vec_free(packets);
+
+    size_t budget = SEND_PACKETS_BUDGET;
+    while(budget && !tmq_vec_empty(group->send_conns) && time_now() - start < IO_HANDLER_TIME_BUDGET)
+    {
+        if(group->send_next >= tmq_vec_size(group->send_conns))
+            group->send_next = 0;
+        tmq_tcp_conn_t* conn = *tmq_vec_at(group->send_conns, group->send_next);
+        tcp_conn_broker_ctx* ctx = conn->context;
+        size_t n = 0;
+        for(; n < SEND_PACKETS_QUANTUM && n < budget && ctx->send_head < tmq_vec_size(ctx->send_queue); n++)
+        {
+            tmq_any_packet_t* pkt = tmq_vec_at(ctx->send_queue, ctx->send_head++);
+            if(drop_publish(group, conn, pkt) || conflate_publish(group, conn, pkt))
+                continue;
+            send_any_packet(conn, pkt);
+            tmq_any_pkt_cleanup(pkt);
+        }
+        budget -= n;
+        if(ctx->send_head < tmq_vec_size(ctx->send_queue))
+        {
+            group->send_next++;
+            continue;
+        }
+        /* the queue is drained, the last connection takes its place in the round-robin */
+        tmq_vec_clear(ctx->send_queue);
+        ctx->send_head = 0;
+        tmq_vec_set(group->send_conns, group->send_next, *tmq_vec_at(group->send_conns, tmq_vec_size(group->send_conns) - 1));
+        tmq_vec_pop_back(group->send_conns);
+        release_ref(conn);
+    }
+    if(!tmq_vec_empty(group->send_conns))
+        tmq_notifier_notify(&group->sending_packets_notifier);
+    tmq_histogram_record(&group->send_packets_latency, time_now() - start);
+}
+
+static void fanout_messages(void* arg)
+{
+    tmq_io_group_t* group = arg;
+    int64_t start = time_now();
+
+    int refilled = 0;
+    if(group->fanout_next == tmq_vec_size(group->fanout_backlog))
+    {
+        tmq_vec_clear(group->fanout_backlog);
+        group->fanout_next = 0;
+        pthread_mutex_lock(&group->fanout_reqs_lk);
+        tmq_vec_swap(group->fanout_backlog, group->fanout_reqs);
+        group->fanout_backlog_seq = group->fanout_queued_seq;
+        pthread_mutex_unlock(&group->fanout_reqs_lk);
+        refilled = 1;
+    }
+    size_t budget = FANOUT_BUDGET;
+    size_t first = group->fanout_next;
+    while(group->fanout_next < tmq_vec_size(group->fanout_backlog) &&
+          budget-- && time_now() - start < IO_HANDLER_TIME_BUDGET)
+    {
+        fanout_req* req = tmq_vec_at(group->fanout_backlog, group->fanout_next++);
+        tmq_session_t* session = req->session;
+        fanout_batch* batch = req->batch;
+        pthread_mutex_lock(&session->lk);
+        if(session->state == CLOSED)
+        {
+            for(size_t i = 0; i < batch->n; i++)
+            {
+                uint8_t qos = req->qos < batch->messages[i].qos ? req->qos : batch->messages[i].qos;
+                tmq_session_store_publish(session, batch->topic, batch->messages[i].message, qos, 0);
+            }
+        }
+        else
+            tmq_session_publish_batch(session, batch->topic, batch->messages, batch->n, req->qos);
+        pthread_mutex_unlock(&session->lk);
+        fanout_batch_release(batch);
+    }
+    decrementAndGet(group->fanout_depth, group->fanout_next - first);
+    if(group->fanout_next < tmq_vec_size(group->fanout_backlog))
+        tmq_notifier_notify(&group->fanout_notifier);
+    /* the sessions in these requests can be freed by the broker now */
+    else
+    {
+        atomicSet(group->fanout_done_seq, group->fanout_backlog_seq);
+        /* pick up the requests queued while the old backlog was processed */
+        if(!refilled)
+            tmq_notifier_notify(&group->fanout_notifier);
+    }
+    tmq_histogram_record(&group->fanout_latency, time_now() - start);
+}
+
+void tmq_io_group_add_fanout(tmq_io_group_t* group, fanout_req_list* reqs, uint64_t seq)
+{
+    pthread_mutex_lock(&group->fanout_reqs_lk);
+    tmq_vec_extend(group->fanout_reqs, *reqs);
+    group->fanout_queued_seq = seq;
+    pthread_mutex_unlock(&group->fanout_reqs_lk);
+    incrementAndGet(group->fanout_depth, tmq_vec_size(*reqs));
+    tmq_vec_clear(*reqs);
+
+    tmq_notifier_notify(&group->fanout_notifier);
+}
+
+static void resume_reading(void* arg)
+{
+    tmq_io_group_t* group = arg;
+    if(tmq_broker_ingress_blocked(group->broker))
+    {
+        tmq_timer_t* timer = tmq_timer_new(INGRESS_CHECK_INTERVAL, 0, resume_reading, group);
+        tmq_event_loop_add_timer(&group->loop, timer);
+        return;
+    }
+    for(tmq_tcp_conn_t** conn = tmq_vec_begin(group->paused_conns); conn != tmq_vec_end(group->paused_conns); conn++)
+    {
+        tmq_tcp_conn_resume_reading(*conn);
+        release_ref(*conn);
+    }
+    tmq_vec_clear(group->paused_conns);
+}
+
+void tmq_io_group_pause_reading(tmq_io_group_t* group, tmq_tcp_conn_t* conn)
+{
+    if(conn->reading_paused)
+        return;
+    tmq_tcp_conn_pause_reading(conn);
+    incrementAndGet(group->paused_reads, 1);
+    /* the first paused connection starts the check for resuming */
+    if(tmq_vec_empty(group->paused_conns))
+    {
+        tmq_timer_t* timer = tmq_timer_new(INGRESS_CHECK_INTERVAL, 0, resume_reading, group);
+        tmq_event_loop_add_timer(&group->loop, timer);
+    }
+    tmq_vec_push_back(group->paused_conns, get_ref(conn));
 }
 
 void tmq_io_group_init(tmq_io_group_t* group, tmq_broker_t* broker)
 {
     group->broker = broker;
-    tmq_event_loop_init(&group->loop);
+    if(!broker->io_uring || tmq_event_loop_init_uring(&group->loop) < 0)
+        tmq_event_loop_init(&group->loop);
+    /* connections are only handled by the io thread, the broker hands them over through the notifiers */
+    tmq_event_loop_set_owner_only(&group->loop);
+    tmq_event_loop_set_busy_poll(&group->loop, broker->busy_poll_us);
     tmq_map_str_init(&group->tcp_conns, tmq_tcp_conn_t*, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
+    tmq_chunk_pool_init(&group->chunk_pool, broker->chunk_pool_limit);
+    tmq_obj_pool_init(&group->obj_pool, broker->obj_pool_limit);
 
     tmq_timer_t* timer = tmq_timer_new(SEC_MS(MQTT_TCP_CHECKALIVE_INTERVAL), 1, tcp_checkalive, group);
     group->tcp_checkalive_timer = tmq_event_loop_add_timer(&group->loop, timer);
@@ -218,26 +525,59 @@ void tmq_io_group_init(tmq_io_group_t* group, tmq_broker_t* broker)
         fatal_error("pthread_mutex_init() error %d: %s", errno, strerror(errno));
     if(pthread_mutex_init(&group->sending_packets_lk, NULL))
         fatal_error("pthread_mutex_init() error %d: %s", errno, strerror(errno));
+    if(pthread_mutex_init(&group->fanout_reqs_lk, NULL))
+        fatal_error("pthread_mutex_init() error %d: %s", errno, strerror(errno));
 
     tmq_vec_init(&group->pending_conns, tmq_socket_t);
     tmq_vec_init(&group->connect_resp, session_connect_resp);
     tmq_vec_init(&group->sending_packets, packet_send_req);
+    tmq_vec_init(&group->fanout_reqs, fanout_req);
+    group->fanout_queued_seq = group->fanout_done_seq = 0;
+    tmq_vec_init(&group->fanout_backlog, fanout_req);
+    group->fanout_next = 0;
+    group->fanout_backlog_seq = 0;
+    tmq_vec_init(&group->send_conns, tmq_tcp_conn_t*);
+    group->send_next = 0;
+    group->fanout_depth = 0;
+    group->sending_depth = 0;
+    tmq_vec_init(&group->paused_conns, tmq_tcp_conn_t*);
+    tmq_histogram_init(&group->send_packets_latency);
+    tmq_histogram_init(&group->fanout_latency);
+    group->dropped_messages = group->conflated_messages = 0;
+    group->slow_consumer_disconnects = group->paused_reads = 0;
+    group->conn_count = group->idle_conn_count = group->conn_memory = 0;
 
     tmq_notifier_init(&group->new_conn_notifier, &group->loop, handle_new_connection, group);
     tmq_notifier_init(&group->connect_resp_notifier, &group->loop, handle_new_session, group);
     tmq_notifier_init(&group->sending_packets_notifier, &group->loop, send_packets, group);
+    tmq_notifier_init(&group->fanout_notifier, &group->loop, fanout_messages, group);
 }
 
 static void* io_group_thread_func(void* arg)
 {
     tmq_io_group_t* group = (tmq_io_group_t*) arg;
+    tmq_chunk_pool_attach(&group->chunk_pool);
+    tmq_obj_pool_attach(&group->obj_pool);
     tmq_event_loop_run(&group->loop);
 
     /* clean up */
-    /* free all connections in the connection map */
+    for(tmq_tcp_conn_t** conn = tmq_vec_begin(group->send_conns); conn != tmq_vec_end(group->send_conns); conn++)
+        release_ref(*conn);
+    tmq_vec_free(group->send_conns);
+    for(tmq_tcp_conn_t** conn = tmq_vec_begin(group->paused_conns); conn != tmq_vec_end(group->paused_conns); conn++)
+        release_ref(*conn);
+    tmq_vec_free(group->paused_conns);
+    /* free all connections in the connection map,
+     * their handlers are still registered and would be freed again by tmq_event_loop_destroy() */
     tmq_map_iter_t it = tmq_map_iter(group->tcp_conns);
     for(; tmq_map_has_next(it); tmq_map_next(group->tcp_conns, it))
-        tmq_tcp_conn_free(*(tmq_tcp_conn_t**)it.second);
+    {
+        tmq_tcp_conn_t* conn = *(tmq_tcp_conn_t**)it.second;
+        tmq_handler_unregister(&group->loop, conn->read_event_handler);
+        tmq_handler_unregister(&group->loop, conn->error_close_handler);
+        tmq_handler_unregister(&group->loop, conn->write_event_handler);
+        tmq_tcp_conn_free(conn);
+    }
     tmq_map_free(group->tcp_conns);
 
     /* close pending conns in the pending list */
@@ -250,16 +590,28 @@ static void* io_group_thread_func(void* arg)
     for(; req != tmq_vec_end(group->sending_packets); req++)
         tmq_any_pkt_cleanup(&req->pkt);
     tmq_vec_free(group->sending_packets);
+    for(fanout_req* freq = tmq_vec_begin(group->fanout_reqs); freq != tmq_vec_end(group->fanout_reqs); freq++)
+        fanout_batch_release(freq->batch);
+    tmq_vec_free(group->fanout_reqs);
+    for(size_t i = group->fanout_next; i < tmq_vec_size(group->fanout_backlog); i++)
+        fanout_batch_release(tmq_vec_at(group->fanout_backlog, i)->batch);
+    tmq_vec_free(group->fanout_backlog);
 
     tmq_notifier_destroy(&group->new_conn_notifier);
     tmq_notifier_destroy(&group->connect_resp_notifier);
     tmq_notifier_destroy(&group->sending_packets_notifier);
+    tmq_notifier_destroy(&group->fanout_notifier);
 
     pthread_mutex_destroy(&group->pending_conns_lk);
     pthread_mutex_destroy(&group->connect_resp_lk);
     pthread_mutex_destroy(&group->sending_packets_lk);
+    pthread_mutex_destroy(&group->fanout_reqs_lk);
 
     tmq_event_loop_destroy(&group->loop);
+    tmq_chunk_pool_attach(NULL);
+    tmq_chunk_pool_destroy(&group->chunk_pool);
+    tmq_obj_pool_attach(NULL);
+    tmq_obj_pool_destroy(&group->obj_pool);
 }
 
 void tmq_io_group_run(tmq_io_group_t* group)
@@ -5,13 +5,24 @@
 #ifndef TINYMQTT_MQTT_IO_GROUP_H
 #define TINYMQTT_MQTT_IO_GROUP_H
 #include "event/mqtt_event.h"
+#include "base/mqtt_histogram.h"
+#include "net/mqtt_buffer.h"
+#include "base/mqtt_obj_pool.h"
 #include "mqtt_types.h"
 
 #define MQTT_TCP_CHECKALIVE_INTERVAL    10
 #define MQTT_CONNECT_MAX_PENDING        10
 #define MQTT_TCP_MAX_IDLE               600
+/* connections with queued packets take turns to send at most SEND_PACKETS_QUANTUM packets,
+ * until SEND_PACKETS_BUDGET packets are sent or IO_HANDLER_TIME_BUDGET us passed in one handler call */
+#define SEND_PACKETS_BUDGET             4096
+#define SEND_PACKETS_QUANTUM            16
+/* fan-out requests processed in one handler call */
+#define FANOUT_BUDGET                   1024
+#define IO_HANDLER_TIME_BUDGET          2000
 
 typedef tmq_map(char*, tmq_tcp_conn_t*) tcp_conn_map_t;
+typedef tmq_vec(tmq_tcp_conn_t*) tcp_conn_list;
 typedef struct tmq_io_group_s
 {
     tmq_broker_t* broker;
@@ -27,18 +38,62 @@ typedef struct tmq_io_group_s
     connect_resp_list connect_resp;
     /* guarded by sending_packets_lk */
     packet_send_list sending_packets;
+    /* guarded by fanout_reqs_lk */
+    fanout_req_list fanout_reqs;
+    /* sequence number of the last fan-out requests queued, guarded by fanout_reqs_lk */
+    uint64_t fanout_queued_seq;
+    /* sequence number of the last fan-out requests processed */
+    uint64_t fanout_done_seq;
+    /* requests taken from fanout_reqs but not processed yet, starting from fanout_next */
+    fanout_req_list fanout_backlog;
+    size_t fanout_next;
+    uint64_t fanout_backlog_seq;
+    /* connections with packets in their send queues, served in round-robin from send_next */
+    tcp_conn_list send_conns;
+    size_t send_next;
+    /* fan-out requests queued but not processed yet */
+    int64_t fanout_depth;
+    /* packets in sending_packets, not moved to the send queues yet */
+    int64_t sending_depth;
+    /* publishers not being read because the broker is overloaded */
+    tcp_conn_list paused_conns;
+    /* buffer chunks shared by the connections of the group, attached to the io thread */
+    tmq_chunk_pool_t chunk_pool;
+    /* connections, handlers, timers and packets allocated by the io thread */
+    tmq_obj_pool_t obj_pool;
+
+    tmq_histogram_t send_packets_latency;
+    tmq_histogram_t fanout_latency;
+    /* qos 0 messages dropped for congested connections */
+    uint64_t dropped_messages;
+    /* qos 0 messages replaced by a newer message of the same conflated topic */
+    uint64_t conflated_messages;
+    /* connections closed for staying above the egress hard limit */
+    uint64_t slow_consumer_disconnects;
+    /* times a publisher was paused */
+    uint64_t paused_reads;
+    /* connections of the group, the idle ones among them and the heap bytes they hold,
+     * counted by the last checkalive pass */
+    size_t conn_count, idle_conn_count, conn_memory;
 
     pthread_mutex_t pending_conns_lk;
     pthread_mutex_t connect_resp_lk;
     pthread_mutex_t sending_packets_lk;
+    pthread_mutex_t fanout_reqs_lk;
 
     tmq_notifier_t new_conn_notifier;
     tmq_notifier_t connect_resp_notifier;
     tmq_notifier_t sending_packets_notifier;
+    tmq_notifier_t fanout_notifier;
 } tmq_io_group_t;
 
 void tmq_io_group_init(tmq_io_group_t* group, tmq_broker_t* broker);
 void tmq_io_group_run(tmq_io_group_t* group);
 void tmq_io_group_stop(tmq_io_group_t* group);
+/* called by the broker thread, the requests are moved into the io group */
+void tmq_io_group_add_fanout(tmq_io_group_t* group, fanout_req_list* reqs, uint64_t seq);
+/* stop reading from the connection until the broker catches up */
+void tmq_io_group_pause_reading(tmq_io_group_t* group, tmq_tcp_conn_t* conn);
+
 
 #endif //TINYMQTT_MQTT_IO_GROUP_H
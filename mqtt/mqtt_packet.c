@@ -3,6 +3,7 @@
 //
 #include "mqtt_packet.h"
 #include "tlog.h"
+#include "base/mqtt_obj_pool.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -19,7 +20,10 @@ void tmq_connect_pkt_cleanup(void* pkt)
 void tmq_publish_pkt_cleanup(void* pkt)
 {
     tmq_publish_pkt* publish_pkt = pkt;
-    tmq_str_free(publish_pkt->topic);
+    if(publish_pkt->interned)
+        tmq_interned_topic_put(publish_pkt->interned);
+    else
+        tmq_str_free(publish_pkt->topic);
     tmq_str_free(publish_pkt->payload);
 }
 
@@ -59,21 +63,24 @@ void tmq_any_pkt_cleanup(tmq_any_packet_t* any_pkt)
 {
     if(any_packet_cleanup_fps[any_pkt->packet_type])
         any_packet_cleanup_fps[any_pkt->packet_type](any_pkt->packet);
-    free(any_pkt->packet);
+    tmq_obj_free(any_pkt->packet);
 }
 
 tmq_publish_pkt* tmq_publish_pkt_clone(tmq_publish_pkt* pkt)
 {
-    tmq_publish_pkt* clone = malloc(sizeof(tmq_publish_pkt));
+    tmq_publish_pkt* clone = tmq_obj_new(tmq_publish_pkt, OBJ_PACKET);
     memcpy(clone, pkt, sizeof(tmq_publish_pkt));
-    clone->topic = tmq_str_new(pkt->topic);
+    if(pkt->interned)
+        tmq_interned_topic_get(pkt->interned);
+    else
+        clone->topic = tmq_str_new(pkt->topic);
     clone->payload = tmq_str_new(pkt->payload);
     return clone;
 }
 
 tmq_pubrel_pkt* tmq_pubrel_pkt_clone(tmq_pubrel_pkt* pkt)
 {
-    tmq_pubrel_pkt* clone = malloc(sizeof(tmq_pubrel_pkt));
+    tmq_pubrel_pkt* clone = tmq_obj_new(tmq_pubrel_pkt, OBJ_PACKET);
     clone->packet_id = pkt->packet_id;
     return clone;
 }
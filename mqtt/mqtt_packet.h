@@ -5,6 +5,7 @@
 #ifndef TINYMQTT_MQTT_PACKET_H
 #define TINYMQTT_MQTT_PACKET_H
 #include "base/mqtt_str.h"
+#include "mqtt_intern.h"
 #include <stdint.h>
 
 typedef enum tmq_packet_type_e
@@ -65,6 +66,8 @@ typedef struct tmq_publish_pkt
     tmq_str_t topic;
     uint16_t packet_id; /* only for qos 1 and 2 */
     tmq_str_t payload;
+    /* if set, topic is the name of this interned topic and is not owned by the packet */
+    tmq_interned_topic_t* interned;
 } tmq_publish_pkt;
 
 #define PUBLISH_QOS(flags)      (((flags) >> 1) & 0x03)
@@ -0,0 +1,251 @@
+//
+// Created by zr on 23-7-2.
+//
+#include "mqtt_retain.h"
+#include "base/mqtt_util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static retain_node_t* retain_node_new(int level, const char* topic, tmq_message* message)
+{
+    retain_node_t* node = malloc(sizeof(retain_node_t) + level * sizeof(retain_node_t*));
+    if(!node) fatal_error("malloc() error: out of memory");
+    node->level = level;
+    bzero(node->next, level * sizeof(retain_node_t*));
+    node->message.retain_topic = topic ? tmq_str_new(topic) : NULL;
+    node->message.retain_msg.message = message ? tmq_str_new(message->message) : NULL;
+    node->message.retain_msg.qos = message ? message->qos : 0;
+    return node;
+}
+
+static void retain_node_free(retain_node_t* node)
+{
+    tmq_str_free(node->message.retain_topic);
+    tmq_str_free(node->message.retain_msg.message);
+    free(node);
+}
+
+static int random_level(tmq_retain_store_t* store)
+{
+    int level = 1;
+    /* every level is promoted with probability 1/4 */
+    while(level < RETAIN_SKIPLIST_MAX_LEVEL && (rand_r(&store->rand_seed) & 3) == 0)
+        level++;
+    return level;
+}
+
+void tmq_retain_store_init(tmq_retain_store_t* store)
+{
+    if(!store) return;
+    pthread_mutex_init(&store->lk, NULL);
+    store->head = retain_node_new(RETAIN_SKIPLIST_MAX_LEVEL, NULL, NULL);
+    store->level = 1;
+    store->size = 0;
+    store->rand_seed = time(NULL);
+}
+
+/* find the last node whose topic is less than the given topic on every level */
+static void find_predecessors(tmq_retain_store_t* store, const char* topic, retain_node_t** update)
+{
+    retain_node_t* node = store->head;
+    for(int i = store->level - 1; i >= 0; i--)
+    {
+        while(node->next[i] && strcmp(node->next[i]->message.retain_topic, topic) < 0)
+            node = node->next[i];
+        update[i] = node;
+    }
+}
+
+/* the first node whose topic is greater than (or equal to, if inclusive is set) the given topic */
+static retain_node_t* lower_bound(tmq_retain_store_t* store, const char* topic, int inclusive)
+{
+    retain_node_t* node = store->head;
+    for(int i = store->level - 1; i >= 0; i--)
+    {
+        while(node->next[i])
+        {
+            int cmp = strcmp(node->next[i]->message.retain_topic, topic);
+            if(cmp < 0 || (cmp == 0 && !inclusive))
+                node = node->next[i];
+            else break;
+        }
+    }
+    return node->next[0];
+}
+
+static void retain_store_put(tmq_retain_store_t* store, const char* topic, tmq_message* message)
+{
+    retain_node_t* update[RETAIN_SKIPLIST_MAX_LEVEL];
+    find_predecessors(store, topic, update);
+    retain_node_t* node = update[0]->next[0];
+    int exist = node && !strcmp(node->message.retain_topic, topic);
+    /* a retained message with zero-byte payload clears the retained message of this topic */
+    if(!message->message || !tmq_str_len(message->message))
+    {
+        if(!exist) return;
+        for(int i = 0; i < node->level; i++)
+            update[i]->next[i] = node->next[i];
+        while(store->level > 1 && !store->head->next[store->level - 1])
+            store->level--;
+        retain_node_free(node);
+        store->size--;
+        return;
+    }
+    if(exist)
+    {
+        node->message.retain_msg.message = tmq_str_assign(node->message.retain_msg.message, message->message);
+        node->message.retain_msg.qos = message->qos;
+        return;
+    }
+    int level = random_level(store);
+    for(int i = store->level; i < level; i++)
+        update[i] = store->head;
+    if(level > store->level)
+        store->level = level;
+    node = retain_node_new(level, topic, message);
+    for(int i = 0; i < level; i++)
+    {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+    store->size++;
+}
+
+void tmq_retain_store_put(tmq_retain_store_t* store, const char* topic, tmq_message* message)
+{
+    pthread_mutex_lock(&store->lk);
+    retain_store_put(store, topic, message);
+    pthread_mutex_unlock(&store->lk);
+}
+
+static retain_message_t* retain_store_find(tmq_retain_store_t* store, const char* topic)
+{
+    retain_node_t* node = lower_bound(store, topic, 1);
+    if(node && !strcmp(node->message.retain_topic, topic))
+        return &node->message;
+    return NULL;
+}
+
+retain_message_t* tmq_retain_store_get(tmq_retain_store_t* store, const char* topic)
+{
+    pthread_mutex_lock(&store->lk);
+    retain_message_t* retain_msg = retain_store_find(store, topic);
+    pthread_mutex_unlock(&store->lk);
+    return retain_msg;
+}
+
+size_t tmq_retain_store_size(tmq_retain_store_t* store) {return store->size;}
+
+void tmq_retain_store_destroy(tmq_retain_store_t* store)
+{
+    if(!store) return;
+    retain_node_t* node = store->head, *next;
+    while(node)
+    {
+        next = node->next[0];
+        retain_node_free(node);
+        node = next;
+    }
+    store->head = NULL;
+    store->size = 0;
+    pthread_mutex_destroy(&store->lk);
+}
+
+void tmq_retain_cursor_init(tmq_retain_cursor_t* cursor, const char* topic_filter)
+{
+    cursor->topic_filter = tmq_str_new(topic_filter);
+    cursor->last_topic = NULL;
+    cursor->done = 0;
+    const char* wildcard = strpbrk(topic_filter, "+#");
+    if(!wildcard)
+        cursor->prefix = tmq_str_new(topic_filter);
+    /* "a/b/+" => "a/b", the trailing '/' is dropped because "a/b/#" also matches "a/b" */
+    else
+        cursor->prefix = tmq_str_new_len(topic_filter, wildcard > topic_filter ? wildcard - topic_filter - 1 : 0);
+}
+
+void tmq_retain_cursor_destroy(tmq_retain_cursor_t* cursor)
+{
+    tmq_str_free(cursor->topic_filter);
+    tmq_str_free(cursor->prefix);
+    tmq_str_free(cursor->last_topic);
+}
+
+static size_t retain_store_scan(tmq_retain_store_t* store, tmq_retain_cursor_t* cursor,
+                                size_t max_scan, retain_scan_cb cb, void* arg)
+{
+    size_t prefix_len = tmq_str_len(cursor->prefix);
+    /* a filter without wildcards matches at most one topic, no need to scan */
+    if(prefix_len == tmq_str_len(cursor->topic_filter))
+    {
+        retain_message_t* retain_msg = retain_store_find(store, cursor->topic_filter);
+        if(retain_msg && cb(arg, retain_msg))
+            return 0;
+        cursor->done = 1;
+        return retain_msg != NULL;
+    }
+    retain_node_t* node = cursor->last_topic ? lower_bound(store, cursor->last_topic, 0) :
+                          lower_bound(store, cursor->prefix, 1);
+    retain_node_t* last = NULL;
+    size_t scanned = 0, accepted = 0;
+    for(; node && scanned < max_scan; node = node->next[0], scanned++)
+    {
+        if(strncmp(node->message.retain_topic, cursor->prefix, prefix_len) != 0)
+            break;
+        if(tmq_topic_filter_match(cursor->topic_filter, node->message.retain_topic))
+        {
+            if(cb(arg, &node->message))
+                break;
+            accepted++;
+        }
+        last = node;
+    }
+    if(last)
+    {
+        if(!cursor->last_topic)
+            cursor->last_topic = tmq_str_new(last->message.retain_topic);
+        else
+            cursor->last_topic = tmq_str_assign(cursor->last_topic, last->message.retain_topic);
+    }
+    /* reached the end of the prefix range */
+    if(!node || strncmp(node->message.retain_topic, cursor->prefix, prefix_len) != 0)
+        cursor->done = 1;
+    return accepted;
+}
+
+size_t tmq_retain_store_scan(tmq_retain_store_t* store, tmq_retain_cursor_t* cursor,
+                             size_t max_scan, retain_scan_cb cb, void* arg)
+{
+    if(cursor->done) return 0;
+    pthread_mutex_lock(&store->lk);
+    size_t accepted = retain_store_scan(store, cursor, max_scan, cb, arg);
+    pthread_mutex_unlock(&store->lk);
+    return accepted;
+}
+
+int tmq_topic_filter_match(const char* topic_filter, const char* topic)
+{
+    const char* f = topic_filter, *t = topic;
+    while(1)
+    {
+        const char* f_end = strchrnul(f, '/');
+        const char* t_end = strchrnul(t, '/');
+        if(f_end - f == 1 && *f == '#')
+            return 1;
+        if(!(f_end - f == 1 && *f == '+'))
+        {
+            if(f_end - f != t_end - t || strncmp(f, t, f_end - f) != 0)
+                return 0;
+        }
+        if(!*f_end && !*t_end)
+            return 1;
+        /* "a/#" includes the parent "a" */
+        if(!*t_end)
+            return !strcmp(f_end, "/#");
+        if(!*f_end)
+            return 0;
+        f = f_end + 1;
+        t = t_end + 1;
+    }
+}
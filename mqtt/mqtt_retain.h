@@ -0,0 +1,71 @@
+//
+// Created by zr on 23-7-2.
+//
+
+#ifndef TINYMQTT_MQTT_RETAIN_H
+#define TINYMQTT_MQTT_RETAIN_H
+#include "base/mqtt_str.h"
+#include "mqtt_types.h"
+#include <pthread.h>
+
+#define RETAIN_SKIPLIST_MAX_LEVEL   24
+/* max number of retained messages examined by one scan step */
+#define RETAIN_SCAN_BATCH           256
+
+typedef struct retain_message_s
+{
+    tmq_message retain_msg;
+    tmq_str_t retain_topic;
+} retain_message_t;
+
+typedef struct retain_node_s
+{
+    retain_message_t message;
+    int level;
+    struct retain_node_s* next[];
+} retain_node_t;
+
+/* retained messages sorted by topic name in a skiplist,
+ * so messages sharing a topic prefix are adjacent and can be scanned as a range.
+ * the store is shared by all threads routing messages and guarded by lk. */
+typedef struct tmq_retain_store_s
+{
+    pthread_mutex_t lk;
+    retain_node_t* head;
+    int level;
+    size_t size;
+    unsigned int rand_seed;
+} tmq_retain_store_t;
+
+/* position of a incremental scan over the retained messages matching a topic filter */
+typedef struct tmq_retain_cursor_s
+{
+    tmq_str_t topic_filter;
+    /* the literal part of the filter before the first wildcard, all matching topics start with it */
+    tmq_str_t prefix;
+    /* the last topic handed out, the next scan step resumes right after it */
+    tmq_str_t last_topic;
+    int done;
+} tmq_retain_cursor_t;
+
+/* return non-zero to stop the scan, the message will be handed out again by the next scan step */
+typedef int(*retain_scan_cb)(void* arg, retain_message_t* retain_msg);
+
+void tmq_retain_store_init(tmq_retain_store_t* store);
+/* store a retained message under the topic, a message with empty payload removes the retained message */
+void tmq_retain_store_put(tmq_retain_store_t* store, const char* topic, tmq_message* message);
+/* the returned message is only valid until the retained message of this topic is replaced */
+retain_message_t* tmq_retain_store_get(tmq_retain_store_t* store, const char* topic);
+size_t tmq_retain_store_size(tmq_retain_store_t* store);
+void tmq_retain_store_destroy(tmq_retain_store_t* store);
+
+void tmq_retain_cursor_init(tmq_retain_cursor_t* cursor, const char* topic_filter);
+void tmq_retain_cursor_destroy(tmq_retain_cursor_t* cursor);
+/* examine at most max_scan retained messages after the cursor, call cb for the ones matching the filter.
+ * returns the number of messages accepted by cb. */
+size_t tmq_retain_store_scan(tmq_retain_store_t* store, tmq_retain_cursor_t* cursor,
+                             size_t max_scan, retain_scan_cb cb, void* arg);
+
+int tmq_topic_filter_match(const char* topic_filter, const char* topic);
+
+#endif //TINYMQTT_MQTT_RETAIN_H
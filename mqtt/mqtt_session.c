@@ -5,6 +5,7 @@
 #include "mqtt_io_group.h"
 #include "net/mqtt_tcp_conn.h"
 #include "base/mqtt_util.h"
+#include "base/mqtt_obj_pool.h"
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -16,7 +17,7 @@ extern void on_mqtt_unsubscribe_response(tiny_mqtt* mqtt, tmq_unsuback_pkt* unsu
 
 static sending_packet* sending_packet_new(tmq_packet_type type, void* pkt, uint16_t packet_id)
 {
-    sending_packet* sending_pkt = malloc(sizeof(sending_packet));
+    sending_packet* sending_pkt = tmq_obj_new(sending_packet, OBJ_SENDING_PACKET);
     if(!sending_pkt) fatal_error("malloc() error: out of memory");
     sending_pkt->packet_id = packet_id;
     sending_pkt->packet.packet_type = type;
@@ -26,6 +27,21 @@ static sending_packet* sending_packet_new(tmq_packet_type type, void* pkt, uint1
     return sending_pkt;
 }
 
+/* move the first pending packet into the inflight window, called with sending_queue_lk held */
+static void send_pending_packet(tmq_session_t* session)
+{
+    tmq_any_packet_t send = session->pending_pointer->packet;
+    if(send.packet_type == MQTT_PUBLISH)
+        send.packet = tmq_publish_pkt_clone(session->pending_pointer->packet.packet);
+    else send.packet = tmq_pubrel_pkt_clone(session->pending_pointer->packet.packet);
+    tmq_session_send_packet(session, &send);
+
+    session->pending_pointer->send_time = time_now();
+    session->pending_pointer = session->pending_pointer->next;
+    session->inflight_packets++;
+    session->pending_packets--;
+}
+
 static int accknowledge(tmq_session_t* session, uint16_t packet_id, tmq_packet_type type, int qos)
 {
     int ack_success = 0;
@@ -56,28 +72,19 @@ static int accknowledge(tmq_session_t* session, uint16_t packet_id, tmq_packet_t
         if(session->sending_queue_tail == remove)
             session->sending_queue_tail = session->sending_queue_head ? (sending_packet*) p: NULL;
         tmq_any_pkt_cleanup(&remove->packet);
-        free(remove);
+        tmq_obj_free(remove);
         session->inflight_packets--;
         ack_success = 1;
         break;
     }
-    if(session->pending_pointer && ack_success)
-    {
-        tmq_any_packet_t send = session->pending_pointer->packet;
-        if(send.packet_type == MQTT_PUBLISH)
-            send.packet = tmq_publish_pkt_clone(session->pending_pointer->packet.packet);
-        else send.packet = tmq_pubrel_pkt_clone(session->pending_pointer->packet.packet);
-        tmq_session_send_packet(session, &send);
-
-        session->pending_pointer->send_time = time_now();
-        session->pending_pointer = session->pending_pointer->next;
-        session->inflight_packets++;
-    }
+    if(session->pending_pointer && ack_success && !atomicGet(session->conn->congested))
+        send_pending_packet(session);
     pthread_mutex_unlock(&session->sending_queue_lk);
     return ack_success;
 }
 
-static int store_sending_packet(tmq_session_t* session, sending_packet* sending_pkt)
+/* the packet is held in the sending queue if hold is set, even if there is a free inflight slot */
+static int store_sending_packet(tmq_session_t* session, sending_packet* sending_pkt, int hold)
 {
     pthread_mutex_lock(&session->sending_queue_lk);
     int send_now = 1;
@@ -91,12 +98,13 @@ static int store_sending_packet(tmq_session_t* session, sending_packet* sending_
     }
     /* if the number of inflight packets less than the inflight window size,
      * this packet can be sent immediately */
-    if(session->inflight_packets < session->inflight_window_size)
+    if(session->inflight_packets < session->inflight_window_size && !hold)
         session->inflight_packets++;
     /* otherwise, it must wait for sending in the sending_queue */
     else
     {
         send_now = 0;
+        session->pending_packets++;
         if(!session->pending_pointer)
             session->pending_pointer = sending_pkt;
     }
@@ -104,16 +112,19 @@ static int store_sending_packet(tmq_session_t* session, sending_packet* sending_
     return send_now;
 }
 
-static void resend_messages(void* arg)
+/* resend the inflight packets sent at least min_age us ago */
+static void resend_inflight(tmq_session_t* session, int64_t min_age)
 {
     int64_t now = time_now();
-    tmq_session_t* session = arg;
+    /* resending to a congested connection only piles up more unsent data */
+    if(atomicGet(session->conn->congested))
+        return;
     pthread_mutex_lock(&session->sending_queue_lk);
     sending_packet* sending_pkt = session->sending_queue_head;
     int cnt = 0;
     while(sending_pkt && cnt++ < session->inflight_packets)
     {
-        if(now - sending_pkt->send_time >= SEC_US(RESEND_INTERVAL))
+        if(now - sending_pkt->send_time >= min_age)
         {
             tmq_any_packet_t send = sending_pkt->packet;
             if(send.packet_type == MQTT_PUBLISH)
@@ -126,11 +137,16 @@ static void resend_messages(void* arg)
     pthread_mutex_unlock(&session->sending_queue_lk);
 }
 
+static void resend_messages(void* arg)
+{
+    resend_inflight(arg, SEC_US(RESEND_INTERVAL));
+}
+
 tmq_session_t* tmq_session_new(void* upstream, new_message_cb on_new_message, close_cb on_close, tmq_tcp_conn_t* conn,
                                char* client_id, uint8_t clean_session, uint16_t keep_alive, char* will_topic,
                                char* will_message, uint8_t will_qos, uint8_t will_retain, uint8_t max_inflight)
 {
-    tmq_session_t* session = malloc(sizeof(tmq_session_t));
+    tmq_session_t* session = tmq_obj_new(tmq_session_t, OBJ_SESSION);
     if(!session) fatal_error("malloc() error: out of memory");
     bzero(session, sizeof(tmq_session_t));
     session->upstream = upstream;
@@ -156,16 +172,22 @@ tmq_session_t* tmq_session_new(void* upstream, new_message_cb on_new_message, cl
 
     session->sending_queue_head = session->sending_queue_tail = NULL;
 
-    tmq_map_str_init(&session->subscriptions, uint8_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
-    tmq_map_32_init(&session->qos2_packet_ids, uint8_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
-    pthread_mutex_init(&session->lk, NULL);
+    tmq_map_str_init(&session->subscriptions, topic_subscription_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
+    session->qos2_packet_ids.base = NULL;
+    /* the lock is held while publishing a message, which may acquire it again */
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&session->lk, &attr);
+    pthread_mutexattr_destroy(&attr);
     pthread_mutex_init(&session->sending_queue_lk, NULL);
     return session;
 }
 
 void tmq_session_start(tmq_session_t* session)
 {
-    resend_messages(session);
+    /* the packets unacknowledged by the last connection are resent before any new one, in their original order */
+    resend_inflight(session, 0);
     if (session->inflight_packets > 0)
     {
         tmq_timer_t* timer = tmq_timer_new(SEC_MS(RESEND_INTERVAL), 1, resend_messages, session);
@@ -175,13 +197,16 @@ void tmq_session_start(tmq_session_t* session)
 
 void tmq_session_close(tmq_session_t* session)
 {
+    pthread_mutex_lock(&session->lk);
+    /* the connection is released only once, a closed session may be closed again when it is discarded */
     if(session->state == OPEN)
     {
         tmq_event_loop_cancel_timer(session->conn->loop, session->resend_timer);
         session->state = CLOSED;
+        if(session->conn)
+            release_ref(session->conn);
     }
-    if(session->conn)
-        release_ref(session->conn);
+    pthread_mutex_unlock(&session->lk);
     if(session->on_close)
         session->on_close(session->upstream, session);
 }
@@ -189,26 +214,32 @@ void tmq_session_close(tmq_session_t* session)
 void tmq_session_free(tmq_session_t* session)
 {
     tmq_str_free(session->client_id);
+    tmq_map_iter_t it = tmq_map_iter(session->subscriptions);
+    for(; tmq_map_has_next(it); tmq_map_next(session->subscriptions, it))
+        tmq_str_free(((topic_subscription_t*) it.second)->group_name);
     tmq_map_free(session->subscriptions);
-    tmq_map_free(session->qos2_packet_ids);
+    if(session->qos2_packet_ids.base)
+        tmq_map_free(session->qos2_packet_ids);
     sending_packet* sending_pkt = session->sending_queue_head;
     while(sending_pkt)
     {
         sending_packet * next = sending_pkt->next;
         tmq_any_pkt_cleanup(&sending_pkt->packet);
-        free(sending_pkt);
+        tmq_obj_free(sending_pkt);
         sending_pkt = next;
     }
     pthread_mutex_destroy(&session->sending_queue_lk);
     pthread_mutex_destroy(&session->lk);
-    free(session);
+    tmq_obj_free(session);
 }
 
 void tmq_session_resume(tmq_session_t* session, tmq_tcp_conn_t* conn, uint16_t keep_alive, char* will_topic,
                         char* will_message, uint8_t will_qos, uint8_t will_retain)
 {
+    pthread_mutex_lock(&session->lk);
     session->conn = get_ref(conn);
     session->state = OPEN;
+    pthread_mutex_unlock(&session->lk);
     session->last_pkt_ts = time_now();
     session->keep_alive = keep_alive;
     session->will_publish_req.topic = NULL;
@@ -225,9 +256,6 @@ void tmq_session_resume(tmq_session_t* session, tmq_tcp_conn_t* conn, uint16_t k
 void tmq_session_handle_subscribe(tmq_session_t* session, tmq_subscribe_pkt* subscribe_pkt)
 {
     session->last_pkt_ts = time_now();
-    topic_filter_qos* tf = tmq_vec_begin(subscribe_pkt->topics);
-    for(; tf != tmq_vec_end(subscribe_pkt->topics); tf++)
-        tmq_map_put(session->subscriptions, tf->topic_filter, tf->qos);
     subscribe_unsubscribe_req req = {
             .client_id = tmq_str_new(session->client_id),
             .sub_unsub_pkt.subscribe_pkt = *subscribe_pkt
@@ -238,8 +266,6 @@ void tmq_session_handle_subscribe(tmq_session_t* session, tmq_subscribe_pkt* sub
 void tmq_session_handle_unsubscribe(tmq_session_t* session, tmq_unsubscribe_pkt* unsubscribe_pkt)
 {
     session->last_pkt_ts = time_now();
-    for(tmq_str_t* tf = tmq_vec_begin(unsubscribe_pkt->topics); tf != tmq_vec_end(unsubscribe_pkt->topics); tf++)
-        tmq_map_erase(session->subscriptions, *tf);
     subscribe_unsubscribe_req req = {
             .client_id = tmq_str_new(session->client_id),
             .sub_unsub_pkt.unsubscribe_pkt = *unsubscribe_pkt
@@ -271,6 +297,8 @@ void tmq_session_handle_publish(tmq_session_t* session, tmq_publish_pkt* publish
     {
         /* if this is the first time that receive this publish message,
          * store the packet id and deliver this message */
+        if(!session->qos2_packet_ids.base)
+            tmq_map_32_init(&session->qos2_packet_ids, uint8_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
         if(tmq_map_get(session->qos2_packet_ids, publish_pkt->packet_id) == NULL)
             tmq_map_put(session->qos2_packet_ids, publish_pkt->packet_id, 1);
             /* if it is a redelivered message, just discard it. */
@@ -305,11 +333,11 @@ void tmq_session_handle_pubrec(tmq_session_t* session, tmq_pubrec_pkt* pubrec_pk
     session->last_pkt_ts = time_now();
     if(accknowledge(session, pubrec_pkt->packet_id, MQTT_PUBLISH, 2))
     {
-        tmq_pubrel_pkt* pubrel_pkt = malloc(sizeof(tmq_pubrel_pkt));
+        tmq_pubrel_pkt* pubrel_pkt = tmq_obj_new(tmq_pubrel_pkt, OBJ_PACKET);
         pubrel_pkt->packet_id = pubrec_pkt->packet_id;
 
         sending_packet* sending_pkt = sending_packet_new(MQTT_PUBREL, pubrel_pkt, pubrel_pkt->packet_id);
-        if(store_sending_packet(session, sending_pkt))
+        if(store_sending_packet(session, sending_pkt, 0))
         {
             tmq_any_packet_t pkt = {
                     .packet_type = MQTT_PUBREL,
@@ -324,7 +352,8 @@ void tmq_session_handle_pubrec(tmq_session_t* session, tmq_pubrec_pkt* pubrec_pk
 void tmq_session_handle_pubrel(tmq_session_t* session, tmq_pubrel_pkt* pubrel_pkt)
 {
     session->last_pkt_ts = time_now();
-    tmq_map_erase(session->qos2_packet_ids, pubrel_pkt->packet_id);
+    if(session->qos2_packet_ids.base)
+        tmq_map_erase(session->qos2_packet_ids, pubrel_pkt->packet_id);
 }
 
 void tmq_session_handle_pubcomp(tmq_session_t* session, tmq_pubcomp_pkt* pubcomp_pkt)
@@ -341,56 +370,82 @@ void tmq_session_handle_pubcomp(tmq_session_t* session, tmq_pubcomp_pkt* pubcomp
 
 void tmq_session_send_packet(tmq_session_t* session, tmq_any_packet_t* pkt)
 {
+    tmq_session_send_packets(session, pkt, 1);
+}
+
+void tmq_session_send_packets(tmq_session_t* session, tmq_any_packet_t* pkts, size_t n)
+{
+    if(!n) return;
     tmq_io_group_t* group = session->conn->group;
     /* if the underlying tcp connection doesn't belong to an io-group,
-     * send the packet directly in this thread */
+     * send the packets directly in this thread */
     if(!group)
     {
-        send_any_packet(session->conn, pkt);
-        tmq_any_pkt_cleanup(pkt);
+        for(size_t i = 0; i < n; i++)
+        {
+            send_any_packet(session->conn, &pkts[i]);
+            tmq_any_pkt_cleanup(&pkts[i]);
+        }
     }
-    /* otherwise, send the packet in the io-group which the connection belongs to */
+    /* otherwise, send the packets in the io-group which the connection belongs to,
+     * they are queued together and the io-group is notified once */
     else
     {
-        packet_send_req req = {
-                .conn = get_ref(session->conn),
-                .pkt = *pkt
-        };
         pthread_mutex_lock(&group->sending_packets_lk);
-        tmq_vec_push_back(group->sending_packets, req);
+        for(size_t i = 0; i < n; i++)
+        {
+            packet_send_req req = {
+                    .conn = get_ref(session->conn),
+                    .pkt = pkts[i]
+            };
+            tmq_vec_push_back(group->sending_packets, req);
+        }
+        incrementAndGet(group->sending_depth, n);
         pthread_mutex_unlock(&group->sending_packets_lk);
 
         tmq_notifier_notify(&group->sending_packets_notifier);
     }
 }
 
-void tmq_session_publish(tmq_session_t* session, const char* topic, const char* payload, uint8_t qos, uint8_t retain)
+static tmq_publish_pkt* publish_pkt_new(const char* topic, tmq_interned_topic_t* interned,
+                                        const char* payload, uint8_t retain)
 {
-    tmq_publish_pkt* publish_pkt = malloc(sizeof(tmq_publish_pkt));
+    tmq_publish_pkt* publish_pkt = tmq_obj_new(tmq_publish_pkt, OBJ_PACKET);
+    if(!publish_pkt) fatal_error("malloc() error: out of memory");
     bzero(publish_pkt, sizeof(tmq_publish_pkt));
-    publish_pkt->topic = tmq_str_new(topic);
+    /* an interned topic is shared instead of copied */
+    if(interned)
+    {
+        publish_pkt->interned = tmq_interned_topic_get(interned);
+        publish_pkt->topic = interned->name;
+    }
+    else
+        publish_pkt->topic = tmq_str_new(topic);
     publish_pkt->payload = tmq_str_new(payload);
     publish_pkt->flags |= retain;
+    return publish_pkt;
+}
 
-    tmq_any_packet_t pkt = {
-            .packet_type = MQTT_PUBLISH,
-            .packet = publish_pkt
-    };
+/* returns 1 if the packet can be sent now, otherwise it only waits in the sending queue */
+static int session_prepare_publish(tmq_session_t* session, tmq_publish_pkt* publish_pkt, uint8_t qos)
+{
     int send_now = 1;
     /* if qos = 0, fire and forget */
     if(qos > 0)
     {
+        /* messages may be published to a session by several threads */
+        pthread_mutex_lock(&session->lk);
+
         publish_pkt->packet_id = session->next_packet_id;
         session->next_packet_id = session->next_packet_id == UINT16_MAX ? 0 : session->next_packet_id + 1;
         publish_pkt->flags |= (qos << 1);
 
-        pthread_mutex_lock(&session->lk);
-
         int start_resend = session->inflight_packets == 0;
         tmq_publish_pkt* stored_pkt = tmq_publish_pkt_clone(publish_pkt);
 
         sending_packet* sending_pkt = sending_packet_new(MQTT_PUBLISH, stored_pkt, publish_pkt->packet_id);
-        send_now = store_sending_packet(session, sending_pkt);
+        /* while the connection is congested, the message waits in the session instead of the socket buffer */
+        send_now = store_sending_packet(session, sending_pkt, atomicGet(session->conn->congested));
         if(send_now) sending_pkt->send_time = time_now();
 
         if(start_resend && tmq_event_loop_resume_timer(session->conn->loop, session->resend_timer) < 0)
@@ -400,25 +455,70 @@ void tmq_session_publish(tmq_session_t* session, const char* topic, const char*
         }
         pthread_mutex_unlock(&session->lk);
     }
-    if(send_now)
-        tmq_session_send_packet(session, &pkt);
-    else tmq_publish_pkt_cleanup(publish_pkt);
+    if(!send_now)
+    {
+        tmq_publish_pkt_cleanup(publish_pkt);
+        tmq_obj_free(publish_pkt);
+    }
+    return send_now;
+}
+
+static void session_publish(tmq_session_t* session, tmq_publish_pkt* publish_pkt, uint8_t qos)
+{
+    if(!session_prepare_publish(session, publish_pkt, qos))
+        return;
+    tmq_any_packet_t pkt = {
+            .packet_type = MQTT_PUBLISH,
+            .packet = publish_pkt
+    };
+    tmq_session_send_packet(session, &pkt);
+}
+
+void tmq_session_publish(tmq_session_t* session, const char* topic, const char* payload, uint8_t qos, uint8_t retain)
+{
+    session_publish(session, publish_pkt_new(topic, NULL, payload, retain), qos);
+}
+
+void tmq_session_publish_batch(tmq_session_t* session, tmq_interned_topic_t* topic,
+                               tmq_message* messages, size_t n, uint8_t max_qos)
+{
+    packet_list pkts = tmq_vec_make(tmq_any_packet_t);
+    tmq_vec_reserve(pkts, n);
+    for(size_t i = 0; i < n; i++)
+    {
+        uint8_t qos = max_qos < messages[i].qos ? max_qos : messages[i].qos;
+        tmq_publish_pkt* publish_pkt = publish_pkt_new(NULL, topic, messages[i].message, 0);
+        if(!session_prepare_publish(session, publish_pkt, qos))
+            continue;
+        tmq_any_packet_t pkt = {
+                .packet_type = MQTT_PUBLISH,
+                .packet = publish_pkt
+        };
+        tmq_vec_push_back(pkts, pkt);
+    }
+    tmq_session_send_packets(session, tmq_vec_begin(pkts), tmq_vec_size(pkts));
+    tmq_vec_free(pkts);
 }
 
-void tmq_session_store_publish(tmq_session_t* session, const char* topic, const char* payload, uint8_t qos, uint8_t retain)
+void tmq_session_store_publish(tmq_session_t* session, tmq_interned_topic_t* topic,
+                               const char* payload, uint8_t qos, uint8_t retain)
 {
     if(qos == 0) return;
-    tmq_publish_pkt* publish_pkt = malloc(sizeof(tmq_publish_pkt));
-    bzero(publish_pkt, sizeof(tmq_publish_pkt));
-    publish_pkt->topic = tmq_str_new(topic);
-    publish_pkt->payload = tmq_str_new(payload);
-    publish_pkt->flags |= retain;
+    tmq_publish_pkt* publish_pkt = publish_pkt_new(NULL, topic, payload, retain);
     publish_pkt->flags |= (qos << 1);
     publish_pkt->packet_id = session->next_packet_id;
     session->next_packet_id = session->next_packet_id == UINT16_MAX ? 0 : session->next_packet_id + 1;
 
     sending_packet* sending_pkt = sending_packet_new(MQTT_PUBLISH, publish_pkt, publish_pkt->packet_id);
-    store_sending_packet(session, sending_pkt);
+    store_sending_packet(session, sending_pkt, 0);
+}
+
+void tmq_session_send_pending(tmq_session_t* session)
+{
+    pthread_mutex_lock(&session->sending_queue_lk);
+    while(session->pending_pointer && session->inflight_packets < session->inflight_window_size)
+        send_pending_packet(session);
+    pthread_mutex_unlock(&session->sending_queue_lk);
 }
 
 void tmq_session_subscribe(tmq_session_t* session, const char* topic_filter, uint8_t qos)
@@ -430,7 +530,7 @@ void tmq_session_subscribe(tmq_session_t* session, const char* topic_filter, uin
     };
     tmq_vec_push_back(topics, topic);
 
-    tmq_subscribe_pkt* subscribe_pkt = malloc(sizeof(tmq_subscribe_pkt));
+    tmq_subscribe_pkt* subscribe_pkt = tmq_obj_new(tmq_subscribe_pkt, OBJ_PACKET);
     subscribe_pkt->packet_id = session->next_packet_id;
     subscribe_pkt->topics = topics;
     session->next_packet_id = session->next_packet_id == UINT16_MAX ? 0 : session->next_packet_id + 1;
@@ -446,7 +546,7 @@ void tmq_session_unsubscribe(tmq_session_t* session, const char* topic_filter)
     str_vec topics = tmq_vec_make(tmq_str_t);
     tmq_vec_push_back(topics, tmq_str_new(topic_filter));
 
-    tmq_unsubscribe_pkt* unsubscribe_pkt = malloc(sizeof(tmq_unsubscribe_pkt));
+    tmq_unsubscribe_pkt* unsubscribe_pkt = tmq_obj_new(tmq_unsubscribe_pkt, OBJ_PACKET);
     unsubscribe_pkt->packet_id =  session->next_packet_id;
     unsubscribe_pkt->topics = topics;
     session->next_packet_id = session->next_packet_id == UINT16_MAX ? 0 : session->next_packet_id + 1;
@@ -461,4 +561,18 @@ void tmq_session_set_publish_finish_callback(tmq_session_t* session, publish_fin
 {
     if(!session) return;
     session->on_publish_finish = cb;
+}
+
+void tmq_session_compact(tmq_session_t* session)
+{
+    if(session->qos2_packet_ids.base && !tmq_map_size(session->qos2_packet_ids))
+    {
+        tmq_map_free(session->qos2_packet_ids);
+        session->qos2_packet_ids.base = NULL;
+    }
+}
+
+size_t tmq_session_memory(tmq_session_t* session)
+{
+    return sizeof(tmq_session_t) + tmq_str_len(session->client_id) + tmq_map_memory(session->qos2_packet_ids);
 }
\ No newline at end of file
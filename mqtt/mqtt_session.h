@@ -6,6 +6,7 @@
 #define TINYMQTT_MQTT_SESSION_H
 #include "net/mqtt_tcp_conn.h"
 #include "mqtt/mqtt_types.h"
+#include "mqtt/mqtt_topic.h"
 
 #define RESEND_INTERVAL 1
 
@@ -24,7 +25,6 @@ typedef void(*new_message_cb)(void* upstream, char* topic, tmq_message* message,
 typedef void(*publish_finish_cb)(void* upstream, uint16_t packet_id, uint8_t qos);
 typedef void(*close_cb)(void* upstream, tmq_session_t* session);
 
-typedef tmq_map(char*, uint8_t) subscription_map;
 typedef tmq_map(uint32_t, uint8_t)  packet_id_set;
 
 typedef struct tmq_session_s
@@ -33,13 +33,18 @@ typedef struct tmq_session_s
     tmq_tcp_conn_t* conn;
     session_state_e state;
     uint8_t clean_session;
-    subscription_map subscriptions;
+    /* maintained by the broker thread */
+    topic_subscription_map subscriptions;
+    /* index of the io group the broker queues fan-out messages of this session to */
+    int fanout_group;
 
     uint16_t keep_alive;
     int64_t last_pkt_ts;
     uint16_t next_packet_id;
     uint8_t inflight_window_size;
     uint8_t inflight_packets;
+    /* number of packets waiting in the sending queue for a free inflight slot */
+    uint32_t pending_packets;
     tmq_timerid_t resend_timer;
     pthread_mutex_t lk;
 
@@ -52,6 +57,7 @@ typedef struct tmq_session_s
     sending_packet* sending_queue_head, *sending_queue_tail;
     sending_packet* pending_pointer;
 
+    /* created by the first qos 2 message, released by tmq_session_compact when empty */
     packet_id_set qos2_packet_ids;
     publish_req will_publish_req;
 } tmq_session_t;
@@ -62,14 +68,25 @@ tmq_session_t* tmq_session_new(void* upstream, new_message_cb on_new_message, cl
 void tmq_session_close(tmq_session_t* session);
 void tmq_session_free(tmq_session_t* session);
 void tmq_session_publish(tmq_session_t* session, const char* topic, const char* payload, uint8_t qos, uint8_t retain);
-void tmq_session_store_publish(tmq_session_t* session, const char* topic, const char* payload,
-                               uint8_t qos, uint8_t retain);
+/* publish several messages of an interned topic, sharing its name instead of copying it.
+ * the qos of each message is limited by max_qos */
+void tmq_session_publish_batch(tmq_session_t* session, tmq_interned_topic_t* topic,
+                               tmq_message* messages, size_t n, uint8_t max_qos);
+void tmq_session_store_publish(tmq_session_t* session, tmq_interned_topic_t* topic,
+                               const char* payload, uint8_t qos, uint8_t retain);
+/* send the packets held in the sending queue while the connection was congested, as the inflight window allows */
+void tmq_session_send_pending(tmq_session_t* session);
 void tmq_session_subscribe(tmq_session_t* session, const char* topic_filter, uint8_t qos);
 void tmq_session_unsubscribe(tmq_session_t* session, const char* topic_filter);
 void tmq_session_send_packet(tmq_session_t* session, tmq_any_packet_t* pkt);
+void tmq_session_send_packets(tmq_session_t* session, tmq_any_packet_t* pkts, size_t n);
 void tmq_session_start(tmq_session_t* session);
 void tmq_session_resume(tmq_session_t* session, tmq_tcp_conn_t* conn, uint16_t keep_alive, char* will_topic,
                         char* will_message, uint8_t will_qos, uint8_t will_retain);
 void tmq_session_set_publish_finish_callback(tmq_session_t* session, publish_finish_cb cb);
+/* called in the io thread of the session's connection while it's idle */
+void tmq_session_compact(tmq_session_t* session);
+/* heap bytes held by the session, not counting its subscriptions and queued packets */
+size_t tmq_session_memory(tmq_session_t* session);
 
 #endif //TINYMQTT_MQTT_SESSION_H
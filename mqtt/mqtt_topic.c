@@ -7,322 +7,1020 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <sched.h>
+#include <errno.h>
+
+#define SHARED_PREFIX   "$share/"
 
 typedef tmq_vec(topic_tree_node*) topic_path;
 
-static topic_tree_node* topic_tree_node_new(topic_tree_node* parent, char* level_name)
+static topic_tree_node* node_slab_alloc(topic_node_slab_t* slab)
+{
+    if(!slab->free_nodes)
+    {
+        topic_tree_node* chunk = malloc(sizeof(topic_tree_node) * TOPIC_NODE_SLAB_SIZE);
+        if(!chunk) fatal_error("malloc() error: out of memory");
+        tmq_vec_push_back(slab->chunks, chunk);
+        /* free nodes are linked by their parent pointer */
+        for(int i = TOPIC_NODE_SLAB_SIZE - 1; i >= 0; i--)
+        {
+            chunk[i].parent = slab->free_nodes;
+            slab->free_nodes = &chunk[i];
+        }
+    }
+    topic_tree_node* node = slab->free_nodes;
+    slab->free_nodes = node->parent;
+    slab->nodes_in_use++;
+    return node;
+}
+
+static void node_slab_free(topic_node_slab_t* slab, topic_tree_node* node)
+{
+    node->parent = slab->free_nodes;
+    slab->free_nodes = node;
+    slab->nodes_in_use--;
+}
+
+static unsigned hash_ptr(const void* key)
+{
+    uint64_t p = (uint64_t) *(void* const*) key;
+    /* heap pointers are aligned, drop the low bits that are always zero */
+    return (uint32_t) ((p >> 4) * UINT64_C(0x9e3779b97f4a7c15) >> 32);
+}
+
+static int equal_ptr(const void* k1, const void* k2)
+{
+    return *(void* const*) k1 == *(void* const*) k2;
+}
+
+static unsigned hash_level(const void* key)
+{
+    const topic_level_t* level = key;
+    return hash_bytes(level->name, level->len);
+}
+
+static int equal_level(const void* k1, const void* k2)
+{
+    const topic_level_t* l1 = k1, *l2 = k2;
+    return l1->len == l2->len && !memcmp(l1->name, l2->name, l1->len);
+}
+
+static void set_levels(topic_tree_node* node, tmq_str_t levels)
+{
+    tmq_str_free(node->levels);
+    node->levels = levels;
+    node->first_level_len = strchrnul(levels, '/') - levels;
+}
+
+static topic_level_t first_level(topic_tree_node* node)
+{
+    topic_level_t level = {node->levels, node->first_level_len};
+    return level;
+}
+
+static int is_wildcard(const char* level, size_t len)
+{
+    return len == 1 && (*level == '+' || *level == '#');
+}
+
+static int is_wildcard_node(topic_tree_node* node)
+{
+    return tmq_str_len(node->levels) == 1 && is_wildcard(node->levels, 1);
+}
+
+static topic_tree_node* topic_tree_node_new(topic_tree_t* tree, const char* levels, size_t len)
 {
-    topic_tree_node* node = malloc(sizeof(topic_tree_node));
-    if(!node) fatal_error("malloc() error: out of memory");
-    node->parent = parent;
-    node->level_name = tmq_str_new(level_name);
-    node->retain_message = NULL;
-    tmq_map_str_init(&node->childs, topic_tree_node*, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
-    tmq_map_str_init(&node->subscribers, uint8_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
+    topic_tree_node* node = node_slab_alloc(&tree->node_slab);
+    node->parent = NULL;
+    node->levels = NULL;
+    set_levels(node, tmq_str_new_len(levels, len));
+    node->flags = 0;
+    node->child_cnt = 0;
+    node->subscriber_cnt = 0;
+    node->shared_groups = NULL;
     return node;
 }
 
-static void topic_tree_node_free(topic_tree_node* node)
+static void topic_tree_node_free(topic_tree_t* tree, topic_tree_node* node)
+{
+    if(node->flags & TOPIC_CHILDS_IN_MAP)
+        tmq_map_free(node->childs.child_map);
+    if(node->flags & TOPIC_SUBSCRIBERS_IN_MAP)
+        tmq_map_free(node->subscribers.subscriber_map);
+    if(node->shared_groups)
+    {
+        tmq_map_free(*node->shared_groups);
+        free(node->shared_groups);
+    }
+    tmq_str_free(node->levels);
+    node_slab_free(&tree->node_slab, node);
+}
+
+static size_t child_count(topic_tree_node* node)
+{
+    if(node->flags & TOPIC_CHILDS_IN_MAP)
+        return tmq_map_size(node->childs.child_map);
+    return node->child_cnt;
+}
+
+static topic_tree_node* find_child(topic_tree_node* node, const char* level, size_t len)
+{
+    if(node->flags & TOPIC_CHILDS_IN_MAP)
+    {
+        /* tmq_map_get() stores the key in the map, look up with a local key so readers don't write the node */
+        topic_level_t key = {level, len};
+        topic_tree_node** child = tmq_map_get_(node->childs.child_map.base, &key);
+        return child ? *child : NULL;
+    }
+    for(int i = 0; i < node->child_cnt; i++)
+    {
+        topic_tree_node* child = node->childs.inline_childs[i];
+        if(child->first_level_len == len && !memcmp(child->levels, level, len))
+            return child;
+    }
+    return NULL;
+}
+
+static void add_child(topic_tree_node* node, topic_tree_node* child)
+{
+    child->parent = node;
+    if(!(node->flags & TOPIC_CHILDS_IN_MAP))
+    {
+        if(node->child_cnt < TOPIC_INLINE_CHILDS)
+        {
+            node->childs.inline_childs[node->child_cnt++] = child;
+            return;
+        }
+        topic_child_map child_map;
+        tmq_map_custom_init(&child_map, topic_level_t, topic_tree_node*, MAP_DEFAULT_CAP,
+                            MAP_DEFAULT_LOAD_FACTOR, hash_level, equal_level);
+        for(int i = 0; i < node->child_cnt; i++)
+            tmq_map_put(child_map, first_level(node->childs.inline_childs[i]), node->childs.inline_childs[i]);
+        node->childs.child_map = child_map;
+        node->child_cnt = 0;
+        node->flags |= TOPIC_CHILDS_IN_MAP;
+    }
+    tmq_map_put(node->childs.child_map, first_level(child), child);
+}
+
+/* must be called before the levels of the child is modified, the child map is keyed by them */
+static void remove_child(topic_tree_node* node, topic_tree_node* child)
+{
+    if(!(node->flags & TOPIC_CHILDS_IN_MAP))
+    {
+        for(int i = 0; i < node->child_cnt; i++)
+        {
+            if(node->childs.inline_childs[i] != child)
+                continue;
+            node->childs.inline_childs[i] = node->childs.inline_childs[--node->child_cnt];
+            break;
+        }
+        return;
+    }
+    tmq_map_erase(node->childs.child_map, first_level(child));
+    if(tmq_map_size(node->childs.child_map) > TOPIC_INLINE_CHILDS / 2)
+        return;
+    /* move the remaining childs back into the node */
+    topic_tree_node* remain[TOPIC_INLINE_CHILDS];
+    int n = 0;
+    tmq_map_iter_t it = tmq_map_iter(node->childs.child_map);
+    for(; tmq_map_has_next(it); tmq_map_next(node->childs.child_map, it))
+        remain[n++] = *(topic_tree_node**) it.second;
+    tmq_map_free(node->childs.child_map);
+    memcpy(node->childs.inline_childs, remain, n * sizeof(topic_tree_node*));
+    node->child_cnt = n;
+    node->flags &= ~TOPIC_CHILDS_IN_MAP;
+}
+
+static void get_childs(topic_tree_node* node, topic_path* childs)
+{
+    if(!(node->flags & TOPIC_CHILDS_IN_MAP))
+    {
+        for(int i = 0; i < node->child_cnt; i++)
+            tmq_vec_push_back(*childs, node->childs.inline_childs[i]);
+        return;
+    }
+    tmq_map_iter_t it = tmq_map_iter(node->childs.child_map);
+    for(; tmq_map_has_next(it); tmq_map_next(node->childs.child_map, it))
+        tmq_vec_push_back(*childs, *(topic_tree_node**) it.second);
+}
+
+static size_t subscriber_count(topic_tree_node* node)
+{
+    if(node->flags & TOPIC_SUBSCRIBERS_IN_MAP)
+        return tmq_map_size(node->subscribers.subscriber_map);
+    return node->subscriber_cnt;
+}
+
+static int has_subscribers(topic_tree_node* node)
+{
+    return subscriber_count(node) > 0 || (node->shared_groups && tmq_map_size(*node->shared_groups) > 0);
+}
+
+/* returns 1 if the subscriber is new to this node, 0 if only its qos is updated */
+static int put_subscriber(topic_tree_node* node, void* subscriber, uint8_t qos)
+{
+    if(node->flags & TOPIC_SUBSCRIBERS_IN_MAP)
+    {
+        size_t n = tmq_map_size(node->subscribers.subscriber_map);
+        tmq_map_put(node->subscribers.subscriber_map, subscriber, qos);
+        return tmq_map_size(node->subscribers.subscriber_map) > n;
+    }
+    topic_subscriber_t* subscribers = node->subscribers.inline_subscribers;
+    for(int i = 0; i < node->subscriber_cnt; i++)
+    {
+        if(subscribers[i].subscriber == subscriber)
+        {
+            subscribers[i].qos = qos;
+            return 0;
+        }
+    }
+    if(node->subscriber_cnt < TOPIC_INLINE_SUBSCRIBERS)
+    {
+        subscribers[node->subscriber_cnt].subscriber = subscriber;
+        subscribers[node->subscriber_cnt++].qos = qos;
+        return 1;
+    }
+    topic_subscriber_map subscriber_map;
+    tmq_map_custom_init(&subscriber_map, void*, uint8_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR, hash_ptr, equal_ptr);
+    for(int i = 0; i < node->subscriber_cnt; i++)
+        tmq_map_put(subscriber_map, subscribers[i].subscriber, subscribers[i].qos);
+    tmq_map_put(subscriber_map, subscriber, qos);
+    node->subscribers.subscriber_map = subscriber_map;
+    node->subscriber_cnt = 0;
+    node->flags |= TOPIC_SUBSCRIBERS_IN_MAP;
+    return 1;
+}
+
+/* returns 1 if the subscriber is removed */
+static int erase_subscriber(topic_tree_node* node, void* subscriber)
+{
+    if(!(node->flags & TOPIC_SUBSCRIBERS_IN_MAP))
+    {
+        topic_subscriber_t* subscribers = node->subscribers.inline_subscribers;
+        for(int i = 0; i < node->subscriber_cnt; i++)
+        {
+            if(subscribers[i].subscriber != subscriber)
+                continue;
+            subscribers[i] = subscribers[--node->subscriber_cnt];
+            return 1;
+        }
+        return 0;
+    }
+    size_t size = tmq_map_size(node->subscribers.subscriber_map);
+    tmq_map_erase(node->subscribers.subscriber_map, subscriber);
+    int removed = tmq_map_size(node->subscribers.subscriber_map) < size;
+    if(tmq_map_size(node->subscribers.subscriber_map) > TOPIC_INLINE_SUBSCRIBERS / 2)
+        return removed;
+    /* move the remaining subscribers back into the node */
+    topic_subscriber_t remain[TOPIC_INLINE_SUBSCRIBERS];
+    int n = 0;
+    tmq_map_iter_t it = tmq_map_iter(node->subscribers.subscriber_map);
+    for(; tmq_map_has_next(it); tmq_map_next(node->subscribers.subscriber_map, it))
+    {
+        remain[n].subscriber = *(void**) it.first;
+        remain[n++].qos = *(uint8_t*) it.second;
+    }
+    tmq_map_free(node->subscribers.subscriber_map);
+    memcpy(node->subscribers.inline_subscribers, remain, n * sizeof(topic_subscriber_t));
+    node->subscriber_cnt = n;
+    node->flags &= ~TOPIC_SUBSCRIBERS_IN_MAP;
+    return removed;
+}
+
+static void topic_tree_init(topic_tree_t* tree)
 {
-    tmq_map_free(node->childs);
-    tmq_map_free(node->subscribers);
-    tmq_str_free(node->level_name);
-    free(node);
+    tmq_vec_init(&tree->node_slab.chunks, topic_tree_node*);
+    tree->node_slab.free_nodes = NULL;
+    tree->node_slab.nodes_in_use = 0;
+    tmq_vec_init(&tree->reclaim_list, topic_reclaim_t);
+    tree->reclaim_head = 0;
+    bzero(&tree->gc_stats, sizeof(topic_gc_stats_t));
+    tree->root = topic_tree_node_new(tree, "", 0);
+    tree->sys_root = topic_tree_node_new(tree, "", 0);
 }
 
-void tmq_topics_init(tmq_topics_t* topics, tmq_broker_t* broker, match_cb on_match)
+void tmq_topics_init(tmq_topics_t* topics, tmq_broker_t* broker, match_cb on_match, subscriber_name_cb subscriber_name)
 {
     if(!topics) return;
-    topics->topic_tree_root = topic_tree_node_new(NULL, NULL);
-    topics->sys_topic_tree_root = topic_tree_node_new(NULL, NULL);
+    topic_tree_init(&topics->trees[0]);
+    topics->active = 0;
+    topics->concurrent = 0;
+    bzero(topics->readers, sizeof(topics->readers));
+    topics->readers_cnt = 0;
+    bzero(&topics->level_filter, sizeof(topics->level_filter));
+    tmq_retain_store_init(&topics->retain_store);
+    tmq_intern_table_init(&topics->topic_table);
     topics->on_match = on_match;
+    topics->subscriber_name = subscriber_name;
+    topics->shared_policy = SHARED_ROUND_ROBIN;
+    topics->member_load = NULL;
+    topics->fanout_threshold = 0;
+    topics->on_fanout = NULL;
     topics->broker = broker;
 }
 
-static topic_tree_node* find_or_create(topic_tree_node* cur, tmq_str_t level, int create)
+void tmq_topics_enable_concurrent_readers(tmq_topics_t* topics)
+{
+    if(topics->concurrent) return;
+    topic_tree_init(&topics->trees[1]);
+    if(pthread_key_create(&topics->reader_key, NULL))
+        fatal_error("pthread_key_create() error %d: %s", errno, strerror(errno));
+    topics->concurrent = 1;
+}
+
+void tmq_topics_set_shared_policy(tmq_topics_t* topics, shared_policy_e policy, member_load_cb member_load)
+{
+    topics->shared_policy = policy;
+    topics->member_load = member_load;
+}
+
+void tmq_topics_set_fanout(tmq_topics_t* topics, size_t threshold, match_cb on_fanout)
 {
-    topic_tree_node** next = tmq_map_get(cur->childs, level);
-    if(next) return *next;
-    if(!create) return NULL;
-    topic_tree_node* new_next = topic_tree_node_new(cur, level);
-    tmq_map_put(cur->childs, level, new_next);
-    return new_next;
+    topics->fanout_threshold = threshold;
+    topics->on_fanout = on_fanout;
 }
 
-static topic_tree_node* add_topic_or_find(tmq_topics_t* topics, char* topic_filter, int add, topic_path* path)
+int tmq_topic_filter_is_shared(const char* topic_filter)
+{
+    return !strncmp(topic_filter, SHARED_PREFIX, strlen(SHARED_PREFIX));
+}
+
+/* split "$share/{group}/{filter}", returns the filter part or NULL if the shared subscription is malformed */
+static char* parse_shared_filter(char* topic_filter, tmq_str_t* group)
+{
+    char* group_name = topic_filter + strlen(SHARED_PREFIX);
+    char* filter = strchr(group_name, '/');
+    if(!filter || filter == group_name || !*(filter + 1))
+        return NULL;
+    *group = tmq_str_new_len(group_name, filter - group_name);
+    if(strpbrk(*group, "+#"))
+    {
+        tmq_str_free(*group);
+        return NULL;
+    }
+    return filter + 1;
+}
+
+/* length of the longest common prefix of the levels and the topic filter which ends at a level boundary */
+static size_t common_levels_len(const char* levels, const char* topic_filter)
+{
+    size_t i = 0, common = 0;
+    for(; levels[i] && levels[i] == topic_filter[i]; i++)
+    {
+        if(levels[i] == '/')
+            common = i;
+    }
+    if((!levels[i] || levels[i] == '/') && (!topic_filter[i] || topic_filter[i] == '/'))
+        common = i;
+    return common;
+}
+
+/* split the first len bytes of levels of the node into a new parent node,
+ * so the node with subscribers is never moved */
+static topic_tree_node* split_node(topic_tree_t* tree, topic_tree_node* node, size_t len)
+{
+    topic_tree_node* parent = node->parent;
+    remove_child(parent, node);
+    topic_tree_node* prefix = topic_tree_node_new(tree, node->levels, len);
+    set_levels(node, tmq_str_new(node->levels + len + 1));
+    add_child(prefix, node);
+    add_child(parent, prefix);
+    return prefix;
+}
+
+/* merge a node without subscribers into its only child */
+static int try_merge_node(topic_tree_t* tree, topic_tree_node* node)
+{
+    /* a node in the reclaim list is merged when it is reclaimed */
+    if(!node->parent || has_subscribers(node) || child_count(node) != 1 || is_wildcard_node(node) ||
+       (node->flags & TOPIC_NODE_RECLAIM))
+        return 0;
+    assert(!(node->flags & TOPIC_CHILDS_IN_MAP));
+    topic_tree_node* child = node->childs.inline_childs[0];
+    if(is_wildcard_node(child))
+        return 0;
+    topic_tree_node* parent = node->parent;
+    remove_child(parent, node);
+    remove_child(node, child);
+    tmq_str_t levels = tmq_str_new(node->levels);
+    levels = tmq_str_append_char(levels, '/');
+    levels = tmq_str_append_str(levels, child->levels);
+    set_levels(child, levels);
+    add_child(parent, child);
+    topic_tree_node_free(tree, node);
+    return 1;
+}
+
+/* create nodes for the remaining levels of a topic filter,
+ * continuous non-wildcard levels are put in one node */
+static topic_tree_node* add_levels(topic_tree_t* tree, topic_tree_node* node, const char* levels)
 {
-    char* lp = topic_filter, *rp = lp;
-    topic_tree_node* node = topics->topic_tree_root;
-    if(path) tmq_vec_push_back(*path, node);
-    tmq_str_t level = tmq_str_empty();
     while(1)
     {
-        while(*rp && *rp != '/') rp++;
-        if(rp == lp)
+        const char* end = strchrnul(levels, '/');
+        if(!is_wildcard(levels, end - levels))
         {
-            level = tmq_str_assign(level, "");
-            node = find_or_create(node, level, add);
-            if(!node) break;
-            if(path) tmq_vec_push_back(*path, node);
+            while(*end)
+            {
+                const char* next_end = strchrnul(end + 1, '/');
+                if(is_wildcard(end + 1, next_end - end - 1))
+                    break;
+                end = next_end;
+            }
         }
-        else
+        topic_tree_node* child = topic_tree_node_new(tree, levels, end - levels);
+        add_child(node, child);
+        node = child;
+        if(!*end) return node;
+        levels = end + 1;
+    }
+}
+
+static topic_tree_node* add_topic_or_find(topic_tree_t* tree, const char* topic_filter, int add)
+{
+    const char* levels = topic_filter;
+    topic_tree_node* node = tree->root;
+    while(1)
+    {
+        const char* level_end = strchrnul(levels, '/');
+        topic_tree_node* child = find_child(node, levels, level_end - levels);
+        if(!child)
+            return add ? add_levels(tree, node, levels) : NULL;
+        size_t common = common_levels_len(child->levels, levels);
+        if(common < tmq_str_len(child->levels))
         {
-            level = tmq_str_assign_n(level, lp, rp - lp);
-            node = find_or_create(node, level, add);
-            if(!node) break;
-            if(path) tmq_vec_push_back(*path, node);
+            if(!add) return NULL;
+            child = split_node(tree, child, common);
         }
-        if(!*rp) break;
-        lp = rp + 1; rp = lp;
-        if(!*lp)
+        node = child;
+        if(!levels[common]) return node;
+        levels += common + 1;
+    }
+}
+
+static int add_shared_member(topic_tree_node* node, tmq_str_t group_name, void* subscriber, uint8_t qos)
+{
+    if(!node->shared_groups)
+    {
+        node->shared_groups = malloc(sizeof(shared_group_map));
+        if(!node->shared_groups) fatal_error("malloc() error: out of memory");
+        tmq_map_str_init(node->shared_groups, shared_group_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
+    }
+    shared_group_t* group = tmq_map_get(*node->shared_groups, group_name);
+    if(!group)
+    {
+        shared_group_t new_group = {.next = 0};
+        tmq_vec_init(&new_group.members, shared_member_t);
+        tmq_map_put(*node->shared_groups, group_name, new_group);
+        group = tmq_map_get(*node->shared_groups, group_name);
+    }
+    for(shared_member_t* member = tmq_vec_begin(group->members); member != tmq_vec_end(group->members); member++)
+    {
+        if(member->subscriber == subscriber)
         {
-            level = tmq_str_assign(level, "");
-            node = find_or_create(node, level, add);
-            if(path) tmq_vec_push_back(*path, node);
-            break;
+            member->qos = qos;
+            return 0;
         }
     }
-    tmq_str_free(level);
-    return node;
+    shared_member_t member = {
+            .subscriber = subscriber,
+            .qos = qos
+    };
+    tmq_vec_push_back(group->members, member);
+    return 1;
+}
+
+static int remove_shared_member(topic_tree_node* node, tmq_str_t group_name, void* subscriber)
+{
+    if(!node->shared_groups) return 0;
+    shared_group_t* group = tmq_map_get(*node->shared_groups, group_name);
+    if(!group) return 0;
+    int removed = 0;
+    for(size_t i = 0; i < tmq_vec_size(group->members); i++)
+    {
+        shared_member_t* member = tmq_vec_at(group->members, i);
+        if(member->subscriber != subscriber)
+            continue;
+        tmq_vec_erase(group->members, i);
+        removed = 1;
+        break;
+    }
+    if(tmq_vec_empty(group->members))
+    {
+        tmq_vec_free(group->members);
+        tmq_map_erase(*node->shared_groups, group_name);
+    }
+    if(!tmq_map_size(*node->shared_groups))
+    {
+        tmq_map_free(*node->shared_groups);
+        free(node->shared_groups);
+        node->shared_groups = NULL;
+    }
+    return removed;
 }
 
-/* retrieve all retained messages from the sub-topic */
-static void get_all_retain(topic_tree_node* node, retain_message_list* retain_msg)
+/* index of the copy of the topic tree that is not visible to readers */
+static int writable_index(tmq_topics_t* topics)
 {
-    if(node->retain_message)
-        tmq_vec_push_back(*retain_msg, node->retain_message);
-    tmq_map_iter_t it = tmq_map_iter(node->childs);
-    for(; tmq_map_has_next(it); tmq_map_next(node->childs, it))
+    return topics->concurrent ? !topics->active : 0;
+}
+
+/* make the modified copy visible to readers and wait until the other copy is no longer used */
+static void switch_active_tree(tmq_topics_t* topics)
+{
+    atomicSet(topics->active, !topics->active);
+    int n = atomicGet(topics->readers_cnt);
+    for(int i = 0; i < n; i++)
     {
-        char* next_level = it.first;
-        if(!strcmp(next_level, "+") || !strcmp(next_level, "#"))
+        uint64_t epoch = atomicGet(topics->readers[i].epoch);
+        if(!(epoch & 1))
             continue;
-        topic_tree_node* next = *(topic_tree_node**) it.second;
-        get_all_retain(next, retain_msg);
+        while(atomicGet(topics->readers[i].epoch) == epoch)
+            sched_yield();
     }
 }
 
-static void find_retain_messages(topic_tree_node* node, size_t i, topic_path* path, retain_message_list* retain_msg)
+static void level_filter_update(topic_level_filter_t* filter, const char* level, size_t len, int delta)
 {
-    if(i == tmq_vec_size(*path))
+    if(is_wildcard(level, len))
     {
-        if(node->retain_message)
-            tmq_vec_push_back(*retain_msg, node->retain_message);
+        __atomic_add_fetch(&filter->wildcard_subscriptions, delta, __ATOMIC_RELAXED);
         return;
     }
-    topic_tree_node* path_node = *tmq_vec_at(*path, i);
-    /* if the subscription path contains single-level wildcards,
-     * find retained messages in all matching sub-topics */
-    if(!strcmp(path_node->level_name, "+"))
+    unsigned h = hash_bytes(level, len);
+    __atomic_add_fetch(&filter->counters[h & (TOPIC_LEVEL_FILTER_SIZE - 1)], delta, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&filter->counters[(h >> 16) & (TOPIC_LEVEL_FILTER_SIZE - 1)], delta, __ATOMIC_RELAXED);
+}
+
+/* the first level of a subscribed topic filter, kept by the child of the root */
+static topic_level_t subscription_first_level(topic_tree_node* node)
+{
+    while(node->parent->parent)
+        node = node->parent;
+    return first_level(node);
+}
+
+int tmq_topics_may_match(tmq_topics_t* topics, const char* topic)
+{
+    topic_level_filter_t* filter = &topics->level_filter;
+    if(__atomic_load_n(&filter->wildcard_subscriptions, __ATOMIC_RELAXED))
+        return 1;
+    unsigned h = hash_bytes(topic, strchrnul(topic, '/') - topic);
+    return __atomic_load_n(&filter->counters[h & (TOPIC_LEVEL_FILTER_SIZE - 1)], __ATOMIC_RELAXED) &&
+           __atomic_load_n(&filter->counters[(h >> 16) & (TOPIC_LEVEL_FILTER_SIZE - 1)], __ATOMIC_RELAXED);
+}
+
+/* returns 1 if the subscription is new, 0 if an existing one is updated */
+static int add_subscription(topic_tree_t* tree, const char* topic_filter, tmq_str_t group_name,
+                            void* subscriber, uint8_t qos, topic_tree_node** added)
+{
+    topic_tree_node* node = add_topic_or_find(tree, topic_filter, 1);
+    assert(node != NULL);
+    *added = node;
+    if(node->flags & TOPIC_NODE_RECLAIM)
+        node->flags |= TOPIC_NODE_REUSED;
+    if(group_name)
+        return add_shared_member(node, group_name, subscriber, qos);
+    return put_subscriber(node, subscriber, qos);
+}
+
+int tmq_topics_add_subscription(tmq_topics_t* topics, char* topic_filter, void* subscriber, uint8_t qos,
+                                topic_subscription_t* sub)
+{
+    if(!topic_filter || strlen(topic_filter) < 1)
+        return -1;
+    tmq_str_t group_name = NULL;
+    if(tmq_topic_filter_is_shared(topic_filter))
     {
-        tmq_map_iter_t it = tmq_map_iter(node->childs);
-        for(; tmq_map_has_next(it); tmq_map_next(node->childs, it))
+        char* filter = parse_shared_filter(topic_filter, &group_name);
+        if(!filter)
         {
-            char* next_level = it.first;
-            if(!strcmp(next_level, "+") || !strcmp(next_level, "#"))
-                continue;
-            topic_tree_node* next = *(topic_tree_node**) it.second;
-            find_retain_messages(next, i + 1, path, retain_msg);
+            tlog_warn("invalid shared subscription: %s", topic_filter);
+            return -1;
         }
+        topic_filter = filter;
     }
-    else if(!strcmp(path_node->level_name, "#"))
-        get_all_retain(node, retain_msg);
-    else
+    topic_subscription_t added = {
+            .nodes = {NULL, NULL},
+            .group_name = group_name,
+            .qos = qos
+    };
+    if(topics->concurrent)
     {
-        topic_tree_node** next = tmq_map_get(node->childs, path_node->level_name);
-        if(next) find_retain_messages(*next, i + 1, path, retain_msg);
+        int idx = writable_index(topics);
+        add_subscription(&topics->trees[idx], topic_filter, group_name, subscriber, qos, &added.nodes[idx]);
+        switch_active_tree(topics);
     }
+    int idx = writable_index(topics);
+    if(add_subscription(&topics->trees[idx], topic_filter, group_name, subscriber, qos, &added.nodes[idx]))
+        level_filter_update(&topics->level_filter, topic_filter, strchrnul(topic_filter, '/') - topic_filter, 1);
+    if(sub)
+        *sub = added;
+    else
+        tmq_str_free(group_name);
+    return 0;
 }
 
-retain_message_list tmq_topics_add_subscription(tmq_topics_t* topics, char* topic_filter, char* client_id, uint8_t qos)
+/* a node without subscribers isn't removed immediately, it is put in the reclaim list */
+static void try_remove_topic(topic_tree_t* tree, topic_tree_node* node, int64_t now)
 {
-    retain_message_list retain_messages = tmq_vec_make(retain_message_t*);
-    if(!topic_filter || strlen(topic_filter) < 1)
-        return retain_messages;
-    topic_path path = tmq_vec_make(topic_tree_node*);
-    topic_tree_node* node = add_topic_or_find(topics, topic_filter, 1, &path);
-    assert(node != NULL);
-    tmq_map_put(node->subscribers, client_id, qos);
-    /* find all retained messages that matches this subscription */
-    size_t i = 0; topic_tree_node* next;
-    do
-    {
-        next = *tmq_vec_at(path, i + 1);
-        if(strcmp(next->level_name, "+") != 0 && strcmp(next->level_name, "#") != 0)
-            i++;
-        else break;
-    } while(i < tmq_vec_size(path) - 1);
-    if(i == tmq_vec_size(path) - 1 && (*tmq_vec_at(path, i))->retain_message)
-        tmq_vec_push_back(retain_messages, (*tmq_vec_at(path, i))->retain_message);
-    else
-        find_retain_messages(*tmq_vec_at(path, i), i + 1, &path, &retain_messages);
-    tmq_vec_free(path);
-    return retain_messages;
+    if(!node->parent || has_subscribers(node) || (node->flags & TOPIC_NODE_RECLAIM))
+        return;
+    node->flags |= TOPIC_NODE_RECLAIM;
+    topic_reclaim_t reclaim = {
+            .node = node,
+            .since = now
+    };
+    tmq_vec_push_back(tree->reclaim_list, reclaim);
 }
 
-static void try_remove_topic(tmq_topics_t* topics, topic_tree_node* node)
+static void reclaim_node(topic_tree_t* tree, topic_tree_node* node, int64_t now)
 {
-    /* when a topic has no subscribers, no sub-topics and no retained message, it can be removed */
-    while(tmq_map_size(node->subscribers) == 0
-          && tmq_map_size(node->childs) == 0
-          && !node->retain_message)
+    int reused = node->flags & TOPIC_NODE_REUSED;
+    node->flags &= ~(TOPIC_NODE_RECLAIM | TOPIC_NODE_REUSED);
+    if(reused)
+        tree->gc_stats.nodes_reused++;
+    if(has_subscribers(node))
+        return;
+    /* the node lost its subscribers again after its entry was queued, it gets a full grace period */
+    if(reused)
+    {
+        try_remove_topic(tree, node, now);
+        return;
+    }
+    /* when a topic has no subscribers and no sub-topics, it can be removed.
+     * the ancestors left empty are removed too, unless they are waiting in the reclaim list */
+    while(node->parent && !has_subscribers(node) && !child_count(node) && !(node->flags & TOPIC_NODE_RECLAIM))
     {
         topic_tree_node* parent = node->parent;
-        tmq_map_erase(parent->childs, node->level_name);
-        topic_tree_node_free(node);
+        remove_child(parent, node);
+        topic_tree_node_free(tree, node);
+        tree->gc_stats.nodes_freed++;
         node = parent;
-        if(node == topics->topic_tree_root || node == topics->sys_topic_tree_root)
+    }
+    if(try_merge_node(tree, node))
+        tree->gc_stats.nodes_freed++;
+}
+
+/* reclaim the nodes whose grace period is over */
+static size_t reclaim_nodes(topic_tree_t* tree, int64_t now, size_t max_nodes)
+{
+    size_t n = 0;
+    for(; n < max_nodes && tree->reclaim_head < tmq_vec_size(tree->reclaim_list); n++)
+    {
+        topic_reclaim_t* reclaim = tmq_vec_at(tree->reclaim_list, tree->reclaim_head);
+        if(now - reclaim->since < TOPIC_GC_GRACE)
             break;
+        tree->reclaim_head++;
+        reclaim_node(tree, reclaim->node, now);
     }
+    /* drop the consumed part of the list once it makes up half of it */
+    size_t remain = tmq_vec_size(tree->reclaim_list) - tree->reclaim_head;
+    if(tree->reclaim_head > remain)
+    {
+        topic_reclaim_t* reclaims = tmq_vec_begin(tree->reclaim_list);
+        if(remain)
+            memmove(reclaims, reclaims + tree->reclaim_head, remain * sizeof(topic_reclaim_t));
+        tmq_vec_resize(tree->reclaim_list, remain);
+        tree->reclaim_head = 0;
+    }
+    return n;
 }
 
-void tmq_topics_remove_subscription(tmq_topics_t* topics, char* topic_filter, char* client_id)
+/* returns 1 if the subscription is removed */
+static int remove_subscription(topic_tree_t* tree, topic_tree_node* node, tmq_str_t group_name,
+                               void* subscriber, int64_t now)
 {
-    topic_tree_node* node = add_topic_or_find(topics, topic_filter, 0, NULL);
-    if(!node)
+    int removed = group_name ? remove_shared_member(node, group_name, subscriber) :
+                  erase_subscriber(node, subscriber);
+    try_remove_topic(tree, node, now);
+    return removed;
+}
+
+static void drop_from_level_filter(tmq_topics_t* topics, topic_tree_node* node)
+{
+    topic_level_t level = subscription_first_level(node);
+    level_filter_update(&topics->level_filter, level.name, level.len, -1);
+}
+
+void tmq_topics_remove_subscription(tmq_topics_t* topics, char* topic_filter, void* subscriber)
+{
+    tmq_str_t group_name = NULL;
+    if(tmq_topic_filter_is_shared(topic_filter))
     {
+        topic_filter = parse_shared_filter(topic_filter, &group_name);
+        if(!topic_filter) return;
+    }
+    int64_t now = time_now();
+    topic_tree_t* tree = &topics->trees[writable_index(topics)];
+    topic_tree_node* node = add_topic_or_find(tree, topic_filter, 0);
+    if(!node)
         tlog_warn("topic filter doesn't exist: %s", topic_filter);
-        return;
+    else
+    {
+        if(remove_subscription(tree, node, group_name, subscriber, now))
+            drop_from_level_filter(topics, node);
+        if(topics->concurrent)
+        {
+            switch_active_tree(topics);
+            tree = &topics->trees[writable_index(topics)];
+            remove_subscription(tree, add_topic_or_find(tree, topic_filter, 0), group_name, subscriber, now);
+        }
+    }
+    tmq_str_free(group_name);
+}
+
+void tmq_topics_drop_subscription(tmq_topics_t* topics, void* subscriber, topic_subscription_t* sub)
+{
+    int64_t now = time_now();
+    int idx = writable_index(topics);
+    if(remove_subscription(&topics->trees[idx], sub->nodes[idx], sub->group_name, subscriber, now))
+        drop_from_level_filter(topics, sub->nodes[idx]);
+    if(topics->concurrent)
+    {
+        switch_active_tree(topics);
+        idx = writable_index(topics);
+        remove_subscription(&topics->trees[idx], sub->nodes[idx], sub->group_name, subscriber, now);
+    }
+    tmq_str_free(sub->group_name);
+    sub->group_name = NULL;
+}
+
+static void drop_subscriptions(tmq_topics_t* topics, void* subscriber, topic_subscription_map* subscriptions,
+                               int64_t now, int update_filter)
+{
+    int idx = writable_index(topics);
+    tmq_map_iter_t it = tmq_map_iter(*subscriptions);
+    for(; tmq_map_has_next(it); tmq_map_next(*subscriptions, it))
+    {
+        topic_subscription_t* sub = it.second;
+        if(remove_subscription(&topics->trees[idx], sub->nodes[idx], sub->group_name, subscriber, now) && update_filter)
+            drop_from_level_filter(topics, sub->nodes[idx]);
+    }
+}
+
+void tmq_topics_drop_all_subscriptions(tmq_topics_t* topics, void* subscriber, topic_subscription_map* subscriptions)
+{
+    int64_t now = time_now();
+    /* all the subscriptions are removed from a copy before switching, readers are waited for only once */
+    drop_subscriptions(topics, subscriber, subscriptions, now, 1);
+    if(topics->concurrent)
+    {
+        switch_active_tree(topics);
+        drop_subscriptions(topics, subscriber, subscriptions, now, 0);
+    }
+    tmq_map_iter_t it = tmq_map_iter(*subscriptions);
+    for(; tmq_map_has_next(it); tmq_map_next(*subscriptions, it))
+        tmq_str_free(((topic_subscription_t*) it.second)->group_name);
+    tmq_map_clear(*subscriptions);
+}
+
+size_t tmq_topics_gc(tmq_topics_t* topics, size_t max_nodes)
+{
+    int64_t now = time_now();
+    size_t n = reclaim_nodes(&topics->trees[writable_index(topics)], now, max_nodes);
+    /* both copies have the same reclaim list */
+    if(topics->concurrent && n > 0)
+    {
+        switch_active_tree(topics);
+        reclaim_nodes(&topics->trees[writable_index(topics)], now, max_nodes);
     }
-    tmq_map_erase(node->subscribers, client_id);
-    try_remove_topic(topics, node);
+    tmq_intern_table_evict(&topics->topic_table, INTERN_MAX_UNUSED);
+    return n;
 }
 
-static void match(tmq_topics_t* topics, topic_tree_node* node, int n, int is_any_wildcard,
-                  str_vec* levels, char* topic, tmq_message* message, int retain)
+static shared_member_t* select_shared_member(tmq_topics_t* topics, shared_group_t* group, tmq_interned_topic_t* topic)
 {
-    if(n == tmq_vec_size(*levels) || is_any_wildcard)
+    size_t n = tmq_vec_size(group->members);
+    /* the round-robin position may be advanced by several readers at the same time, a lost update is harmless */
+    size_t next = __atomic_load_n(&group->next, __ATOMIC_RELAXED);
+    size_t start = topics->shared_policy == SHARED_STICKY ? topic->hash % n : next % n;
+    shared_member_t* selected = NULL;
+    int min_load = 0;
+    /* search from the round-robin position (or the topic's hash position), skipping offline members */
+    for(size_t i = 0; i < n; i++)
     {
-        tmq_map_iter_t it = tmq_map_iter(node->subscribers);
-        for(; tmq_map_has_next(it); tmq_map_next(node->subscribers, it))
+        shared_member_t* member = tmq_vec_at(group->members, (start + i) % n);
+        int load = topics->member_load ? topics->member_load(topics->broker, member->subscriber) : 0;
+        if(load < 0)
+            continue;
+        if(topics->shared_policy != SHARED_LEAST_INFLIGHT)
         {
-            char* client_id = it.first;
-            uint8_t required_qos = *(uint8_t*) it.second;
-            topics->on_match(topics->broker, client_id, topic, required_qos, message);
+            selected = member;
+            break;
         }
-        if(n == tmq_vec_size(*levels))
+        if(!selected || load < min_load)
         {
-            /* if this is a retained message, save this message under the topic */
-            if(retain)
-            {
-                if(!node->retain_message)
-                {
-                    node->retain_message = malloc(sizeof(retain_message_t));
-                    node->retain_message->retain_msg.message = tmq_str_empty();
-                    node->retain_message->retain_topic = tmq_str_empty();
-                }
-                node->retain_message->retain_msg.message = tmq_str_assign(node->retain_message->retain_msg.message,
-                                                                          message->message);
-                node->retain_message->retain_msg.qos = message->qos;
-                node->retain_message->retain_topic = tmq_str_assign(node->retain_message->retain_topic, topic);
-            }
-            /* "#" includes the parent */
-            topic_tree_node** next = tmq_map_get(node->childs, "#");
-            if(next)
-            {
-                it = tmq_map_iter((*next)->subscribers);
-                for(; tmq_map_has_next(it); tmq_map_next((*next)->subscribers, it))
-                {
-                    char* client_id = it.first;
-                    uint8_t required_qos = *(uint8_t*) it.second;
-                    topics->on_match(topics->broker, client_id, topic, required_qos, message);
-                }
-            }
+            selected = member;
+            min_load = load;
+            if(!load) break;
         }
-        return;
-    }
-    topic_tree_node** next;
-    char* level = *tmq_vec_at(*levels, n);
-    if((next = tmq_map_get(node->childs, level)) != NULL)
-        match(topics, *next, n + 1, 0, levels, topic, message, retain);
-    else if(retain)
-    {
-        topic_tree_node* new_next = topic_tree_node_new(node, level);
-        tmq_map_put(node->childs, level, new_next);
-        match(topics, new_next, n + 1, 0, levels, topic, message, retain);
     }
-    if((next = tmq_map_get(node->childs, "+")) != NULL)
-        match(topics, *next, n + 1, 0, levels, topic, message, 0);
-    if((next = tmq_map_get(node->childs, "#")) != NULL)
-        match(topics, *next, n + 1, 1, levels, topic, message, 0);
+    /* all members are offline, the message will be stored in the session of one member */
+    if(!selected)
+        selected = tmq_vec_at(group->members, start);
+    __atomic_store_n(&group->next, selected - (shared_member_t*) tmq_vec_begin(group->members) + 1, __ATOMIC_RELAXED);
+    return selected;
 }
 
-void tmq_topics_publish(tmq_topics_t* topics, int sys, char* topic, tmq_message* message, int retain)
+/* a message being routed */
+typedef struct topic_publish_s
 {
-    char* lp = topic, *rp = lp;
-    tmq_str_t level;
-    str_vec levels = tmq_vec_make(tmq_str_t);
-    while(1)
+    char* topic;
+    /* interned when the first subscriber is found */
+    tmq_interned_topic_t* interned;
+    /* messages published to the same topic, in order */
+    tmq_message* messages;
+    size_t n;
+    /* large subscriber sets may be handed to on_fanout */
+    int fanout;
+} topic_publish_t;
+
+static void deliver_to_subscribers(tmq_topics_t* topics, topic_tree_node* node, topic_publish_t* pub)
+{
+    if(!has_subscribers(node))
+        return;
+    if(!pub->interned)
+        pub->interned = tmq_intern_topic(&topics->topic_table, pub->topic);
+    tmq_interned_topic_t* topic = pub->interned;
+    match_cb on_match = topics->on_match;
+    if(pub->fanout && topics->fanout_threshold && subscriber_count(node) >= topics->fanout_threshold)
+        on_match = topics->on_fanout;
+    if(node->flags & TOPIC_SUBSCRIBERS_IN_MAP)
     {
-        while(*rp && *rp != '/') rp++;
-        if(rp == lp)
+        tmq_map_iter_t it = tmq_map_iter(node->subscribers.subscriber_map);
+        for(; tmq_map_has_next(it); tmq_map_next(node->subscribers.subscriber_map, it))
         {
-            level = tmq_str_new("");
-            tmq_vec_push_back(levels, level);
+            void* subscriber = *(void**) it.first;
+            uint8_t required_qos = *(uint8_t*) it.second;
+            on_match(topics->broker, subscriber, topic, required_qos, pub->messages, pub->n);
         }
-        else
+    }
+    else
+    {
+        for(int i = 0; i < node->subscriber_cnt; i++)
         {
-            level = tmq_str_new_len(lp, rp - lp);
-            tmq_vec_push_back(levels, level);
+            topic_subscriber_t* subscriber = &node->subscribers.inline_subscribers[i];
+            on_match(topics->broker, subscriber->subscriber, topic, subscriber->qos, pub->messages, pub->n);
         }
-        if(!*rp) break;
-        lp = rp + 1; rp = lp;
-        if(!*lp)
+    }
+    if(!node->shared_groups)
+        return;
+    tmq_map_iter_t it = tmq_map_iter(*node->shared_groups);
+    for(; tmq_map_has_next(it); tmq_map_next(*node->shared_groups, it))
+    {
+        /* members are selected for every message to balance the load */
+        for(size_t i = 0; i < pub->n; i++)
         {
-            level = tmq_str_new("");
-            tmq_vec_push_back(levels, level);
-            break;
+            shared_member_t* member = select_shared_member(topics, it.second, topic);
+            topics->on_match(topics->broker, member->subscriber, topic, member->qos, &pub->messages[i], 1);
         }
     }
-    topic_tree_node* root = sys ? topics->sys_topic_tree_root : topics->topic_tree_root;
-    match(topics, root, 0, 0, &levels, topic, message, retain);
-    for(tmq_str_t* it = tmq_vec_begin(levels); it != tmq_vec_end(levels); it++)
-        tmq_str_free(*it);
-    tmq_vec_free(levels);
 }
 
-static void topic_info(topic_tree_node* node, str_vec* levels)
+/* level points to the next unmatched level in the topic, NULL if all levels are matched */
+static void match(tmq_topics_t* topics, topic_tree_node* node, const char* level, int is_any_wildcard,
+                  topic_publish_t* pub)
 {
-    tmq_map_iter_t it = tmq_map_iter(node->childs);
-    for(; tmq_map_has_next(it); tmq_map_next(node->childs, it))
-    {
-        char* next_level = it.first;
-        topic_tree_node* next = *(topic_tree_node**) it.second;
-        tmq_vec_push_back(*levels, tmq_str_new(next_level));
-        topic_info(next, levels);
-        tmq_str_free(*tmq_vec_pop_back(*levels));
-    }
-    if(tmq_map_size(node->subscribers) > 0 || node->retain_message)
+    if(!level || is_any_wildcard)
     {
-        printf("--------------------\n");
-        for(size_t i = 0; i < tmq_vec_size(*levels); i++)
+        deliver_to_subscribers(topics, node, pub);
+        if(!level)
         {
-            printf("%s", *tmq_vec_at(*levels, i));
-            if(i < tmq_vec_size(*levels) - 1)
-                printf("/");
+            /* "#" includes the parent */
+            topic_tree_node* next = find_child(node, "#", 1);
+            if(next)
+                deliver_to_subscribers(topics, next, pub);
         }
-        printf("\nsubscribers:");
+        return;
+    }
+    const char* level_end = strchrnul(level, '/');
+    const char* next_level = *level_end ? level_end + 1 : NULL;
+    topic_tree_node* next;
+    if((next = find_child(node, level, level_end - level)) != NULL)
+    {
+        size_t len = tmq_str_len(next->levels);
+        if(len == (size_t) (level_end - level))
+            match(topics, next, next_level, 0, pub);
+        /* a compressed node matches several levels at once */
+        else if(!strncmp(level, next->levels, len) && (!level[len] || level[len] == '/'))
+            match(topics, next, level[len] ? level + len + 1 : NULL, 0, pub);
+    }
+    if((next = find_child(node, "+", 1)) != NULL)
+        match(topics, next, next_level, 0, pub);
+    if((next = find_child(node, "#", 1)) != NULL)
+        match(topics, next, next_level, 1, pub);
+}
+
+void tmq_topics_publish(tmq_topics_t* topics, int sys, char* topic, tmq_message* message, int retain)
+{
+    /* if this is a retained message, save it in the retain store before matching,
+     * so a concurrent subscription either gets the message routed or finds it retained */
+    if(retain)
+        tmq_retain_store_put(&topics->retain_store, topic, message);
+    tmq_topics_publish_batch(topics, sys, topic, message, 1);
+}
+
+void tmq_topics_publish_batch(tmq_topics_t* topics, int sys, char* topic, tmq_message* messages, size_t n)
+{
+    /* the broker thread is the only writer, both copies are consistent here */
+    topic_tree_t* tree = &topics->trees[topics->active];
+    topic_publish_t pub = {.topic = topic, .interned = NULL, .messages = messages, .n = n, .fanout = 1};
+    match(topics, sys ? tree->sys_root : tree->root, topic, 0, &pub);
+    if(pub.interned)
+        tmq_interned_topic_put(pub.interned);
+}
+
+void tmq_topics_reader_publish(tmq_topics_t* topics, char* topic, tmq_message* message, int retain)
+{
+    /* the slot is stored plus one, so a thread without one gets NULL */
+    intptr_t reader_id = (intptr_t) pthread_getspecific(topics->reader_key) - 1;
+    if(reader_id < 0)
+    {
+        reader_id = incrementAndGet(topics->readers_cnt, 1) - 1;
+        if(reader_id >= TOPICS_MAX_READERS)
+            fatal_error("too many topic tree readers");
+        pthread_setspecific(topics->reader_key, (void*) (reader_id + 1));
+    }
+    if(retain)
+        tmq_retain_store_put(&topics->retain_store, topic, message);
+    tmq_topics_reader_t* reader = &topics->readers[reader_id];
+    __atomic_add_fetch(&reader->epoch, 1, __ATOMIC_SEQ_CST);
+    topic_tree_t* tree = &topics->trees[atomicGet(topics->active)];
+    topic_publish_t pub = {.topic = topic, .interned = NULL, .messages = message, .n = 1, .fanout = 0};
+    match(topics, tree->root, topic, 0, &pub);
+    __atomic_add_fetch(&reader->epoch, 1, __ATOMIC_RELEASE);
+    if(pub.interned)
+        tmq_interned_topic_put(pub.interned);
+}
+
+static void print_subscriber(tmq_topics_t* topics, void* subscriber, uint8_t qos)
+{
+    if(topics->subscriber_name)
+        printf("<%s, %u> ", topics->subscriber_name(subscriber), qos);
+    else
+        printf("<%p, %u> ", subscriber, qos);
+}
 
-        it = tmq_map_iter(node->subscribers);
-        for(; tmq_map_has_next(it); tmq_map_next(node->subscribers, it))
+static void topic_info(tmq_topics_t* topics, topic_tree_node* node, tmq_str_t path)
+{
+    topic_path childs = tmq_vec_make(topic_tree_node*);
+    get_childs(node, &childs);
+    for(topic_tree_node** it = tmq_vec_begin(childs); it != tmq_vec_end(childs); it++)
+    {
+        tmq_str_t child_path = tmq_str_new(path);
+        if(node->parent)
+            child_path = tmq_str_append_char(child_path, '/');
+        child_path = tmq_str_append_str(child_path, (*it)->levels);
+        topic_info(topics, *it, child_path);
+        tmq_str_free(child_path);
+    }
+    tmq_vec_free(childs);
+    if(!has_subscribers(node))
+        return;
+    printf("--------------------\n");
+    printf("%s", path);
+    printf("\nsubscribers:");
+    if(node->flags & TOPIC_SUBSCRIBERS_IN_MAP)
+    {
+        tmq_map_iter_t it = tmq_map_iter(node->subscribers.subscriber_map);
+        for(; tmq_map_has_next(it); tmq_map_next(node->subscribers.subscriber_map, it))
+            print_subscriber(topics, *(void**) it.first, *(uint8_t*) it.second);
+    }
+    else
+    {
+        for(int i = 0; i < node->subscriber_cnt; i++)
+            print_subscriber(topics, node->subscribers.inline_subscribers[i].subscriber,
+                             node->subscribers.inline_subscribers[i].qos);
+    }
+    if(node->shared_groups)
+    {
+        tmq_map_iter_t it = tmq_map_iter(*node->shared_groups);
+        for(; tmq_map_has_next(it); tmq_map_next(*node->shared_groups, it))
         {
-            char* client_id = it.first;
-            uint8_t required_qos = *(uint8_t*) it.second;
-            printf("<%s, %u> ", client_id, required_qos);
+            shared_group_t* group = it.second;
+            printf("$share/%s[", (char*) it.first);
+            for(shared_member_t* member = tmq_vec_begin(group->members); member != tmq_vec_end(group->members); member++)
+                print_subscriber(topics, member->subscriber, member->qos);
+            printf("] ");
         }
-        printf("\n");
-        if(node->retain_message)
-            printf("retain message: %s\n", node->retain_message->retain_msg.message);
     }
+    printf("\n");
 }
 
 void tmq_topics_info(tmq_topics_t* topics)
 {
-    str_vec levels = tmq_vec_make(tmq_str_t);
-    topic_info(topics->topic_tree_root, &levels);
+    tmq_str_t path = tmq_str_empty();
+    topic_tree_t* tree = &topics->trees[topics->active];
+    topic_info(topics, tree->root, path);
     printf("--------------------\n");
-    tmq_vec_clear(levels);
-    topic_info(topics->sys_topic_tree_root, &levels);
+    topic_info(topics, tree->sys_root, path);
     printf("--------------------\n");
-    tmq_vec_free(levels);
-}
\ No newline at end of file
+    printf("topic tree nodes: %lu\n", tree->node_slab.nodes_in_use);
+    printf("nodes waiting for reclaim: %lu, reused: %lu, freed: %lu\n",
+           tmq_vec_size(tree->reclaim_list) - tree->reclaim_head, tree->gc_stats.nodes_reused, tree->gc_stats.nodes_freed);
+    printf("retained messages: %lu\n", tmq_retain_store_size(&topics->retain_store));
+    printf("interned topics: %lu\n", tmq_intern_table_size(&topics->topic_table));
+    tmq_str_free(path);
+}
@@ -7,40 +7,227 @@
 #include "base/mqtt_str.h"
 #include "base/mqtt_map.h"
 #include "mqtt_types.h"
+#include "mqtt_retain.h"
+#include "mqtt_intern.h"
+#include "event/mqtt_timer.h"
 
-typedef struct retain_message_s
+typedef enum shared_policy_e
 {
-    tmq_message retain_msg;
-    tmq_str_t retain_topic;
-} retain_message_t;
-typedef tmq_vec(retain_message_t*) retain_message_list;
+    SHARED_ROUND_ROBIN,
+    SHARED_LEAST_INFLIGHT,
+    /* messages of the same topic always go to the same member while the group doesn't change */
+    SHARED_STICKY
+} shared_policy_e;
+
+/* the subscriber is an opaque pointer to the tree (a session in the broker) */
+typedef struct shared_member_s
+{
+    void* subscriber;
+    uint8_t qos;
+} shared_member_t;
+typedef tmq_vec(shared_member_t) shared_member_list;
+
+/* subscribers of "$share/{group}/{filter}", each message is delivered to only one of them */
+typedef struct shared_group_s
+{
+    shared_member_list members;
+    size_t next;
+} shared_group_t;
+
+/* a child map is keyed by the first level of the child, which points into the child's levels */
+typedef struct topic_level_s
+{
+    const char* name;
+    size_t len;
+} topic_level_t;
+
+typedef struct topic_subscriber_s
+{
+    void* subscriber;
+    uint8_t qos;
+} topic_subscriber_t;
+
+typedef tmq_map(topic_level_t, struct topic_tree_node*) topic_child_map;
+typedef tmq_map(void*, uint8_t) topic_subscriber_map;
+typedef tmq_map(char*, shared_group_t) shared_group_map;
+
+/* small sets of childs and subscribers are kept inline in the node,
+ * they are moved into a hash map when the number exceeds these limits */
+#define TOPIC_INLINE_CHILDS         4
+#define TOPIC_INLINE_SUBSCRIBERS    4
+/* number of nodes allocated at a time by the node slab */
+#define TOPIC_NODE_SLAB_SIZE        64
+
+/* nodes without subscribers are kept in the tree for a grace period, so a client resubscribing
+ * shortly after unsubscribing reuses them. they are freed in batches of at most TOPIC_GC_BATCH */
+#define TOPIC_GC_GRACE              SEC_US(30)
+#define TOPIC_GC_BATCH              256
+
+#define TOPIC_CHILDS_IN_MAP         1
+#define TOPIC_SUBSCRIBERS_IN_MAP    2
+/* the node is in the reclaim list */
+#define TOPIC_NODE_RECLAIM          4
+/* the node got a subscriber while in the reclaim list, its grace period starts over when it's reached */
+#define TOPIC_NODE_REUSED           8
 
 typedef struct topic_tree_node
 {
-    tmq_str_t level_name;
+    /* one or more topic levels joined by '/'. a chain of non-wildcard levels
+     * with only one child and no subscribers is compressed into one node */
+    tmq_str_t levels;
+    uint32_t first_level_len;
+    uint8_t flags;
+    uint8_t child_cnt;
+    uint8_t subscriber_cnt;
     struct topic_tree_node* parent;
-    /* next level */
-    tmq_map(char*, struct topic_tree_node*) childs;
-    /* the subscriber's client_id and max qos */
-    tmq_map(char*, uint8_t) subscribers;
-    retain_message_t* retain_message;
+    union
+    {
+        struct topic_tree_node* inline_childs[TOPIC_INLINE_CHILDS];
+        topic_child_map child_map;
+    } childs;
+    /* the subscribers and their max qos */
+    union
+    {
+        topic_subscriber_t inline_subscribers[TOPIC_INLINE_SUBSCRIBERS];
+        topic_subscriber_map subscriber_map;
+    } subscribers;
+    /* shared subscription groups of this topic filter keyed by the group name, created on demand */
+    shared_group_map* shared_groups;
 } topic_tree_node;
 
-typedef void(*match_cb)(tmq_broker_t* broker, char* client_id,
-                        char* topic, uint8_t required_qos, tmq_message* message);
-typedef struct tmq_topics_s
+typedef tmq_vec(topic_tree_node*) topic_node_chunk_list;
+typedef struct topic_node_slab_s
+{
+    topic_node_chunk_list chunks;
+    topic_tree_node* free_nodes;
+    size_t nodes_in_use;
+} topic_node_slab_t;
+
+typedef struct topic_reclaim_s
 {
-    topic_tree_node* topic_tree_root;
+    topic_tree_node* node;
+    /* when the node lost its last subscriber */
+    int64_t since;
+} topic_reclaim_t;
+typedef tmq_vec(topic_reclaim_t) topic_reclaim_list;
+
+typedef struct topic_gc_stats_s
+{
+    /* nodes that got subscribers again before they were reclaimed */
+    size_t nodes_reused;
+    size_t nodes_freed;
+} topic_gc_stats_t;
+
+typedef struct topic_tree_s
+{
+    topic_tree_node* root;
     /* system topics */
-    topic_tree_node* sys_topic_tree_root;
+    topic_tree_node* sys_root;
+    topic_node_slab_t node_slab;
+    /* nodes waiting for reclaim in the order they lost their subscribers, starting at reclaim_head */
+    topic_reclaim_list reclaim_list;
+    size_t reclaim_head;
+    topic_gc_stats_t gc_stats;
+} topic_tree_t;
+
+/* where a subscription is kept in the topic tree, so it can be removed without searching the tree.
+ * a node is never moved or freed while it holds subscribers. */
+typedef struct topic_subscription_s
+{
+    /* the node holding the subscription in each copy of the tree */
+    topic_tree_node* nodes[2];
+    /* the group of a shared subscription, NULL otherwise */
+    tmq_str_t group_name;
+    uint8_t qos;
+} topic_subscription_t;
+/* subscriptions of a subscriber keyed by topic filter */
+typedef tmq_map(char*, topic_subscription_t) topic_subscription_map;
+
+/* maximum number of threads that can route messages concurrently with the broker thread */
+#define TOPICS_MAX_READERS  64
+
+/* number of counters of the first level filter, must be a power of 2 */
+#define TOPIC_LEVEL_FILTER_SIZE 4096
+
+/* a counting bloom filter of the first levels of all the subscribed topic filters,
+ * updated by the broker thread and read by any thread to drop topics without subscribers early */
+typedef struct topic_level_filter_s
+{
+    uint32_t counters[TOPIC_LEVEL_FILTER_SIZE];
+    /* subscriptions starting with a wildcard may match any topic */
+    uint32_t wildcard_subscriptions;
+} topic_level_filter_t;
+
+/* the epoch is odd while the reader is matching a topic */
+typedef struct tmq_topics_reader_s
+{
+    uint64_t epoch;
+    char padding[56];
+} tmq_topics_reader_t;
+
+/* the interned topic is shared by all the subscribers, acquire a reference to keep it.
+ * messages published to the same topic may be delivered to a subscriber together, in order */
+typedef void(*match_cb)(tmq_broker_t* broker, void* subscriber, tmq_interned_topic_t* topic,
+                        uint8_t required_qos, tmq_message* messages, size_t n);
+/* returns the number of unacknowledged messages of a subscriber, or -1 if it is offline */
+typedef int(*member_load_cb)(tmq_broker_t* broker, void* subscriber);
+/* used by tmq_topics_info() to print subscribers */
+typedef const char*(*subscriber_name_cb)(void* subscriber);
+/* Subscriptions are modified only by the broker thread. If concurrent readers are enabled,
+ * two copies of the topic tree are kept: readers match topics against the active copy
+ * without locking, while the broker thread modifies the other one, switches the active
+ * copy, waits until no reader is using the old copy and then applies the same change to it. */
+typedef struct tmq_topics_s
+{
+    topic_tree_t trees[2];
+    int active;
+    int concurrent;
+    tmq_topics_reader_t readers[TOPICS_MAX_READERS];
+    /* reader slots are assigned to threads on their first concurrent publish,
+     * the slot of a thread is kept under reader_key so each instance has its own */
+    int readers_cnt;
+    pthread_key_t reader_key;
+    topic_level_filter_t level_filter;
+    /* retained messages are kept apart from the subscription tree */
+    tmq_retain_store_t retain_store;
+    /* names of the topics being published to */
+    tmq_intern_table_t topic_table;
     match_cb on_match;
+    subscriber_name_cb subscriber_name;
+    shared_policy_e shared_policy;
+    member_load_cb member_load;
+    /* subscribers of a topic with at least fanout_threshold subscribers are handed to on_fanout */
+    size_t fanout_threshold;
+    match_cb on_fanout;
     tmq_broker_t* broker;
 } tmq_topics_t;
 
-void tmq_topics_init(tmq_topics_t* topics, tmq_broker_t* broker, match_cb on_match);
-retain_message_list tmq_topics_add_subscription(tmq_topics_t* topics, char* topic_filter, char* client_id, uint8_t qos);
-void tmq_topics_remove_subscription(tmq_topics_t* topics, char* topic_filter, char* client_id);
+void tmq_topics_init(tmq_topics_t* topics, tmq_broker_t* broker, match_cb on_match, subscriber_name_cb subscriber_name);
+/* must be called before any subscription is added */
+void tmq_topics_enable_concurrent_readers(tmq_topics_t* topics);
+void tmq_topics_set_shared_policy(tmq_topics_t* topics, shared_policy_e policy, member_load_cb member_load);
+/* only used by tmq_topics_publish() and tmq_topics_publish_batch(), a threshold of 0 disables it */
+void tmq_topics_set_fanout(tmq_topics_t* topics, size_t threshold, match_cb on_fanout);
+int tmq_topic_filter_is_shared(const char* topic_filter);
+/* returns -1 if the topic filter is invalid, otherwise fills sub (if not NULL) with the place of the subscription */
+int tmq_topics_add_subscription(tmq_topics_t* topics, char* topic_filter, void* subscriber, uint8_t qos,
+                                topic_subscription_t* sub);
+void tmq_topics_remove_subscription(tmq_topics_t* topics, char* topic_filter, void* subscriber);
+/* remove a subscription filled by tmq_topics_add_subscription() */
+void tmq_topics_drop_subscription(tmq_topics_t* topics, void* subscriber, topic_subscription_t* sub);
+/* remove all the subscriptions of a subscriber and clear the map */
+void tmq_topics_drop_all_subscriptions(tmq_topics_t* topics, void* subscriber, topic_subscription_map* subscriptions);
+/* returns 0 if no subscription can match the topic, may be called by any thread */
+int tmq_topics_may_match(tmq_topics_t* topics, const char* topic);
+/* called by the broker thread */
 void tmq_topics_publish(tmq_topics_t* topics, int sys, char* topic, tmq_message* message, int retain);
+/* route several messages of the same topic with a single match, the messages are not retained */
+void tmq_topics_publish_batch(tmq_topics_t* topics, int sys, char* topic, tmq_message* messages, size_t n);
+/* called by other threads when concurrent readers are enabled */
+void tmq_topics_reader_publish(tmq_topics_t* topics, char* topic, tmq_message* message, int retain);
+/* reclaim at most max_nodes nodes whose grace period is over and evict unused interned topics,
+ * returns the number of nodes examined */
+size_t tmq_topics_gc(tmq_topics_t* topics, size_t max_nodes);
 void tmq_topics_info(tmq_topics_t* topics);
 
 #endif //TINYMQTT_MQTT_TOPIC_H
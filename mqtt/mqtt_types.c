@@ -2,6 +2,8 @@
 // Created by zr on 23-6-8.
 //
 #include "mqtt_types.h"
+#include "base/mqtt_util.h"
+#include <stdlib.h>
 
 void tcp_conn_broker_ctx_cleanup(void* arg)
 {
@@ -12,4 +14,48 @@ void tcp_conn_broker_ctx_cleanup(void* arg)
     for(; pkt != tmq_vec_end(ctx->pending_packets); pkt++)
         tmq_any_pkt_cleanup(pkt);
     tmq_vec_free(ctx->pending_packets);
+    for(size_t i = ctx->send_head; i < tmq_vec_size(ctx->send_queue); i++)
+        tmq_any_pkt_cleanup(tmq_vec_at(ctx->send_queue, i));
+    tmq_vec_free(ctx->send_queue);
+    for(pkt = tmq_vec_begin(ctx->conflated); pkt != tmq_vec_end(ctx->conflated); pkt++)
+        tmq_any_pkt_cleanup(pkt);
+    tmq_vec_free(ctx->conflated);
+    if(ctx->conflated_index.base)
+        tmq_map_free(ctx->conflated_index);
+}
+
+void tcp_conn_broker_ctx_compact(tcp_conn_broker_ctx* ctx)
+{
+    tmq_vec_shrink(ctx->pending_packets);
+    if(ctx->send_head == tmq_vec_size(ctx->send_queue))
+    {
+        tmq_vec_clear(ctx->send_queue);
+        ctx->send_head = 0;
+        tmq_vec_shrink(ctx->send_queue);
+    }
+    if(tmq_vec_empty(ctx->conflated))
+    {
+        tmq_vec_shrink(ctx->conflated);
+        if(ctx->conflated_index.base)
+        {
+            tmq_map_free(ctx->conflated_index);
+            ctx->conflated_index.base = NULL;
+        }
+    }
+}
+
+size_t tcp_conn_broker_ctx_memory(tcp_conn_broker_ctx* ctx)
+{
+    return sizeof(tcp_conn_broker_ctx) + tmq_vec_memory(ctx->pending_packets) + tmq_vec_memory(ctx->send_queue) +
+           tmq_vec_memory(ctx->conflated) + tmq_map_memory(ctx->conflated_index);
+}
+
+void fanout_batch_release(fanout_batch* batch)
+{
+    if(decrementAndGet(batch->refcnt, 1))
+        return;
+    for(size_t i = 0; i < batch->n; i++)
+        tmq_str_free(batch->messages[i].message);
+    tmq_interned_topic_put(batch->topic);
+    free(batch);
 }
\ No newline at end of file
@@ -38,6 +38,15 @@ typedef struct tcp_conn_broker_ctx_s
 {
     TCP_CONN_CTX_COMMON
     packet_list pending_packets;
+    /* packets waiting for their turn to be sent, the ones before send_head are sent */
+    packet_list send_queue;
+    size_t send_head;
+    /* when the connection went above the egress hard limit, 0 if it's below */
+    int64_t over_limit_since;
+    /* the latest qos 0 message of each conflated topic waiting for the unsent output to be written,
+     * indexed by the interned topic. the index is created on first use */
+    packet_list conflated;
+    tmq_map(tmq_interned_topic_t*, size_t) conflated_index;
 } tcp_conn_broker_ctx;
 
 typedef struct session_connect_req
@@ -113,6 +122,33 @@ typedef struct message_ctl
 } message_ctl;
 typedef tmq_vec(message_ctl) message_ctl_list;
 
+/* messages published to a topic in a batch of message_ctl requests, in arrival order */
+typedef tmq_vec(tmq_message) message_list;
+typedef struct publish_batch
+{
+    tmq_str_t topic;
+    message_list messages;
+} publish_batch;
+typedef tmq_vec(publish_batch) publish_batch_list;
+
+/* messages of a topic shared by the fan-out requests sent to all the io groups */
+typedef struct fanout_batch
+{
+    int refcnt;
+    tmq_interned_topic_t* topic;
+    size_t n;
+    tmq_message messages[];
+} fanout_batch;
+
+/* deliver a fan-out batch to a session in the io group of its connection */
+typedef struct fanout_req
+{
+    tmq_session_t* session;
+    uint8_t qos;
+    fanout_batch* batch;
+} fanout_req;
+typedef tmq_vec(fanout_req) fanout_req_list;
+
 typedef struct packet_send_req
 {
     tmq_tcp_conn_t* conn;
@@ -120,4 +156,9 @@ typedef struct packet_send_req
 } packet_send_req;
 typedef tmq_vec(packet_send_req) packet_send_list;
 
+void fanout_batch_release(fanout_batch* batch);
+/* release the unused capacity of the packet queues of an idle connection */
+void tcp_conn_broker_ctx_compact(tcp_conn_broker_ctx* ctx);
+size_t tcp_conn_broker_ctx_memory(tcp_conn_broker_ctx* ctx);
+
 #endif //TINYMQTT_MQTT_TYPES_H
@@ -3,10 +3,21 @@
 //
 #include "mqtt_acceptor.h"
 #include "base/mqtt_util.h"
+#include "base/mqtt_obj_pool.h"
+#include "tlog.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+
+static void drop_connection(tmq_acceptor_t* acceptor)
+{
+    close(acceptor->idle_socket);
+    acceptor->idle_socket = accept(acceptor->lis_socket, NULL, NULL);
+    close(acceptor->idle_socket);
+    acceptor->idle_socket = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
 
 static void acceptor_cb(tmq_socket_t fd, uint32_t event, void* arg)
 {
@@ -14,16 +25,30 @@ static void acceptor_cb(tmq_socket_t fd, uint32_t event, void* arg)
     tmq_socket_addr_t peer_addr;
     tmq_socket_t conn = tmq_socket_accept(fd, &peer_addr);
     if(conn < 0 && errno == EMFILE)
-    {
-        close(acceptor->idle_socket);
-        acceptor->idle_socket = accept(fd, NULL, NULL);
-        close(acceptor->idle_socket);
-        acceptor->idle_socket = open("/dev/null", O_RDONLY | O_CLOEXEC);
-    }
+        drop_connection(acceptor);
     else if(acceptor->connection_cb)
         acceptor->connection_cb(conn, acceptor->arg);
 }
 
+static void accept_complete(tmq_uring_op_t* op, int res, uint32_t flags)
+{
+    tmq_acceptor_t* acceptor = op->arg;
+    if(res >= 0)
+    {
+        if(acceptor->connection_cb)
+            acceptor->connection_cb(res, acceptor->arg);
+        else
+            close(res);
+    }
+    else if(res == -EMFILE)
+        drop_connection(acceptor);
+    else if(res != -ECANCELED && res != -ECONNABORTED && res != -EINTR)
+        tlog_error("accept error %d: %s", -res, strerror(-res));
+    /* the multishot accept stops on errors */
+    if(!(flags & IORING_CQE_F_MORE) && res != -ECANCELED)
+        tmq_uring_prep_accept_multishot(acceptor->loop->uring, acceptor->lis_socket, &acceptor->accept_op);
+}
+
 void tmq_acceptor_init(tmq_acceptor_t* acceptor, tmq_event_loop_t* loop, uint16_t port)
 {
     if(!acceptor) return;
@@ -33,6 +58,13 @@ void tmq_acceptor_init(tmq_acceptor_t* acceptor, tmq_event_loop_t* loop, uint16_
     tmq_socket_reuse_addr(acceptor->lis_socket, 1);
     tmq_socket_bind(acceptor->lis_socket, NULL, port);
     acceptor->idle_socket = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if(loop->uring)
+    {
+        acceptor->new_conn_handler = NULL;
+        acceptor->accept_op.cb = accept_complete;
+        acceptor->accept_op.arg = acceptor;
+        return;
+    }
     acceptor->new_conn_handler = tmq_event_handler_new(acceptor->lis_socket, EPOLLIN,
                                                          acceptor_cb, acceptor);
     tmq_handler_register(loop, acceptor->new_conn_handler);
@@ -43,6 +75,8 @@ void tmq_acceptor_listen(tmq_acceptor_t* acceptor)
     if(atomicExchange(acceptor->listening, 1))
         return;
     tmq_socket_listen(acceptor->lis_socket);
+    if(acceptor->loop->uring)
+        tmq_uring_prep_accept_multishot(acceptor->loop->uring, acceptor->lis_socket, &acceptor->accept_op);
 }
 
 void tmq_acceptor_set_cb(tmq_acceptor_t* acceptor, tmq_new_connection_cb cb, void* arg)
@@ -53,8 +87,11 @@ void tmq_acceptor_set_cb(tmq_acceptor_t* acceptor, tmq_new_connection_cb cb, voi
 
 void tmq_acceptor_destroy(tmq_acceptor_t* acceptor)
 {
-    tmq_handler_unregister(acceptor->loop, acceptor->new_conn_handler);
-    free(acceptor->new_conn_handler);
+    if(acceptor->new_conn_handler)
+    {
+        tmq_handler_unregister(acceptor->loop, acceptor->new_conn_handler);
+        tmq_obj_free(acceptor->new_conn_handler);
+    }
     close(acceptor->lis_socket);
     close(acceptor->idle_socket);
 }
\ No newline at end of file
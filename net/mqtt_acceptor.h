@@ -15,6 +15,8 @@ typedef struct tmq_acceptor_s
     tmq_socket_t lis_socket;
     tmq_socket_t idle_socket;
     tmq_event_handler_t* new_conn_handler;
+    /* used instead of new_conn_handler if the loop uses io_uring */
+    tmq_uring_op_t accept_op;
     tmq_new_connection_cb connection_cb;
     void* arg;
     int listening;
@@ -3,27 +3,176 @@
 //
 #include "mqtt_buffer.h"
 #include "base/mqtt_vec.h"
+#include "base/mqtt_util.h"
 #include "tlog.h"
 #include <stdlib.h>
+#include <malloc.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
-#include <sys/ioctl.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <limits.h>
 #include <stdio.h>
+#include <unistd.h>
 
 void tmq_buffer_init(tmq_buffer_t* buffer)
 {
     if(!buffer) return;
     buffer->first = buffer->last = NULL;
     buffer->readable_bytes = 0;
-    bzero(buffer->free_chunk_list, 5 * sizeof(tmq_buffer_chunk_t*));
+    buffer->ring = NULL;
+    buffer->ring_size = buffer->ring_read = 0;
+}
+
+/* map the same pages at [ring, ring + size) and [ring + size, ring + 2 * size) */
+static char* ring_map(size_t size)
+{
+    int fd = memfd_create("tmq_buffer", MFD_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+    char* ring = NULL;
+    if(ftruncate(fd, (off_t) size) == 0)
+    {
+        char* addr = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(addr != MAP_FAILED)
+        {
+            if(mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+               mmap(addr + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED)
+                ring = addr;
+            else
+                munmap(addr, size * 2);
+        }
+    }
+    close(fd);
+    return ring;
+}
+
+/* make room for size more bytes, the ring is doubled until they fit. a ring released by
+ * tmq_buffer_shrink is mapped again here. returns -1 with ENOMEM if the new ring can't be mapped,
+ * the old one is kept */
+static int ring_reserve(tmq_buffer_t* buffer, size_t size)
+{
+    if(buffer->ring && buffer->ring_size - buffer->readable_bytes >= size)
+        return 0;
+    size_t ring_size = buffer->ring_size;
+    while(ring_size - buffer->readable_bytes < size)
+        ring_size *= 2;
+    char* ring = ring_map(ring_size);
+    if(!ring)
+    {
+        tlog_error("ring_reserve(): mmap() error %d: %s", errno, strerror(errno));
+        errno = ENOMEM;
+        return -1;
+    }
+    if(buffer->ring)
+    {
+        memcpy(ring, buffer->ring + buffer->ring_read, buffer->readable_bytes);
+        munmap(buffer->ring, buffer->ring_size * 2);
+    }
+    buffer->ring = ring;
+    buffer->ring_size = ring_size;
+    buffer->ring_read = 0;
+    return 0;
+}
+
+static void ring_consume(tmq_buffer_t* buffer, size_t size)
+{
+    buffer->ring_read = (buffer->ring_read + size) & (buffer->ring_size - 1);
+}
+
+int tmq_buffer_init_ring(tmq_buffer_t* buffer, size_t size)
+{
+    if(!buffer || buffer->readable_bytes || buffer->ring_size)
+        return -1;
+    size_t ring_size = sysconf(_SC_PAGESIZE);
+    while(ring_size < size)
+        ring_size *= 2;
+    char* ring = ring_map(ring_size);
+    if(!ring)
+        return -1;
+    tmq_buffer_free(buffer);
+    tmq_buffer_init(buffer);
+    buffer->ring = ring;
+    buffer->ring_size = ring_size;
+    return 0;
+}
+
+const char* tmq_buffer_contiguous(tmq_buffer_t* buffer, size_t size)
+{
+    if(!size || size > buffer->readable_bytes)
+        return NULL;
+    if(buffer->ring_size)
+        return buffer->ring + buffer->ring_read;
+    if(!buffer->first || CHUNK_DATA_LEN(buffer->first) < size)
+        return NULL;
+    return buffer->first->buf + buffer->first->read_idx;
+}
+
+static __thread tmq_chunk_pool_t* local_pool;
+
+void tmq_chunk_pool_init(tmq_chunk_pool_t* pool, size_t limit)
+{
+    bzero(pool, sizeof(tmq_chunk_pool_t));
+    pool->limit = limit;
+}
+
+void tmq_chunk_pool_attach(tmq_chunk_pool_t* pool)
+{
+    local_pool = pool;
+}
+
+static int chunk_class(size_t size)
+{
+    int c = 0;
+    while(((size_t) BUFFER_CHUNK_MIN << c) < size)
+        c++;
+    return c;
+}
+
+static tmq_buffer_chunk_t* pool_pop(tmq_chunk_pool_t* pool, int c)
+{
+    tmq_buffer_chunk_t* chunk = pool->free_lists[c];
+    pool->free_lists[c] = chunk->next;
+    chunk->next = NULL;
+    atomicSet(pool->held_bytes, pool->held_bytes - chunk->chunk_size);
+    if(pool->held_bytes < pool->idle_bytes)
+        pool->idle_bytes = pool->held_bytes;
+    incrementAndGet(pool->hits, 1);
+    return chunk;
+}
+
+/* a cached chunk of at least size bytes */
+static tmq_buffer_chunk_t* find_free_chunk(size_t size)
+{
+    tmq_chunk_pool_t* pool = local_pool;
+    if(!pool || size > CHUNK_POOL_MAX_CHUNK)
+        return NULL;
+    int c = chunk_class(size);
+    return pool->free_lists[c] ? pool_pop(pool, c) : NULL;
+}
+
+static tmq_buffer_chunk_t* get_largest_free_chunk()
+{
+    tmq_chunk_pool_t* pool = local_pool;
+    if(!pool) return NULL;
+    for(int c = CHUNK_POOL_CLASSES - 1; c >= 0; c--)
+        if(pool->free_lists[c])
+            return pool_pop(pool, c);
+    return NULL;
 }
 
 static tmq_buffer_chunk_t* buffer_chunk_new(size_t size)
 {
+    tmq_buffer_chunk_t* chunk = find_free_chunk(size);
+    if(chunk)
+        return chunk;
     size = size < BUFFER_CHUNK_MIN ? BUFFER_CHUNK_MIN : size;
-    tmq_buffer_chunk_t* chunk = malloc(sizeof(tmq_buffer_chunk_t) + size);
+    if(size <= CHUNK_POOL_MAX_CHUNK)
+        size = BUFFER_CHUNK_MIN << chunk_class(size);
+    if(local_pool)
+        incrementAndGet(local_pool->misses, 1);
+    chunk = malloc(sizeof(tmq_buffer_chunk_t) + size);
     if(!chunk)
     {
         tlog_error("buffer_chunk_new(): out of memory");
@@ -35,65 +184,70 @@ static tmq_buffer_chunk_t* buffer_chunk_new(size_t size)
     return chunk;
 }
 
-static void buffer_chunk_realign(tmq_buffer_chunk_t* chunk)
+static void buffer_chunk_remove(tmq_buffer_chunk_t* chunk)
 {
-    if(chunk->read_idx == 0) return;
-    memmove(chunk->buf, chunk->buf + chunk->read_idx, CHUNK_DATA_LEN(chunk));
-    chunk->write_idx -= chunk->read_idx;
-    chunk->read_idx = 0;
+    tmq_chunk_pool_t* pool = local_pool;
+    if(!pool || chunk->chunk_size > CHUNK_POOL_MAX_CHUNK || pool->held_bytes + chunk->chunk_size > pool->limit)
+    {
+        free(chunk);
+        return;
+    }
+    int c = chunk_class(chunk->chunk_size);
+    chunk->read_idx = chunk->write_idx = 0;
+    chunk->next = pool->free_lists[c];
+    pool->free_lists[c] = chunk;
+    atomicSet(pool->held_bytes, pool->held_bytes + chunk->chunk_size);
 }
 
-static tmq_buffer_chunk_t* find_free_chunk(tmq_buffer_t* buffer, size_t req_size)
+void tmq_chunk_pool_trim(tmq_chunk_pool_t* pool)
 {
-    tmq_buffer_chunk_t* chunk = NULL;
-    size_t free_list_idx = FREE_LIST_INDEX(req_size);
-    for(; free_list_idx < 5; free_list_idx++)
+    size_t released = 0;
+    for(int c = CHUNK_POOL_CLASSES - 1; c >= 0 && released < pool->idle_bytes; c--)
     {
-        tmq_buffer_chunk_t** next = &buffer->free_chunk_list[free_list_idx];
-        while(*next && (*next)->chunk_size < req_size)
-            next = &(*next)->next;
-        if(!*next)
-            continue;
-        chunk = *next;
-        *next = (*next)->next;
-        chunk->next = NULL;
-        break;
+        while(pool->free_lists[c] && released < pool->idle_bytes)
+        {
+            tmq_buffer_chunk_t* chunk = pool->free_lists[c];
+            pool->free_lists[c] = chunk->next;
+            released += chunk->chunk_size;
+            free(chunk);
+        }
     }
-    return chunk;
+    atomicSet(pool->held_bytes, pool->held_bytes - released);
+    pool->idle_bytes = pool->held_bytes;
+    if(released)
+        malloc_trim(0);
 }
 
-static tmq_buffer_chunk_t* get_largest_free_chunk(tmq_buffer_t* buffer)
+void tmq_chunk_pool_destroy(tmq_chunk_pool_t* pool)
 {
-    int i = 4;
-    while(i >= 0 && !buffer->free_chunk_list[i])
-        i--;
-    if(i < 0) return NULL;
-    tmq_buffer_chunk_t* largest = buffer->free_chunk_list[i];
-    if(i == 0)
-    {
-        buffer->free_chunk_list[0] = largest->next;
-        largest->next = NULL;
-    }
-    else
-    {
-        tmq_buffer_chunk_t** next = &buffer->free_chunk_list[i];
-        while((*next)->next)
-            next = &(*next)->next;
-        largest = *next;
-        *next = NULL;
-    }
-    return largest;
+    pool->idle_bytes = pool->held_bytes;
+    tmq_chunk_pool_trim(pool);
+}
+
+static void buffer_chunk_realign(tmq_buffer_chunk_t* chunk)
+{
+    if(chunk->read_idx == 0) return;
+    memmove(chunk->buf, chunk->buf + chunk->read_idx, CHUNK_DATA_LEN(chunk));
+    chunk->write_idx -= chunk->read_idx;
+    chunk->read_idx = 0;
 }
 
-void tmq_buffer_append(tmq_buffer_t* buffer, const char* data, size_t size)
+int tmq_buffer_append(tmq_buffer_t* buffer, const char* data, size_t size)
 {
-    if(!buffer || !data || !size) return;
+    if(!buffer || !data || !size) return 0;
+    if(buffer->ring_size)
+    {
+        if(ring_reserve(buffer, size) < 0)
+            return -1;
+        memcpy(buffer->ring + buffer->ring_read + buffer->readable_bytes, data, size);
+        buffer->readable_bytes += size;
+        return 0;
+    }
     tmq_buffer_chunk_t* chunk = buffer->last;
     if(!chunk)
     {
-        chunk = find_free_chunk(buffer, size);
-        if(!chunk)
-            chunk = buffer_chunk_new(size);
+        chunk = buffer_chunk_new(size);
+        if(!chunk) return -1;
         memcpy(chunk->buf, data, size);
         chunk->write_idx += size;
         buffer->first = buffer->last = chunk;
@@ -117,26 +271,37 @@ void tmq_buffer_append(tmq_buffer_t* buffer, const char* data, size_t size)
         chunk->write_idx += last_writable;
         data += last_writable;
         size_t remain = size - last_writable;
-        tmq_buffer_chunk_t* new_chunk = find_free_chunk(buffer, remain);
+        tmq_buffer_chunk_t* new_chunk = buffer_chunk_new(remain);
         if(!new_chunk)
-            new_chunk = buffer_chunk_new(remain);
-        if(!new_chunk) return;
+        {
+            buffer->readable_bytes += last_writable;
+            return -1;
+        }
         memcpy(new_chunk->buf, data, remain);
         new_chunk->write_idx += remain;
         chunk->next = new_chunk;
         buffer->last = new_chunk;
     }
     buffer->readable_bytes += size;
+    return 0;
 }
 
-void tmq_buffer_prepend(tmq_buffer_t* buffer, const char* data, size_t size)
+int tmq_buffer_prepend(tmq_buffer_t* buffer, const char* data, size_t size)
 {
+    if(buffer->ring_size)
+    {
+        if(ring_reserve(buffer, size) < 0)
+            return -1;
+        buffer->ring_read = (buffer->ring_read + buffer->ring_size - size) & (buffer->ring_size - 1);
+        memcpy(buffer->ring + buffer->ring_read, data, size);
+        buffer->readable_bytes += size;
+        return 0;
+    }
     tmq_buffer_chunk_t* chunk = buffer->first;
     if(!chunk)
     {
-        chunk = find_free_chunk(buffer, size);
-        if(!chunk)
-            chunk = buffer_chunk_new(size);
+        chunk = buffer_chunk_new(size);
+        if(!chunk) return -1;
         memcpy(chunk->buf, data, size);
         chunk->write_idx += size;
         buffer->first = buffer->last = chunk;
@@ -149,10 +314,8 @@ void tmq_buffer_prepend(tmq_buffer_t* buffer, const char* data, size_t size)
     else
     {
         size_t remain = size - chunk->read_idx;
-        tmq_buffer_chunk_t* new_chunk = find_free_chunk(buffer, remain);
-        if(!new_chunk)
-            new_chunk = buffer_chunk_new(remain);
-        if(!new_chunk) return;
+        tmq_buffer_chunk_t* new_chunk = buffer_chunk_new(remain);
+        if(!new_chunk) return -1;
         size_t align = new_chunk->chunk_size - remain;
         new_chunk->read_idx += align;
         memcpy(new_chunk->buf + new_chunk->read_idx, data, remain);
@@ -166,31 +329,7 @@ void tmq_buffer_prepend(tmq_buffer_t* buffer, const char* data, size_t size)
         }
     }
     buffer->readable_bytes += size;
-}
-
-static void buffer_chunk_remove(tmq_buffer_t* buffer, tmq_buffer_chunk_t* chunk)
-{
-    chunk->next = NULL;
-    chunk->read_idx = chunk->write_idx = 0;
-    size_t free_list_idx = FREE_LIST_INDEX(chunk->chunk_size);
-    if(!buffer->free_chunk_list[free_list_idx])
-        buffer->free_chunk_list[free_list_idx] = chunk;
-    else
-    {
-        tmq_buffer_chunk_t* p = buffer->free_chunk_list[free_list_idx];
-        if(p->chunk_size >= chunk->chunk_size)
-        {
-            chunk->next = p;
-            buffer->free_chunk_list[free_list_idx] = chunk;
-        }
-        else
-        {
-            while(p->next && p->next->chunk_size < chunk->chunk_size)
-                p = p->next;
-            chunk->next = p->next;
-            p->next = chunk;
-        }
-    }
+    return 0;
 }
 
 static size_t buffer_read_internal(tmq_buffer_t* buffer, char* buf, size_t size, int remove)
@@ -201,6 +340,14 @@ static size_t buffer_read_internal(tmq_buffer_t* buffer, char* buf, size_t size,
         tlog_warn("buffer_read_internal(): buffer->redable_bytes < size");
         size = buffer->readable_bytes;
     }
+    if(buffer->ring_size)
+    {
+        if(!size) return 0;
+        memcpy(buf, buffer->ring + buffer->ring_read, size);
+        if(remove)
+            ring_consume(buffer, size);
+        return size;
+    }
     tmq_buffer_chunk_t* chunk = buffer->first, *next;
     if(!chunk) return 0;
     size_t cnt = 0;
@@ -216,7 +363,7 @@ static size_t buffer_read_internal(tmq_buffer_t* buffer, char* buf, size_t size,
             continue;
         }
         next = chunk->next;
-        buffer_chunk_remove(buffer, chunk);
+        buffer_chunk_remove(chunk);
         chunk = next;
     }
     if(chunk && size)
@@ -291,13 +438,20 @@ void tmq_buffer_remove(tmq_buffer_t* buffer, size_t size)
         tlog_warn("tmq_buffer_remove(): buffer->redable_bytes < size");
         size = buffer->readable_bytes;
     }
+    if(buffer->ring_size)
+    {
+        ring_consume(buffer, size);
+        buffer->readable_bytes -= size;
+        return;
+    }
     tmq_buffer_chunk_t* chunk = buffer->first, *next;
     if(!chunk) return;
+    buffer->readable_bytes -= size;
     while(chunk && size >= CHUNK_DATA_LEN(chunk))
     {
         size -= CHUNK_DATA_LEN(chunk);
         next = chunk->next;
-        buffer_chunk_remove(buffer, chunk);
+        buffer_chunk_remove(chunk);
         chunk = next;
     }
     if(chunk && size)
@@ -305,77 +459,102 @@ void tmq_buffer_remove(tmq_buffer_t* buffer, size_t size)
     buffer->first = chunk;
     if(!chunk)
         buffer->last = NULL;
-    buffer->readable_bytes -= size;
 }
 
 ssize_t tmq_buffer_read_fd(tmq_buffer_t* buffer, tmq_socket_t fd, size_t max)
 {
     if(!buffer) return 0;
-    int fd_readable = 0;
-    if(ioctl(fd, FIONREAD, &fd_readable) < 0)
+    size_t size = max ? min(max, FD_MAX_READ_BYTES) : FD_MAX_READ_BYTES;
+    if(buffer->ring_size)
     {
-        tlog_error("ioctl() error %d: %s", errno, strerror(errno));
-        return 0;
+        if(ring_reserve(buffer, size) < 0)
+            return -1;
+        ssize_t n = read(fd, buffer->ring + buffer->ring_read + buffer->readable_bytes, size);
+        if(n > 0)
+            buffer->readable_bytes += n;
+        return n;
     }
-    size_t size;
-    if(!max)
-        size = min(fd_readable, FD_MAX_READ_BYTES);
-    else
-        size = min(fd_readable, min(max, FD_MAX_READ_BYTES));
-    int iovec_cnt = 0;
+    int iovec_cnt = 0, first_new = 0;
     size_t space_aval = 0;
     struct iovec vecs[MAX_IOVEC_NUM];
+    tmq_buffer_chunk_t* chunks[MAX_IOVEC_NUM];
     tmq_buffer_chunk_t* chunk = buffer->last;
     if(chunk && CHUNK_WRITEABLE(chunk) > 0)
     {
         vecs[0].iov_base = chunk->buf + chunk->write_idx;
-        size_t len = CHUNK_WRITEABLE(chunk) <= size ? CHUNK_WRITEABLE(chunk) : size;
-        vecs[0].iov_len = len;
-        iovec_cnt++;
-        chunk->write_idx += len;
-        space_aval += CHUNK_WRITEABLE(chunk);
+        vecs[0].iov_len = min(CHUNK_WRITEABLE(chunk), size);
+        chunks[0] = chunk;
+        space_aval += vecs[0].iov_len;
+        iovec_cnt = first_new = 1;
     }
     for(int i = iovec_cnt; space_aval < size && i < MAX_IOVEC_NUM; i++)
     {
-        chunk = find_free_chunk(buffer, size - space_aval);
+        chunk = find_free_chunk(size - space_aval);
         if(!chunk && i < MAX_IOVEC_NUM - 1)
-            chunk = get_largest_free_chunk(buffer);
+            chunk = get_largest_free_chunk();
         if(!chunk)
             chunk = buffer_chunk_new(size - space_aval);
         assert(chunk && chunk->chunk_size > 0);
-        if(!buffer->last)
-            buffer->first = buffer->last = chunk;
-        else
-        {
-            buffer->last->next = chunk;
-            buffer->last = chunk;
-        }
-        size_t len = space_aval + chunk->chunk_size <= size ? chunk->chunk_size : size - space_aval;
-        space_aval += chunk->chunk_size;
         vecs[i].iov_base = chunk->buf;
-        vecs[i].iov_len = len;
+        vecs[i].iov_len = min(chunk->chunk_size, size - space_aval);
+        chunks[i] = chunk;
+        space_aval += vecs[i].iov_len;
         iovec_cnt++;
-        chunk->write_idx += len;
     }
+    /* the size of the read is a guess, chunks are only linked into the buffer if they got data */
     ssize_t n = readv(fd, vecs, iovec_cnt);
+    size_t remain = n > 0 ? n : 0;
+    for(int i = 0; i < iovec_cnt; i++)
+    {
+        size_t len = min(remain, vecs[i].iov_len);
+        remain -= len;
+        chunk = chunks[i];
+        if(i < first_new)
+            chunk->write_idx += len;
+        else if(!len)
+            buffer_chunk_remove(chunk);
+        else
+        {
+            chunk->write_idx = len;
+            if(!buffer->last)
+                buffer->first = buffer->last = chunk;
+            else
+            {
+                buffer->last->next = chunk;
+                buffer->last = chunk;
+            }
+        }
+    }
     if(n > 0)
         buffer->readable_bytes += n;
     return n;
 }
 
-ssize_t tmq_buffer_write_fd(tmq_buffer_t* buffer, tmq_socket_t fd)
+ssize_t tmq_buffer_write_fd(tmq_buffer_t* buffer, tmq_socket_t fd, size_t max)
 {
     if(!buffer) return 0;
+    if(buffer->ring_size)
+    {
+        size_t size = max ? min(max, buffer->readable_bytes) : buffer->readable_bytes;
+        if(!size) return 0;
+        ssize_t n = write(fd, buffer->ring + buffer->ring_read, size);
+        if(n > 0)
+            tmq_buffer_remove(buffer, n);
+        return n;
+    }
     tmq_vec(struct iovec) vecs = tmq_vec_make(struct iovec);
     tmq_buffer_chunk_t* chunk = buffer->first;
     int iovec_cnt = 0;
-    while (chunk)
+    size_t size = 0;
+    /* the rest is written on the next writable event */
+    while (chunk && iovec_cnt < IOV_MAX && (!max || size < max))
     {
         iovec_cnt++;
         struct iovec iov = {
                 .iov_base = chunk->buf + chunk->read_idx,
-                .iov_len = CHUNK_DATA_LEN(chunk)
+                .iov_len = max ? min(CHUNK_DATA_LEN(chunk), max - size) : CHUNK_DATA_LEN(chunk)
         };
+        size += iov.iov_len;
         tmq_vec_push_back(vecs, iov);
         chunk = chunk->next;
     }
@@ -390,30 +569,54 @@ ssize_t tmq_buffer_write_fd(tmq_buffer_t* buffer, tmq_socket_t fd)
 void tmq_buffer_free(tmq_buffer_t* buffer)
 {
     if(!buffer) return;
-    tmq_buffer_chunk_t* chunk, *next;
-    for(int i = 0; i < 5; i++)
+    if(buffer->ring_size)
     {
-        chunk = buffer->free_chunk_list[i];
-        while(chunk)
-        {
-            next = chunk->next;
-            free(chunk);
-            chunk = next;
-        }
+        if(buffer->ring)
+            munmap(buffer->ring, buffer->ring_size * 2);
+        buffer->ring = NULL;
+        buffer->ring_size = buffer->ring_read = 0;
+        return;
     }
-    chunk = buffer->first;
+    tmq_buffer_chunk_t* chunk = buffer->first, *next;
     while(chunk)
     {
         next = chunk->next;
-        free(chunk);
+        buffer_chunk_remove(chunk);
         chunk = next;
     }
+    buffer->first = buffer->last = NULL;
+    buffer->readable_bytes = 0;
+}
+
+void tmq_buffer_shrink(tmq_buffer_t* buffer)
+{
+    if(!buffer->ring || buffer->readable_bytes)
+        return;
+    munmap(buffer->ring, buffer->ring_size * 2);
+    buffer->ring = NULL;
+    buffer->ring_size = sysconf(_SC_PAGESIZE);
+    buffer->ring_read = 0;
+}
+
+size_t tmq_buffer_memory(const tmq_buffer_t* buffer)
+{
+    if(buffer->ring_size)
+        return buffer->ring ? buffer->ring_size : 0;
+    size_t bytes = 0;
+    for(tmq_buffer_chunk_t* chunk = buffer->first; chunk; chunk = chunk->next)
+        bytes += sizeof(tmq_buffer_chunk_t) + chunk->chunk_size;
+    return bytes;
 }
 
 void tmq_buffer_debug(const tmq_buffer_t* buffer)
 {
     if(!buffer) return;
     printf("buffer %p: readable bytes=[%lu]\n", buffer, buffer->readable_bytes);
+    if(buffer->ring_size)
+    {
+        printf("ring %p: ring size=[%lu] read offset=[%lu]\n", buffer->ring, buffer->ring_size, buffer->ring_read);
+        return;
+    }
     printf("---------------------------------------\n");
     printf("chunks in use:\n");
     tmq_buffer_chunk_t* chunk = buffer->first;
@@ -430,24 +633,15 @@ void tmq_buffer_debug(const tmq_buffer_t* buffer)
         chunk = chunk->next;
     }
     printf("total %d chunk in use, total size=[%lu]\n", used_chunks, used_chunk_size);
+    tmq_chunk_pool_t* pool = local_pool;
+    if(!pool) return;
     printf("---------------------------------------\n");
-    printf("chunks in free list:\n");
-    for(int i = 0; i < 5; i++)
+    printf("chunk pool %p: held bytes=[%lu] hits=[%lu] misses=[%lu]\n", pool, pool->held_bytes, pool->hits, pool->misses);
+    for(int i = 0; i < CHUNK_POOL_CLASSES; i++)
     {
-        switch (i)
-        {
-            case 0: printf("[512]:\n"); break;
-            case 1: printf("(512, 1204]:\n"); break;
-            case 2: printf("(1024, 2048]:\n"); break;
-            case 3: printf("(2048, 4096]:\n"); break;
-            case 4: printf("(4096, ):\n"); break;
-            default: break;
-        }
-        chunk = buffer->free_chunk_list[i];
-        while(chunk)
-        {
-            printf("free chunk: chunk size=[%lu]\n", chunk->chunk_size);
-            chunk = chunk->next;
-        }
+        int n = 0;
+        for(chunk = pool->free_lists[i]; chunk; chunk = chunk->next)
+            n++;
+        printf("[%d]: %d free chunks\n", BUFFER_CHUNK_MIN << i, n);
     }
 }
\ No newline at end of file
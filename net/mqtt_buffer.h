@@ -10,11 +10,14 @@
 #define MAX_IOVEC_NUM               4
 #define BUFFER_CHUNK_MIN            512
 #define FD_MAX_READ_BYTES           65536
+#define FD_MIN_READ_BYTES           512
 #define CHUNK_DATA_LEN(chunk)       ((chunk)->write_idx - (chunk)->read_idx)
 #define CHUNK_WRITEABLE(chunk)      ((chunk)->chunk_size - (chunk)->write_idx)
 #define CHUNK_AVAL_SPACE(chunk)     ((chunk)->chunk_size - ((chunk)->write_idx - (chunk)->read_idx))
-#define FREE_LIST_INDEX(size)       ((((size) - 1) >> 9) > 0) + ((((size) - 1) >> 10) > 0) + \
-                                    ((((size) - 1) >> 11) > 0) + ((((size) - 1) >> 12) > 0)
+/* chunks up to 64KB are allocated in power of two sizes and cached by the chunk pool */
+#define CHUNK_POOL_CLASSES          8
+#define CHUNK_POOL_MAX_CHUNK        (BUFFER_CHUNK_MIN << (CHUNK_POOL_CLASSES - 1))
+#define CHUNK_POOL_DEFAULT_LIMIT    (4 * 1024 * 1024)
 #define min(a, b)                   (((a) < (b)) ? (a) : (b))
 
 typedef struct tmq_buffer_chunk_s
@@ -30,20 +33,57 @@ typedef struct tmq_buffer_s
 {
     tmq_buffer_chunk_t* first;
     tmq_buffer_chunk_t* last;
-    /* free list 512B, (512B, 1KB], (1KB, 2KB], (2KB, 4KB], (4KB, ) */
-    tmq_buffer_chunk_t* free_chunk_list[5];
     size_t readable_bytes;
+    /* ring mode(ring_size != 0): ring_size bytes mapped twice back to back, so the readable bytes
+     * (from ring + ring_read) and the free space after them are always contiguous. the chunk lists are unused.
+     * ring is NULL after tmq_buffer_shrink until more data comes */
+    char* ring;
+    size_t ring_size, ring_read;
 } tmq_buffer_t;
 
+/* free chunks shared by all the buffers of a thread, one free list per size class.
+ * only the owner thread changes it, the counters are read by other threads */
+typedef struct tmq_chunk_pool_s
+{
+    tmq_buffer_chunk_t* free_lists[CHUNK_POOL_CLASSES];
+    /* bytes of the cached chunks, chunks released above limit are freed */
+    size_t held_bytes, limit;
+    /* the lowest held_bytes since the last trim, those bytes weren't needed in the meantime */
+    size_t idle_bytes;
+    /* chunks taken from the pool and allocated by malloc */
+    uint64_t hits, misses;
+} tmq_chunk_pool_t;
+
+void tmq_chunk_pool_init(tmq_chunk_pool_t* pool, size_t limit);
+/* buffers used by the calling thread take chunks from pool and give them back to it,
+ * without a pool(the default) chunks are allocated and freed directly */
+void tmq_chunk_pool_attach(tmq_chunk_pool_t* pool);
+/* free the chunks that stayed idle since the last trim and return the memory to the OS */
+void tmq_chunk_pool_trim(tmq_chunk_pool_t* pool);
+void tmq_chunk_pool_destroy(tmq_chunk_pool_t* pool);
+
 void tmq_buffer_init(tmq_buffer_t* buffer);
-void tmq_buffer_append(tmq_buffer_t* buffer, const char* data, size_t size);
-void tmq_buffer_prepend(tmq_buffer_t* buffer, const char* data, size_t size);
+/* switch an empty buffer to ring mode, the ring grows as needed. returns -1 if the ring can't be mapped */
+int tmq_buffer_init_ring(tmq_buffer_t* buffer, size_t size);
+/* the first size readable bytes if they are contiguous(always in ring mode), otherwise NULL */
+const char* tmq_buffer_contiguous(tmq_buffer_t* buffer, size_t size);
+/* returns -1 if the memory for the data can't be allocated */
+int tmq_buffer_append(tmq_buffer_t* buffer, const char* data, size_t size);
+int tmq_buffer_prepend(tmq_buffer_t* buffer, const char* data, size_t size);
 size_t tmq_buffer_peek(tmq_buffer_t* buffer, char* buf, size_t size);
 size_t tmq_buffer_read(tmq_buffer_t* buffer, char* buf, size_t size);
+/* one readv of at most max bytes(0 for FD_MAX_READ_BYTES), returns -1 with EAGAIN if nothing is readable,
+ * or with ENOMEM if the ring can't grow */
 ssize_t tmq_buffer_read_fd(tmq_buffer_t* buffer, tmq_socket_t fd, size_t max);
-ssize_t tmq_buffer_write_fd(tmq_buffer_t* buffer, tmq_socket_t fd);
+/* write at most max bytes(0 for no limit) to fd */
+ssize_t tmq_buffer_write_fd(tmq_buffer_t* buffer, tmq_socket_t fd, size_t max);
 void tmq_buffer_remove(tmq_buffer_t* buffer, size_t size);
 void tmq_buffer_free(tmq_buffer_t* buffer);
+/* unmap the ring of an empty buffer, it's mapped again(from one page) when data comes.
+ * chunks are given back to the pool as soon as they are consumed, so a chunked buffer has nothing to release */
+void tmq_buffer_shrink(tmq_buffer_t* buffer);
+/* bytes of the chunks or the ring holding the buffer's data */
+size_t tmq_buffer_memory(const tmq_buffer_t* buffer);
 void tmq_buffer_debug(const tmq_buffer_t* buffer);
 /* functions below will automatically convert network endian to host endian */
 void tmq_buffer_peek16(tmq_buffer_t* buffer, uint16_t* v);
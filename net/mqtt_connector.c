@@ -3,6 +3,7 @@
 //
 #include "mqtt_connector.h"
 #include "tlog.h"
+#include "base/mqtt_obj_pool.h"
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
@@ -28,8 +29,8 @@ static void handle_write(tmq_socket_t sock, uint32_t events, void* arg)
     tmq_connector_t* connector = arg;
     tmq_handler_unregister(connector->loop, connector->write_handler);
     tmq_handler_unregister(connector->loop, connector->error_handler);
-    free(connector->write_handler);
-    free(connector->error_handler);
+    tmq_obj_free(connector->write_handler);
+    tmq_obj_free(connector->error_handler);
 
     /* check if connect successfully */
     int err = tmq_socket_get_error(sock);
@@ -47,8 +48,8 @@ static void handle_error(tmq_socket_t sock, uint32_t events, void* arg)
     tmq_connector_t* connector = arg;
     tmq_handler_unregister(connector->loop, connector->write_handler);
     tmq_handler_unregister(connector->loop, connector->error_handler);
-    free(connector->write_handler);
-    free(connector->error_handler);
+    tmq_obj_free(connector->write_handler);
+    tmq_obj_free(connector->error_handler);
 
     tlog_error("connect error: %s", strerror(errno));
     tmq_socket_close(sock);
@@ -4,26 +4,136 @@
 #include "mqtt_tcp_conn.h"
 #include "mqtt/mqtt_broker.h"
 #include "base/mqtt_util.h"
+#include "base/mqtt_obj_pool.h"
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 
+static void adapt_read_size(tmq_tcp_conn_t* conn, size_t size, size_t n)
+{
+    if(n == size && conn->read_size < FD_MAX_READ_BYTES)
+        conn->read_size *= 2;
+    else if(n < size / 4 && conn->read_size > FD_MIN_READ_BYTES)
+        conn->read_size /= 2;
+}
+
+/* read until a read comes back short or the read budget runs out. an edge-triggered fd gets no more event
+ * for the data left, so it's re-armed when the budget runs out, and the peer's shutdown is handled here */
 static void read_cb_(tmq_socket_t fd, uint32_t event, void* arg)
 {
     if(!arg) return;
     tmq_tcp_conn_t* conn = (tmq_tcp_conn_t*) arg;
-    ssize_t n = tmq_buffer_read_fd(&conn->in_buffer, fd, 0);
-    if(n == 0)
-        tmq_tcp_conn_close(get_ref(conn));
-    else if(n < 0)
+    size_t budget = conn->read_budget ? conn->read_budget : FD_MAX_READ_BYTES;
+    size_t total = 0;
+    int drained = 0;
+    get_ref(conn);
+    while(conn->state == CONNECTED && !conn->reading_paused)
     {
-        tlog_error("tmq_buffer_read_fd() error: n < 0");
+        size_t size = min(budget - total, conn->read_size);
+        ssize_t n = tmq_buffer_read_fd(&conn->in_buffer, conn->fd, size);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            drained = 1;
+            break;
+        }
+        if(n <= 0)
+        {
+            if(n < 0)
+                tlog_error("tmq_buffer_read_fd() error %d: %s", errno, strerror(errno));
+            tmq_tcp_conn_close(get_ref(conn));
+            break;
+        }
+        total += n;
+        adapt_read_size(conn, size, (size_t) n);
+        if(conn->codec)
+            conn->codec->decode_tcp_message(conn->codec, conn, &conn->in_buffer);
+        if((size_t) n < size)
+        {
+            drained = 1;
+            break;
+        }
+        if(total >= budget)
+        {
+            if(conn->edge_triggered && conn->state == CONNECTED && !conn->reading_paused)
+                tmq_handler_rearm(conn->loop, conn->read_event_handler);
+            break;
+        }
+    }
+    if(drained && (event & EPOLLRDHUP) && conn->state == CONNECTED)
         tmq_tcp_conn_close(get_ref(conn));
+    release_ref(conn);
+}
+
+static void update_pending_bytes(tmq_tcp_conn_t* conn)
+{
+    atomicSet(conn->pending_bytes, tmq_tcp_conn_pending_bytes(conn));
+}
+
+/* mark n bytes of out_buffer as written */
+static void out_frames_consume(tmq_tcp_conn_t* conn, size_t n)
+{
+    while(n > 0)
+    {
+        uint32_t* frame = tmq_vec_at(conn->out_frames, conn->out_frame_head);
+        if(n < *frame)
+        {
+            *frame -= n;
+            conn->out_frame_partial = 1;
+            return;
+        }
+        n -= *frame;
+        conn->out_frame_head++;
+        conn->out_frame_partial = 0;
     }
-    else
+    if(conn->out_frame_head == tmq_vec_size(conn->out_frames))
     {
-        if(conn->codec)
-            conn->codec->decode_tcp_message(conn->codec, conn, &conn->in_buffer);
+        tmq_vec_clear(conn->out_frames);
+        conn->out_frame_head = 0;
+    }
+    /* drop the written frames once they take up half of the vector */
+    else if(conn->out_frame_head >= 64 && conn->out_frame_head * 2 >= tmq_vec_size(conn->out_frames))
+    {
+        size_t remain = tmq_vec_size(conn->out_frames) - conn->out_frame_head;
+        uint32_t* frames = tmq_vec_begin(conn->out_frames);
+        memmove(frames, frames + conn->out_frame_head, remain * sizeof(uint32_t));
+        tmq_vec_resize(conn->out_frames, remain);
+        conn->out_frame_head = 0;
+    }
+}
+
+/* write as much as the socket accepts, the urgent buffer goes first whenever out_buffer is at a packet boundary.
+ * returns -1 on error */
+static int conn_flush(tmq_tcp_conn_t* conn)
+{
+    while(1)
+    {
+        if(conn->urgent_buffer.readable_bytes && !conn->out_frame_partial)
+        {
+            ssize_t n = tmq_buffer_write_fd(&conn->urgent_buffer, conn->fd, 0);
+            if(n < 0)
+                return errno == EWOULDBLOCK ? 0 : -1;
+            /* out_buffer must not be written in the middle of an urgent packet,
+             * in edge-triggered mode the urgent buffer is written until it's empty or EAGAIN */
+            if(conn->urgent_buffer.readable_bytes)
+            {
+                if(conn->edge_triggered)
+                    continue;
+                return 0;
+            }
+        }
+        if(!conn->out_buffer.readable_bytes)
+            return 0;
+        /* stop at the end of the current packet if urgent data is waiting */
+        size_t max = conn->urgent_buffer.readable_bytes ?
+                *tmq_vec_at(conn->out_frames, conn->out_frame_head) : 0;
+        ssize_t n = tmq_buffer_write_fd(&conn->out_buffer, conn->fd, max);
+        if(n < 0)
+            return errno == EWOULDBLOCK ? 0 : -1;
+        out_frames_consume(conn, n);
+        /* the socket is full, in edge-triggered mode it's written until EAGAIN */
+        if(!conn->edge_triggered && (!conn->urgent_buffer.readable_bytes || conn->out_frame_partial))
+            return 0;
     }
 }
 
@@ -32,21 +142,35 @@ static void write_cb_(tmq_socket_t fd, uint32_t event, void* arg)
     if(!arg) return;
     tmq_tcp_conn_t* conn = (tmq_tcp_conn_t*) arg;
     if(!conn->is_writing) return;
-    ssize_t n = tmq_buffer_write_fd(&conn->out_buffer, fd);
-    if(n >= 0)
+    int ret = conn_flush(conn);
+    update_pending_bytes(conn);
+    if(ret == 0)
     {
-        if(conn->out_buffer.readable_bytes == 0)
+        if(conn->out_buffer.readable_bytes == 0 && conn->urgent_buffer.readable_bytes == 0)
         {
-            tmq_handler_unregister(conn->loop, conn->write_event_handler);
+            if(!conn->edge_triggered)
+                tmq_handler_unregister(conn->loop, conn->write_event_handler);
             conn->is_writing = 0;
             if(conn->on_write_complete)
                 conn->on_write_complete(conn->cb_arg);
             if(conn->state == DISCONNECTING)
                 tmq_tcp_conn_close(get_ref(conn));
         }
+        if(conn->congested && conn->state == CONNECTED && tmq_tcp_conn_pending_bytes(conn) <= conn->low_water)
+        {
+            atomicSet(conn->congested, 0);
+            if(conn->on_drain)
+                conn->on_drain(conn, conn->cb_arg);
+        }
     }
     else
-        tlog_error("tmq_buffer_write_fd() error");
+    {
+        tlog_error("tmq_buffer_write_fd() error %d: %s", errno, strerror(errno));
+        /* the peer is gone, stop writing the pending output and close the connection */
+        tmq_handler_unregister(conn->loop, conn->write_event_handler);
+        conn->is_writing = 0;
+        tmq_tcp_conn_close(get_ref(conn));
+    }
 }
 
 static void close_cb_(tmq_socket_t fd, uint32_t event, void* arg)
@@ -62,27 +186,153 @@ static void close_cb_(tmq_socket_t fd, uint32_t event, void* arg)
         tmq_tcp_conn_close(get_ref(conn));
 }
 
+static void recv_complete(tmq_uring_op_t* op, int res, uint32_t flags);
+static void send_complete(tmq_uring_op_t* op, int res, uint32_t flags);
+
+/* every operation in flight holds a reference of the connection */
+static void uring_arm_recv(tmq_tcp_conn_t* conn)
+{
+    conn->recv_armed = 1;
+    conn->recv_op.cb = recv_complete;
+    conn->recv_op.arg = get_ref(conn);
+    tmq_uring_prep_recv_multishot(conn->uring, conn->fd, &conn->recv_op);
+}
+
+static void recv_complete(tmq_uring_op_t* op, int res, uint32_t flags)
+{
+    tmq_tcp_conn_t* conn = op->arg;
+    if(res > 0)
+    {
+        char* buf = tmq_uring_recv_buf(conn->uring, flags);
+        if(conn->state != DISCONNECTED && tmq_buffer_append(&conn->in_buffer, buf, res) < 0)
+        {
+            tlog_error("tmq_buffer_append() error: out of memory");
+            tmq_tcp_conn_close(get_ref(conn));
+        }
+        tmq_uring_recycle_buf(conn->uring, flags);
+        if(conn->state != DISCONNECTED && conn->codec)
+            conn->codec->decode_tcp_message(conn->codec, conn, &conn->in_buffer);
+    }
+    if(flags & IORING_CQE_F_MORE)
+        return;
+    conn->recv_armed = 0;
+    if(conn->state != DISCONNECTED)
+    {
+        if(res == 0)
+            tmq_tcp_conn_close(get_ref(conn));
+        /* ENOBUFS: all the provided buffers are in use, they are recycled as the completions are handled */
+        else if(res < 0 && res != -ENOBUFS && res != -ECANCELED)
+        {
+            tlog_error("recv error %d: %s", -res, strerror(-res));
+            tmq_tcp_conn_close(get_ref(conn));
+        }
+        else if(!conn->reading_paused)
+            uring_arm_recv(conn);
+    }
+    release_ref(conn);
+}
+
+static void uring_submit_send(tmq_tcp_conn_t* conn)
+{
+    if(conn->send_inflight)
+        return;
+    if(!conn->sending_buffer.readable_bytes)
+    {
+        /* urgent packets go first, out_buffer only holds whole packets when nothing is being sent */
+        tmq_buffer_t* next = conn->urgent_buffer.readable_bytes ? &conn->urgent_buffer : &conn->out_buffer;
+        if(!next->readable_bytes)
+            return;
+        tmq_buffer_t tmp = conn->sending_buffer;
+        conn->sending_buffer = *next;
+        *next = tmp;
+    }
+    tmq_vec_clear(conn->send_iov);
+    tmq_buffer_chunk_t* chunk = conn->sending_buffer.first;
+    for(; chunk && tmq_vec_size(conn->send_iov) < IOV_MAX; chunk = chunk->next)
+    {
+        struct iovec iov = {
+                .iov_base = chunk->buf + chunk->read_idx,
+                .iov_len = CHUNK_DATA_LEN(chunk)
+        };
+        tmq_vec_push_back(conn->send_iov, iov);
+    }
+    conn->send_inflight = 1;
+    conn->send_op.cb = send_complete;
+    conn->send_op.arg = get_ref(conn);
+    tmq_uring_prep_writev(conn->uring, conn->fd, tmq_vec_begin(conn->send_iov),
+                          tmq_vec_size(conn->send_iov), &conn->send_op);
+}
+
+static void send_complete(tmq_uring_op_t* op, int res, uint32_t flags)
+{
+    tmq_tcp_conn_t* conn = op->arg;
+    conn->send_inflight = 0;
+    if(conn->state != DISCONNECTED && conn->is_writing)
+    {
+        if(res < 0)
+        {
+            tlog_error("writev error %d: %s", -res, strerror(-res));
+            conn->is_writing = 0;
+            tmq_tcp_conn_close(get_ref(conn));
+        }
+        else
+        {
+            tmq_buffer_remove(&conn->sending_buffer, res);
+            update_pending_bytes(conn);
+            if(tmq_tcp_conn_pending_bytes(conn))
+                uring_submit_send(conn);
+            else
+            {
+                conn->is_writing = 0;
+                if(conn->on_write_complete)
+                    conn->on_write_complete(conn->cb_arg);
+                if(conn->state == DISCONNECTING)
+                    tmq_tcp_conn_close(get_ref(conn));
+            }
+            if(conn->congested && conn->state == CONNECTED && tmq_tcp_conn_pending_bytes(conn) <= conn->low_water)
+            {
+                atomicSet(conn->congested, 0);
+                if(conn->on_drain)
+                    conn->on_drain(conn, conn->cb_arg);
+            }
+        }
+    }
+    release_ref(conn);
+}
+
+/* the output of a loop iteration is sent together */
+static void uring_flush(void* arg)
+{
+    tmq_tcp_conn_t* conn = arg;
+    if(conn->state != DISCONNECTED && conn->is_writing)
+        uring_submit_send(conn);
+    release_ref(conn);
+}
+
 void tmq_tcp_conn_free(tmq_tcp_conn_t* conn)
 {
-    free(conn->read_event_handler);
-    free(conn->error_close_handler);
-    if(conn->write_event_handler)
-        free(conn->write_event_handler);
+    tmq_obj_free(conn->read_event_handler);
+    tmq_obj_free(conn->error_close_handler);
+    tmq_obj_free(conn->write_event_handler);
 
     tmq_buffer_free(&conn->in_buffer);
     tmq_buffer_free(&conn->out_buffer);
+    tmq_buffer_free(&conn->urgent_buffer);
+    tmq_buffer_free(&conn->sending_buffer);
+    tmq_vec_free(conn->out_frames);
+    tmq_vec_free(conn->send_iov);
 
     tmq_tcp_conn_set_context(conn, NULL, NULL);
     tmq_socket_close(conn->fd);
 
-    free(conn);
+    tmq_obj_free(conn);
 }
 
 tmq_tcp_conn_t* tmq_tcp_conn_new(tmq_event_loop_t* loop, tmq_io_group_t* group,
                                  tmq_socket_t fd, tmq_codec_t* codec)
 {
     if(fd < 0) return NULL;
-    tmq_tcp_conn_t* conn = malloc(sizeof(tmq_tcp_conn_t));
+    tmq_tcp_conn_t* conn = tmq_obj_new(tmq_tcp_conn_t, OBJ_TCP_CONN);
     if(!conn)
         fatal_error("malloc() error: out of memory");
     bzero(conn, sizeof(tmq_tcp_conn_t));
@@ -93,12 +343,25 @@ tmq_tcp_conn_t* tmq_tcp_conn_new(tmq_event_loop_t* loop, tmq_io_group_t* group,
     conn->codec = codec;
     conn->context = NULL;
     conn->is_writing = 0;
+    conn->read_size = FD_MIN_READ_BYTES;
     tmq_socket_local_addr(conn->fd, &conn->local_addr);
     tmq_socket_peer_addr(conn->fd, &conn->peer_addr);
 
     tmq_buffer_init(&conn->in_buffer);
     tmq_buffer_init(&conn->out_buffer);
+    tmq_buffer_init(&conn->urgent_buffer);
+    tmq_vec_init(&conn->out_frames, uint32_t);
+    conn->out_frame_head = 0;
+    conn->out_frame_partial = 0;
+    tmq_buffer_init(&conn->sending_buffer);
+    tmq_vec_init(&conn->send_iov, struct iovec);
 
+    conn->uring = loop->uring;
+    if(conn->uring)
+    {
+        uring_arm_recv(conn);
+        return conn;
+    }
     conn->read_event_handler = tmq_event_handler_new(fd, EPOLLIN | EPOLLRDHUP, read_cb_, conn);
     conn->error_close_handler = tmq_event_handler_new(fd, EPOLLERR | EPOLLHUP, close_cb_, conn);
     tmq_handler_register(conn->loop, conn->read_event_handler);
@@ -106,8 +369,21 @@ tmq_tcp_conn_t* tmq_tcp_conn_new(tmq_event_loop_t* loop, tmq_io_group_t* group,
     return conn;
 }
 
-void tmq_tcp_conn_write(tmq_tcp_conn_t* conn, char* data, size_t size)
+static void conn_write(tmq_tcp_conn_t* conn, char* data, size_t size, int urgent)
 {
+    if(conn->uring)
+    {
+        tmq_buffer_append(urgent ? &conn->urgent_buffer : &conn->out_buffer, data, size);
+        update_pending_bytes(conn);
+        if(conn->high_water && !conn->congested && tmq_tcp_conn_pending_bytes(conn) >= conn->high_water)
+            atomicSet(conn->congested, 1);
+        if(!conn->is_writing)
+        {
+            conn->is_writing = 1;
+            tmq_event_loop_defer(conn->loop, uring_flush, get_ref(conn));
+        }
+        return;
+    }
     ssize_t wrote = 0;
     if(!conn->is_writing)
         wrote = tmq_socket_write(conn->fd, data, size);
@@ -124,17 +400,55 @@ void tmq_tcp_conn_write(tmq_tcp_conn_t* conn, char* data, size_t size)
         conn->on_write_complete(conn->cb_arg);
     if(!error && remain)
     {
-        tmq_buffer_append(&conn->out_buffer, data + wrote, remain);
+        if(urgent)
+            tmq_buffer_append(&conn->urgent_buffer, data + wrote, remain);
+        else
+        {
+            tmq_buffer_append(&conn->out_buffer, data + wrote, remain);
+            tmq_vec_push_back(conn->out_frames, remain);
+            /* nothing was queued before, so this is the first packet */
+            if(wrote > 0)
+                conn->out_frame_partial = 1;
+        }
+        update_pending_bytes(conn);
+        if(conn->high_water && !conn->congested && tmq_tcp_conn_pending_bytes(conn) >= conn->high_water)
+            atomicSet(conn->congested, 1);
         if(!conn->is_writing)
         {
-            if(!conn->write_event_handler)
-                conn->write_event_handler = tmq_event_handler_new(conn->fd, EPOLLOUT, write_cb_, conn);
-            tmq_handler_register(conn->loop, conn->write_event_handler);
+            /* the write handler of an edge-triggered connection is always registered */
+            if(!conn->edge_triggered)
+            {
+                if(!conn->write_event_handler)
+                    conn->write_event_handler = tmq_event_handler_new(conn->fd, EPOLLOUT, write_cb_, conn);
+                tmq_handler_register(conn->loop, conn->write_event_handler);
+            }
             conn->is_writing = 1;
         }
     }
 }
 
+void tmq_tcp_conn_write(tmq_tcp_conn_t* conn, char* data, size_t size)
+{
+    conn_write(conn, data, size, 0);
+}
+
+void tmq_tcp_conn_write_urgent(tmq_tcp_conn_t* conn, char* data, size_t size)
+{
+    conn_write(conn, data, size, 1);
+}
+
+size_t tmq_tcp_conn_pending_bytes(tmq_tcp_conn_t* conn)
+{
+    return conn->out_buffer.readable_bytes + conn->urgent_buffer.readable_bytes + conn->sending_buffer.readable_bytes;
+}
+
+void tmq_tcp_conn_set_water_marks(tmq_tcp_conn_t* conn, size_t high_water, size_t low_water, tcp_drain_cb on_drain)
+{
+    conn->high_water = high_water;
+    conn->low_water = low_water;
+    conn->on_drain = on_drain;
+}
+
 void tmq_tcp_conn_close(tmq_tcp_conn_t* conn)
 {
     if(conn->state == DISCONNECTED)
@@ -144,11 +458,20 @@ void tmq_tcp_conn_close(tmq_tcp_conn_t* conn)
         conn->state = DISCONNECTING;
         return;
     }
-    tmq_handler_unregister(conn->loop, conn->read_event_handler);
-    tmq_handler_unregister(conn->loop, conn->error_close_handler);
+    if(conn->uring)
+    {
+        if(conn->recv_armed)
+            tmq_uring_prep_cancel(conn->uring, &conn->recv_op);
+    }
+    else
+    {
+        if(!conn->reading_paused)
+            tmq_handler_unregister(conn->loop, conn->read_event_handler);
+        tmq_handler_unregister(conn->loop, conn->error_close_handler);
 
-    if(tmq_handler_is_registered(conn->loop, conn->write_event_handler))
-        tmq_handler_unregister(conn->loop, conn->write_event_handler);
+        if(tmq_handler_is_registered(conn->loop, conn->write_event_handler))
+            tmq_handler_unregister(conn->loop, conn->write_event_handler);
+    }
 
     if(conn->on_close)
         conn->on_close(get_ref(conn), conn->cb_arg);
@@ -157,6 +480,96 @@ void tmq_tcp_conn_close(tmq_tcp_conn_t* conn)
     release_ref(conn);
 }
 
+void tmq_tcp_conn_abort(tmq_tcp_conn_t* conn)
+{
+    if(conn->is_writing)
+    {
+        if(!conn->edge_triggered && !conn->uring)
+            tmq_handler_unregister(conn->loop, conn->write_event_handler);
+        conn->is_writing = 0;
+    }
+    tmq_tcp_conn_close(conn);
+}
+
+void tmq_tcp_conn_set_edge_triggered(tmq_tcp_conn_t* conn)
+{
+    if(conn->edge_triggered || conn->is_writing || conn->uring)
+        return;
+    conn->edge_triggered = 1;
+    conn->read_event_handler->events |= EPOLLET;
+    /* registering the write handler turns the whole fd edge-triggered */
+    if(!conn->write_event_handler)
+        conn->write_event_handler = tmq_event_handler_new(conn->fd, EPOLLOUT, write_cb_, conn);
+    conn->write_event_handler->events |= EPOLLET;
+    tmq_handler_register(conn->loop, conn->write_event_handler);
+}
+
+void tmq_tcp_conn_set_read_budget(tmq_tcp_conn_t* conn, size_t budget)
+{
+    conn->read_budget = budget;
+}
+
+int tmq_tcp_conn_set_ring_input(tmq_tcp_conn_t* conn, size_t size)
+{
+    return tmq_buffer_init_ring(&conn->in_buffer, size);
+}
+
+void tmq_tcp_conn_pause_reading(tmq_tcp_conn_t* conn)
+{
+    if(conn->reading_paused || conn->state == DISCONNECTED)
+        return;
+    if(!conn->uring)
+        tmq_handler_unregister(conn->loop, conn->read_event_handler);
+    else if(conn->recv_armed)
+        tmq_uring_prep_cancel(conn->uring, &conn->recv_op);
+    conn->reading_paused = 1;
+}
+
+void tmq_tcp_conn_resume_reading(tmq_tcp_conn_t* conn)
+{
+    if(!conn->reading_paused || conn->state == DISCONNECTED)
+        return;
+    conn->reading_paused = 0;
+    if(!conn->uring)
+        tmq_handler_register(conn->loop, conn->read_event_handler);
+    /* a canceled recv still in flight is armed again when it completes */
+    else if(!conn->recv_armed)
+        uring_arm_recv(conn);
+}
+
+void tmq_tcp_conn_compact(tmq_tcp_conn_t* conn)
+{
+    if(conn->state != CONNECTED || conn->is_writing || conn->in_buffer.readable_bytes)
+        return;
+    tmq_buffer_shrink(&conn->in_buffer);
+    tmq_vec_clear(conn->out_frames);
+    conn->out_frame_head = 0;
+    tmq_vec_shrink(conn->out_frames);
+    tmq_vec_shrink(conn->send_iov);
+    /* created again by the next write that has to wait */
+    if(!conn->edge_triggered && conn->write_event_handler)
+    {
+        tmq_obj_free(conn->write_event_handler);
+        conn->write_event_handler = NULL;
+    }
+    conn->read_size = FD_MIN_READ_BYTES;
+}
+
+size_t tmq_tcp_conn_memory(tmq_tcp_conn_t* conn)
+{
+    size_t bytes = sizeof(tmq_tcp_conn_t);
+    if(conn->read_event_handler)
+        bytes += sizeof(tmq_event_handler_t);
+    if(conn->write_event_handler)
+        bytes += sizeof(tmq_event_handler_t);
+    if(conn->error_close_handler)
+        bytes += sizeof(tmq_event_handler_t);
+    bytes += tmq_buffer_memory(&conn->in_buffer) + tmq_buffer_memory(&conn->out_buffer) +
+             tmq_buffer_memory(&conn->urgent_buffer) + tmq_buffer_memory(&conn->sending_buffer);
+    bytes += tmq_vec_memory(conn->out_frames) + tmq_vec_memory(conn->send_iov);
+    return bytes;
+}
+
 int tmq_tcp_conn_id(tmq_tcp_conn_t* conn, char* buf, size_t buf_size)
 {
     if(!conn) return -1;
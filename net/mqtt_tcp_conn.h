@@ -15,6 +15,7 @@ typedef struct tmq_tcp_conn_s tmq_tcp_conn_t;
 typedef void(*tcp_close_cb)(tmq_tcp_conn_t* conn, void* arg);
 typedef void(*context_cleanup_cb)(void* context);
 typedef void(*write_complete_cb)(void* arg);
+typedef void(*tcp_drain_cb)(tmq_tcp_conn_t* conn, void* arg);
 
 typedef enum tmq_tcp_conn_state_e
 {
@@ -34,6 +35,36 @@ typedef struct tmq_tcp_conn_s
 
     tmq_socket_addr_t local_addr, peer_addr;
     tmq_buffer_t in_buffer, out_buffer;
+    /* control packets are written ahead of the packets queued in out_buffer,
+     * as soon as the packet being written from out_buffer is finished */
+    tmq_buffer_t urgent_buffer;
+    /* unsent bytes of each packet in out_buffer, starting from out_frame_head */
+    tmq_vec(uint32_t) out_frames;
+    size_t out_frame_head;
+    /* the first packet in out_buffer is partially written */
+    int out_frame_partial;
+    /* the connection becomes congested when more than high_water bytes are waiting to be written,
+     * and stays congested until they drain below low_water. read by other threads */
+    size_t high_water, low_water;
+    int congested;
+    /* tmq_tcp_conn_pending_bytes() as of the last write, for other threads */
+    size_t pending_bytes;
+    tcp_drain_cb on_drain;
+    /* bytes read from the socket in one read event, 0 means FD_MAX_READ_BYTES */
+    size_t read_budget;
+    /* size of the next readv, doubled when a read fills it and halved when a read gets less than a quarter */
+    size_t read_size;
+    int reading_paused;
+    /* the socket is watched with EPOLLET, the write handler stays registered for the whole connection */
+    int edge_triggered;
+    /* not NULL if the loop uses io_uring, the socket is then read by a multishot recv,
+     * and the output of one loop iteration is written by a single writev */
+    tmq_uring_t* uring;
+    tmq_uring_op_t recv_op, send_op;
+    int recv_armed, send_inflight;
+    /* the data being written by the writev in flight, out_buffer or urgent_buffer is swapped in when it's done */
+    tmq_buffer_t sending_buffer;
+    tmq_vec(struct iovec) send_iov;
 
     tmq_event_handler_t* read_event_handler,
     *write_event_handler, *error_close_handler;
@@ -54,7 +85,28 @@ void release_ref(tmq_tcp_conn_t* conn);
 
 /* functions below must be called only in the io thread of the connection */
 void tmq_tcp_conn_write(tmq_tcp_conn_t* conn, char* data, size_t size);
+/* write a packet that shouldn't wait behind the data queued by tmq_tcp_conn_write() */
+void tmq_tcp_conn_write_urgent(tmq_tcp_conn_t* conn, char* data, size_t size);
 void tmq_tcp_conn_close(tmq_tcp_conn_t* conn);
+/* close the connection without writing the pending output */
+void tmq_tcp_conn_abort(tmq_tcp_conn_t* conn);
+/* number of bytes waiting to be written */
+size_t tmq_tcp_conn_pending_bytes(tmq_tcp_conn_t* conn);
+/* high_water = 0 disables congestion tracking, on_drain is called when the congestion ends */
+void tmq_tcp_conn_set_water_marks(tmq_tcp_conn_t* conn, size_t high_water, size_t low_water, tcp_drain_cb on_drain);
+/* must be called before anything is written, see edge_triggered */
+void tmq_tcp_conn_set_edge_triggered(tmq_tcp_conn_t* conn);
+void tmq_tcp_conn_set_read_budget(tmq_tcp_conn_t* conn, size_t budget);
+/* receive into a mirrored ring buffer(see tmq_buffer_init_ring), must be called before anything is read.
+ * returns -1 and keeps the chunked buffer if the ring can't be mapped */
+int tmq_tcp_conn_set_ring_input(tmq_tcp_conn_t* conn, size_t size);
+/* stop watching the socket for input, the peer is throttled by tcp flow control until reading is resumed */
+void tmq_tcp_conn_pause_reading(tmq_tcp_conn_t* conn);
+void tmq_tcp_conn_resume_reading(tmq_tcp_conn_t* conn);
+/* release what an idle connection holds for reading and writing, it's allocated again when needed */
+void tmq_tcp_conn_compact(tmq_tcp_conn_t* conn);
+/* heap bytes held by the connection itself, not counting its context */
+size_t tmq_tcp_conn_memory(tmq_tcp_conn_t* conn);
 int tmq_tcp_conn_id(tmq_tcp_conn_t* conn, char* buf, size_t buf_size);
 void tmq_tcp_conn_set_context(tmq_tcp_conn_t* conn, void* ctx, context_cleanup_cb cleanup_cb);
 void tmq_tcp_conn_free(tmq_tcp_conn_t* conn);
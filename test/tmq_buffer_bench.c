@@ -0,0 +1,133 @@
+//
+// Created by zr on 23-7-25.
+//
+#include "net/mqtt_buffer.h"
+#include "base/mqtt_str.h"
+#include "event/mqtt_timer.h"
+#include "tlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+/* feeds a stream of publish packets(topics of 10-40 bytes, payloads of 16-512 bytes) into a buffer
+ * in read-sized slices and decodes them the way the codec does, for both the chunked and the ring buffer.
+ * usage: tmq_buffer_bench [packets] [read size] */
+
+#define MAX_PACKET_LEN  1024
+
+static size_t build_stream(char* stream, int packets)
+{
+    size_t len = 0;
+    for(int i = 0; i < packets; i++)
+    {
+        char topic[64];
+        int topic_len = snprintf(topic, sizeof(topic), "sensor/%d/%.*s", i % 1000, rand() % 30, "temperature_and_humidity_level");
+        int payload_len = 16 + rand() % 497;
+        uint32_t remain = 2 + topic_len + payload_len;
+        stream[len++] = 0x30;
+        do
+        {
+            uint8_t byte = remain % 128;
+            remain /= 128;
+            stream[len++] = (char) (remain ? byte | 0x80 : byte);
+        } while(remain);
+        uint16_t be_len = htobe16(topic_len);
+        memcpy(stream + len, &be_len, 2);
+        memcpy(stream + len + 2, topic, topic_len);
+        memset(stream + len + 2 + topic_len, 'x', payload_len);
+        len += 2 + topic_len + payload_len;
+    }
+    return len;
+}
+
+/* returns the number of packets decoded, incomplete packets are left in the buffer */
+static int decode(tmq_buffer_t* buffer, uint64_t* checksum)
+{
+    int decoded = 0;
+    while(buffer->readable_bytes >= 2)
+    {
+        char header[5];
+        size_t n = tmq_buffer_peek(buffer, header, min(buffer->readable_bytes, sizeof(header)));
+        uint32_t remain = 0, multiplier = 1;
+        size_t i = 1;
+        for(; i < n; i++)
+        {
+            remain += (header[i] & 0x7F) * multiplier;
+            multiplier *= 128;
+            if(!(header[i] & 0x80))
+                break;
+        }
+        if(i == n || buffer->readable_bytes < i + 1 + remain)
+            break;
+        tmq_buffer_remove(buffer, i + 1);
+
+        uint16_t topic_len;
+        tmq_str_t topic, payload;
+        const char* body = tmq_buffer_contiguous(buffer, remain);
+        if(body)
+        {
+            memcpy(&topic_len, body, 2);
+            topic_len = be16toh(topic_len);
+            topic = tmq_str_new_len(body + 2, topic_len);
+            payload = tmq_str_new_len(body + 2 + topic_len, remain - 2 - topic_len);
+            tmq_buffer_remove(buffer, remain);
+        }
+        else
+        {
+            tmq_buffer_read16(buffer, &topic_len);
+            topic = tmq_str_new_len(NULL, topic_len);
+            tmq_buffer_read(buffer, topic, topic_len);
+            payload = tmq_str_new_len(NULL, remain - 2 - topic_len);
+            tmq_buffer_read(buffer, payload, remain - 2 - topic_len);
+        }
+        *checksum += tmq_str_len(topic) + (uint8_t) payload[0];
+        tmq_str_free(topic);
+        tmq_str_free(payload);
+        decoded++;
+    }
+    return decoded;
+}
+
+static void run(const char* name, tmq_buffer_t* buffer, const char* stream, size_t len, size_t read_size)
+{
+    uint64_t checksum = 0;
+    int decoded = 0;
+    int64_t start = time_now();
+    for(size_t off = 0; off < len; off += read_size)
+    {
+        tmq_buffer_append(buffer, stream + off, min(read_size, len - off));
+        decoded += decode(buffer, &checksum);
+    }
+    double elapsed = (double) (time_now() - start) / 1000000;
+    printf("%-8s %d packets, %.0f packets/s, %.1f MB/s (checksum %lu)\n",
+           name, decoded, decoded / elapsed, len / elapsed / 1024 / 1024, checksum);
+}
+
+int main(int argc, char* argv[])
+{
+    tlog_init("broker.log", 1024 * 1024, 10, 0, TLOG_SCREEN);
+    int packets = argc > 1 ? atoi(argv[1]) : 2000000;
+    size_t read_size = argc > 2 ? atol(argv[2]) : 4096;
+
+    srand(1);
+    char* stream = malloc((size_t) packets * MAX_PACKET_LEN);
+    size_t len = build_stream(stream, packets);
+
+    tmq_buffer_t chunked, ring;
+    tmq_buffer_init(&chunked);
+    tmq_buffer_init(&ring);
+    if(tmq_buffer_init_ring(&ring, read_size * 2) < 0)
+    {
+        printf("can't map the ring buffer\n");
+        return 1;
+    }
+    run("chunked", &chunked, stream, len, read_size);
+    run("ring", &ring, stream, len, read_size);
+
+    tmq_buffer_free(&chunked);
+    tmq_buffer_free(&ring);
+    free(stream);
+    tlog_exit();
+    return 0;
+}
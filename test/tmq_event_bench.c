@@ -0,0 +1,87 @@
+//
+// Created by zr on 23-7-23.
+//
+#include "event/mqtt_event.h"
+#include "tlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+/* registers nfds eventfds on a loop and keeps nactive of them readable,
+ * then reports how many events per second the loop dispatches.
+ * usage: tmq_event_bench [nfds] [nactive] [seconds] [epoll|io_uring] */
+
+static uint64_t dispatched;
+
+static void on_event(tmq_socket_t fd, uint32_t events, void* arg)
+{
+    dispatched++;
+}
+
+static void quit(void* arg)
+{
+    tmq_event_loop_quit(arg);
+}
+
+int main(int argc, char* argv[])
+{
+    tlog_init("broker.log", 1024 * 1024, 10, 0, TLOG_SCREEN);
+    long nfds = argc > 1 ? atol(argv[1]) : 100000;
+    long nactive = argc > 2 ? atol(argv[2]) : 1000;
+    int seconds = argc > 3 ? atoi(argv[3]) : 2;
+    int use_uring = argc > 4 && !strcmp(argv[4], "io_uring");
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if(limit.rlim_cur < (rlim_t) nfds + 64)
+    {
+        limit.rlim_cur = limit.rlim_max < (rlim_t) nfds + 64 ? limit.rlim_max : (rlim_t) nfds + 64;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if(limit.rlim_cur < (rlim_t) nfds + 64)
+    {
+        nfds = (long) limit.rlim_cur - 64;
+        printf("fd limit is %lu, using %ld fds\n", (unsigned long) limit.rlim_cur, nfds);
+    }
+    if(nactive > nfds)
+        nactive = nfds;
+
+    tmq_event_loop_t loop;
+    if(!use_uring)
+        tmq_event_loop_init(&loop);
+    else if(tmq_event_loop_init_uring(&loop) < 0)
+        printf("io_uring isn't available, using epoll\n");
+    int* fds = malloc(sizeof(int) * nfds);
+    for(long i = 0; i < nfds; i++)
+    {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(fds[i] < 0)
+        {
+            perror("eventfd");
+            return 1;
+        }
+        tmq_handler_register(&loop, tmq_event_handler_new(fds[i], EPOLLIN, on_event, NULL));
+    }
+    /* spread the readable fds over the whole range, they are never read so they stay ready */
+    uint64_t one = 1;
+    for(long i = 0; i < nactive; i++)
+        write(fds[i * (nfds / nactive)], &one, sizeof(one));
+
+    tmq_event_loop_add_timer(&loop, tmq_timer_new(seconds * 1000, 0, quit, &loop));
+    int64_t start = time_now();
+    tmq_event_loop_run(&loop);
+    double elapsed = (double) (time_now() - start) / 1000000;
+
+    printf("%ld fds registered, %ld ready: %lu events in %.2fs, %.0f events/s\n",
+           nfds, nactive, dispatched, elapsed, dispatched / elapsed);
+
+    tmq_event_loop_destroy(&loop);
+    for(long i = 0; i < nfds; i++)
+        close(fds[i]);
+    free(fds);
+    tlog_exit();
+    return 0;
+}
@@ -0,0 +1,301 @@
+//
+// Created by zr on 23-7-20.
+//
+#include "mqtt/mqtt_broker.h"
+#include "base/mqtt_util.h"
+#include "tlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/* every publish goes through fan-out, a persistent subscriber is closed and resumed while
+ * the io groups still have messages queued to it, and clean subscribers keep coming and going
+ * so that their sessions are freed while they are still referenced by fan-out requests */
+
+#define TEST_PORT 18839
+#define TEST_TOPIC "fanout/test"
+#define MESSAGES_NUM 10000
+#define CHURN_CLIENTS 4
+#define IDLE_CLIENTS 200
+
+static int publisher_done;
+static uint8_t received[MESSAGES_NUM];
+
+static void* broker_thread(void* arg)
+{
+    tmq_broker_t* broker = arg;
+    tmq_broker_run(broker);
+    return NULL;
+}
+
+static void write_file(const char* path, const char* content)
+{
+    FILE* fp = fopen(path, "w");
+    if(!fp) fatal_error("fopen() error: %s", path);
+    fputs(content, fp);
+    fclose(fp);
+}
+
+static void send_all(int fd, const uint8_t* buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static int recv_all(int fd, uint8_t* buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = recv(fd, buf, len, 0);
+        if(n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void send_packet(int fd, uint8_t header, const uint8_t* body, size_t len)
+{
+    uint8_t buf[1024];
+    size_t pos = 0;
+    buf[pos++] = header;
+    size_t remain = len;
+    do
+    {
+        uint8_t byte = remain % 128;
+        remain /= 128;
+        buf[pos++] = remain ? byte | 0x80 : byte;
+    } while(remain);
+    if(len) memcpy(buf + pos, body, len);
+    send_all(fd, buf, pos + len);
+}
+
+/* returns the packet type or -1 on error or timeout */
+static int recv_packet(int fd, uint8_t* header, uint8_t* body, size_t* len)
+{
+    if(recv_all(fd, header, 1) < 0)
+        return -1;
+    size_t remain = 0, multiplier = 1;
+    uint8_t byte;
+    do
+    {
+        if(recv_all(fd, &byte, 1) < 0)
+            return -1;
+        remain += (byte & 0x7F) * multiplier;
+        multiplier *= 128;
+    } while(byte & 0x80);
+    if(remain > 1024 || recv_all(fd, body, remain) < 0)
+        return -1;
+    *len = remain;
+    return *header >> 4;
+}
+
+static size_t put_string(uint8_t* buf, const char* s)
+{
+    size_t len = strlen(s);
+    buf[0] = len >> 8;
+    buf[1] = len & 0xFF;
+    memcpy(buf + 2, s, len);
+    return len + 2;
+}
+
+static int mqtt_connect(const char* client_id, int clean_session)
+{
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(TEST_PORT),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    uint8_t body[256], header, resp[256];
+    size_t pos = put_string(body, "MQTT"), len;
+    body[pos++] = 4;
+    body[pos++] = clean_session ? 0x02 : 0;
+    body[pos++] = 0;
+    body[pos++] = 60;
+    pos += put_string(body + pos, client_id);
+    /* the broker may not be listening yet, or not aware that the last connection of this client is closed */
+    for(int i = 0; i < 50; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct timeval timeout = {.tv_sec = 5};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+        {
+            send_packet(fd, 0x10, body, pos);
+            if(recv_packet(fd, &header, resp, &len) == 2 && resp[1] == 0)
+                return fd;
+        }
+        close(fd);
+        usleep(100 * 1000);
+    }
+    fatal_error("%s: connect failed", client_id);
+}
+
+static void mqtt_subscribe(int fd, const char* topic_filter, uint8_t qos)
+{
+    uint8_t body[256], header, resp[256];
+    size_t pos = 0, len;
+    body[pos++] = 0;
+    body[pos++] = 1;
+    pos += put_string(body + pos, topic_filter);
+    body[pos++] = qos;
+    send_packet(fd, 0x82, body, pos);
+    if(recv_packet(fd, &header, resp, &len) != 9 || resp[2] == 0x80)
+        fatal_error("subscribe failed");
+}
+
+static void mqtt_disconnect(int fd)
+{
+    send_packet(fd, 0xE0, NULL, 0);
+    close(fd);
+}
+
+/* receive messages until the one with seq `until` shows up, returns the newest seq received */
+static int receive_messages(int fd, int until, int* next, int* out_of_order)
+{
+    uint8_t header, body[1024];
+    size_t len;
+    while(*next <= until)
+    {
+        if(recv_packet(fd, &header, body, &len) != 3)
+            break;
+        size_t topic_len = (body[0] << 8) | body[1];
+        size_t pos = 2 + topic_len;
+        uint8_t qos = (header >> 1) & 3;
+        if(qos > 0)
+        {
+            uint8_t ack[2] = {body[pos], body[pos + 1]};
+            send_packet(fd, 0x40, ack, 2);
+            pos += 2;
+        }
+        char payload[32] = {0};
+        memcpy(payload, body + pos, len - pos < 31 ? len - pos : 31);
+        int seq = atoi(payload);
+        if(seq < 0 || seq >= MESSAGES_NUM)
+            continue;
+        /* qos 1 messages in flight are sent again after the session is resumed,
+         * but a message received for the first time must not be older than the others */
+        if(!received[seq] && seq < *next)
+            (*out_of_order)++;
+        received[seq] = 1;
+        if(seq >= *next)
+            *next = seq + 1;
+    }
+    return *next - 1;
+}
+
+static void* publisher_thread(void* arg)
+{
+    int fd = mqtt_connect("fanout_test_pub", 1);
+    uint8_t body[256], acks[1024];
+    size_t acked = 0;
+    for(int i = 0; i < MESSAGES_NUM; i++)
+    {
+        size_t pos = put_string(body, TEST_TOPIC);
+        body[pos++] = (i + 1) >> 8;
+        body[pos++] = (i + 1) & 0xFF;
+        pos += sprintf((char*) body + pos, "%d", i);
+        send_packet(fd, 0x32, body, pos);
+        /* only 4-byte PUBACKs are sent to the publisher */
+        ssize_t n;
+        while((n = recv(fd, acks, sizeof(acks), MSG_DONTWAIT)) > 0)
+            acked += n;
+        /* slow enough to be still publishing while the subscriber is closed and resumed */
+        if(i % 2 == 0)
+            usleep(1000);
+    }
+    /* the messages not read by the broker yet are discarded once the connection is closed */
+    ssize_t n;
+    while(acked < MESSAGES_NUM * 4 && (n = recv(fd, acks, sizeof(acks), 0)) > 0)
+        acked += n;
+    mqtt_disconnect(fd);
+    atomicSet(publisher_done, 1);
+    return NULL;
+}
+
+static void* churn_thread(void* arg)
+{
+    char client_id[32];
+    sprintf(client_id, "fanout_test_churn%ld", (long) arg);
+    while(!atomicGet(publisher_done))
+    {
+        int fd = mqtt_connect(client_id, 1);
+        mqtt_subscribe(fd, TEST_TOPIC, 1);
+        uint8_t header, body[1024];
+        size_t len;
+        for(int i = 0; i < 50; i++)
+            if(recv_packet(fd, &header, body, &len) < 0)
+                break;
+        /* leave without acknowledging anything */
+        close(fd);
+    }
+    return NULL;
+}
+
+int main()
+{
+    tlog_init("broker.log", 1024 * 1024, 10, 0, 0);
+    char conf[256];
+    sprintf(conf, "port=%d\n"
+                  "password_file=fanout_test.pwd\n"
+                  "allow_anonymous=true\n"
+                  "fanout_threshold=1\n"
+                  "inflight_window=8\n", TEST_PORT);
+    write_file("fanout_test.conf", conf);
+    write_file("fanout_test.pwd", "");
+
+    tmq_broker_t broker;
+    if(tmq_broker_init(&broker, "fanout_test.conf") != 0)
+        return 1;
+    pthread_t broker_tid, publisher_tid, churn_tids[CHURN_CLIENTS];
+    pthread_create(&broker_tid, NULL, broker_thread, &broker);
+
+    /* subscribers that never read keep the io groups busy with fan-out requests */
+    for(int i = 0; i < IDLE_CLIENTS; i++)
+    {
+        char client_id[32];
+        sprintf(client_id, "fanout_test_idle%d", i);
+        mqtt_subscribe(mqtt_connect(client_id, 1), TEST_TOPIC, 1);
+    }
+    int fd = mqtt_connect("fanout_test_sub", 0);
+    mqtt_subscribe(fd, TEST_TOPIC, 1);
+    for(long i = 0; i < CHURN_CLIENTS; i++)
+        pthread_create(&churn_tids[i], NULL, churn_thread, (void*) i);
+    pthread_create(&publisher_tid, NULL, publisher_thread, NULL);
+
+    int next = 0, out_of_order = 0;
+    for(int round = 1; round < 4; round++)
+    {
+        if(receive_messages(fd, MESSAGES_NUM * round / 4, &next, &out_of_order) < MESSAGES_NUM * round / 4)
+            break;
+        /* the session is closed while messages are still queued to it */
+        if(round % 2)
+            mqtt_disconnect(fd);
+        else
+            close(fd);
+        usleep(20 * 1000);
+        fd = mqtt_connect("fanout_test_sub", 0);
+    }
+    receive_messages(fd, MESSAGES_NUM - 1, &next, &out_of_order);
+    mqtt_disconnect(fd);
+    pthread_join(publisher_tid, NULL);
+    for(int i = 0; i < CHURN_CLIENTS; i++)
+        pthread_join(churn_tids[i], NULL);
+
+    int missing = 0;
+    for(int i = 0; i < MESSAGES_NUM; i++)
+        missing += !received[i];
+    printf("received %d of %d messages, %d out of order\n", MESSAGES_NUM - missing, MESSAGES_NUM, out_of_order);
+    tmq_event_loop_quit(&broker.loop);
+    pthread_join(broker_tid, NULL);
+    tlog_exit();
+    return !missing && !out_of_order ? 0 : 1;
+}
\ No newline at end of file
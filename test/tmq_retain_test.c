@@ -0,0 +1,66 @@
+//
+// Created by zr on 23-7-2.
+//
+#include "mqtt/mqtt_retain.h"
+#include <stdio.h>
+
+int print_retain(void* arg, retain_message_t* retain_msg)
+{
+    int* budget = arg;
+    if(*budget == 0)
+        return 1;
+    (*budget)--;
+    printf("%s => (%s, qos=%u)\n", retain_msg->retain_topic, retain_msg->retain_msg.message, retain_msg->retain_msg.qos);
+    return 0;
+}
+
+void scan_all(tmq_retain_store_t* store, char* topic_filter, int batch)
+{
+    printf("---------- %s ----------\n", topic_filter);
+    tmq_retain_cursor_t cursor;
+    tmq_retain_cursor_init(&cursor, topic_filter);
+    while(!cursor.done)
+    {
+        int budget = batch;
+        tmq_retain_store_scan(store, &cursor, RETAIN_SCAN_BATCH, print_retain, &budget);
+        printf("-- batch end\n");
+    }
+    tmq_retain_cursor_destroy(&cursor);
+}
+
+int main()
+{
+    tmq_retain_store_t store;
+    tmq_retain_store_init(&store);
+
+    char* topics[] = {"test/topic", "test/topic/1", "test/topic/2", "test/topic/1/1",
+                      "test/topic2", "test", "other/topic", "test//empty"};
+    for(int i = 0; i < sizeof(topics) / sizeof(char*); i++)
+    {
+        tmq_message message = {
+                .message = tmq_str_new(topics[i]),
+                .qos = i % 3
+        };
+        tmq_retain_store_put(&store, topics[i], &message);
+        tmq_str_free(message.message);
+    }
+    /* an empty message clears the retained message */
+    tmq_message empty = {.message = tmq_str_empty(), .qos = 0};
+    tmq_retain_store_put(&store, "test/topic2", &empty);
+    tmq_str_free(empty.message);
+    printf("retained messages: %lu\n", tmq_retain_store_size(&store));
+
+    scan_all(&store, "test/#", 2);
+    scan_all(&store, "test/topic/+", 1);
+    scan_all(&store, "+/topic", 10);
+    scan_all(&store, "test/+/empty", 10);
+    scan_all(&store, "test/topic/1", 10);
+    scan_all(&store, "#", 100);
+
+    printf("match(a/+/c, a/b/c)=%d\n", tmq_topic_filter_match("a/+/c", "a/b/c"));
+    printf("match(a/#, a)=%d\n", tmq_topic_filter_match("a/#", "a"));
+    printf("match(a/+, a)=%d\n", tmq_topic_filter_match("a/+", "a"));
+    printf("match(a/b, a/bc)=%d\n", tmq_topic_filter_match("a/b", "a/bc"));
+
+    tmq_retain_store_destroy(&store);
+}
@@ -4,22 +4,35 @@
 #include "mqtt/mqtt_topic.h"
 #include <stdio.h>
 
-void on_match(tmq_broker_t* broker, char* client_id,
-              char* topic, uint8_t required_qos, tmq_message* message)
+/* subscribers are the client id strings themselves */
+void on_match(tmq_broker_t* broker, void* subscriber,
+              tmq_interned_topic_t* topic, uint8_t required_qos, tmq_message* messages, size_t n)
 {
-    printf("(%s) => <%s, %u>\n", message->message, client_id, required_qos);
+    for(size_t i = 0; i < n; i++)
+        printf("(%s#%u: %s) => <%s, %u>\n", topic->name, topic->id, messages[i].message, (char*) subscriber, required_qos);
 }
 
+const char* subscriber_name(void* subscriber) {return subscriber;}
+
 int main()
 {
     tmq_topics_t topics;
-    tmq_topics_init(&topics, NULL, on_match);
+    tmq_topics_init(&topics, NULL, on_match, subscriber_name);
+    /* keep two copies of the tree so tmq_topics_reader_publish() can be used */
+    tmq_topics_enable_concurrent_readers(&topics);
 
-    tmq_topics_add_subscription(&topics, "test/topic/+/1", "client1", 0);
-    tmq_topics_add_subscription(&topics, "test/topic/1/+", "client2", 0);
-    tmq_topics_add_subscription(&topics, "test/topic", "client3", 0);
-    tmq_topics_add_subscription(&topics, "test/topic", "client5", 1);
-    tmq_topics_add_subscription(&topics, "test/#", "client4", 0);
+    tmq_topics_add_subscription(&topics, "test/topic/+/1", "client1", 0, NULL);
+    tmq_topics_add_subscription(&topics, "test/topic/1/+", "client2", 0, NULL);
+    tmq_topics_add_subscription(&topics, "test/topic", "client3", 0, NULL);
+    tmq_topics_add_subscription(&topics, "test/topic", "client5", 1, NULL);
+    tmq_topics_add_subscription(&topics, "test/#", "client4", 0, NULL);
+    /* chains of single-child levels are compressed into one node */
+    tmq_topics_add_subscription(&topics, "site/1/floor/4/room/17/sensor/temp", "client9", 1, NULL);
+    tmq_topics_add_subscription(&topics, "site/1/floor/4/room/18/sensor/temp", "client10", 1, NULL);
+    tmq_topics_add_subscription(&topics, "site/1/floor/4/room/+/sensor/temp", "client11", 1, NULL);
+    tmq_topics_add_subscription(&topics, "$share/group1/test/+", "client6", 1, NULL);
+    tmq_topics_add_subscription(&topics, "$share/group1/test/+", "client7", 1, NULL);
+    tmq_topics_add_subscription(&topics, "$share/group2/test/+", "client8", 0, NULL);
 
 
     tmq_message message = {
@@ -27,5 +40,53 @@ int main()
             .qos = 1
     };
     tmq_topics_publish(&topics, 0, "test/topic", &message, 1);
+    /* group1 members take turns */
+    tmq_topics_publish(&topics, 0, "test/topic", &message, 0);
+    tmq_topics_reader_publish(&topics, "site/1/floor/4/room/17/sensor/temp", &message, 0);
+    tmq_topics_info(&topics);
+
+    tmq_topics_remove_subscription(&topics, "$share/group1/test/+", "client6");
+    tmq_topics_remove_subscription(&topics, "$share/group2/test/+", "client8");
+    tmq_topics_remove_subscription(&topics, "site/1/floor/4/room/+/sensor/temp", "client11");
+    tmq_topics_remove_subscription(&topics, "site/1/floor/4/room/18/sensor/temp", "client10");
+    tmq_topics_info(&topics);
+
+    /* subscriptions kept by the subscriber are removed without searching the tree */
+    topic_subscription_map subscriptions;
+    tmq_map_str_init(&subscriptions, topic_subscription_t, MAP_DEFAULT_CAP, MAP_DEFAULT_LOAD_FACTOR);
+    char* filters[] = {"test/topic/+/1", "test/topic/1/+", "$share/group1/test/+"};
+    for(int i = 0; i < 3; i++)
+    {
+        topic_subscription_t sub;
+        tmq_topics_add_subscription(&topics, filters[i], "client12", 1, &sub);
+        tmq_map_put(subscriptions, filters[i], sub);
+    }
+    tmq_topics_drop_subscription(&topics, "client12", tmq_map_get(subscriptions, "test/topic/1/+"));
+    tmq_map_erase(subscriptions, "test/topic/1/+");
+    tmq_topics_publish(&topics, 0, "test/topic/1/1", &message, 0);
+    tmq_topics_drop_all_subscriptions(&topics, "client12", &subscriptions);
+    tmq_map_free(subscriptions);
     tmq_topics_info(&topics);
+
+    /* messages of the same topic are matched once and delivered together */
+    tmq_message batch[3];
+    for(int i = 0; i < 3; i++)
+    {
+        batch[i].message = tmq_str_new("batched");
+        batch[i].qos = i % 3;
+    }
+    tmq_topics_publish_batch(&topics, 0, "test/topic", batch, 3);
+    for(int i = 0; i < 3; i++)
+        tmq_str_free(batch[i].message);
+
+    printf("may match: test/topic=%d, other/topic=%d\n", tmq_topics_may_match(&topics, "test/topic"),
+           tmq_topics_may_match(&topics, "other/topic"));
+
+    /* a topic keeps its id while it is referenced */
+    tmq_interned_topic_t* t1 = tmq_intern_topic(&topics.topic_table, "test/topic/1/1");
+    tmq_interned_topic_t* t2 = tmq_intern_topic(&topics.topic_table, "test/topic/1/1");
+    printf("same topic, same entry: %d, id=%u\n", t1 == t2, t1->id);
+    tmq_interned_topic_put(t1);
+    tmq_interned_topic_put(t2);
+    printf("evicted %lu interned topics\n", tmq_intern_table_evict(&topics.topic_table, 0));
 }
\ No newline at end of file